@@ -0,0 +1,349 @@
+//  Merges vocab shards written by bivec -vocab-shard 1 (or by this tool with -shard-output) into
+//  one vocab that bivec trains from directly.
+//
+//  A shard is a vocab file with a "#bivec-vocab train_words <tokens> pruned <threshold>" header,
+//  </s> first and the other words in strcmp order with their raw counts and their rank in order of
+//  first occurrence in the shard. The shards are read in parallel, the word range is split at words
+//  of the largest shard, and each thread k-way merges its range of all shards, so the merged words
+//  come out in strcmp order with summed counts. min_count is applied only then: the output vocab
+//  keeps the words with at least min_count occurrences (</s> always, <unk> is added like bivec
+//  does), most frequent first. Words with equal counts keep the order of their first occurrence in
+//  the shards as given, in corpus order, which is the order bivec's own vocab sort keeps, so the
+//  merged vocab lists the words with the same ids as a vocab learned from the whole corpus.
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <pthread.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/stat.h>
+
+#define MAX_STRING 1000
+#define VOCAB_HEADER "#bivec-vocab"
+
+struct vocab_entry {
+  const char *word; // NUL-terminated copy in the shard's buffer
+  long long cn;
+  int shard; // first occurrence: the first shard (in argument order) with the word and its rank there
+  long long first;
+};
+
+struct vocab_shard {
+  char *file_name;
+  int index; // argument order
+  char *text; // file contents, words are cut out of it in place
+  struct vocab_entry *entries; // entries[0] is </s>
+  long long num_entries, train_words, pruned;
+};
+
+struct merge_range {
+  struct vocab_shard *shards;
+  int num_shards;
+  const char *lo, *hi; // words w with lo <= w < hi; NULL is open
+  struct vocab_entry *merged;
+  long long num_merged;
+};
+
+static const char unk_word[] = "<unk>";
+int num_threads = 4;
+long long min_count = 5;
+
+int ArgPos(char *str, int argc, char **argv) {
+  int a;
+  for (a = 1; a < argc; a++) if (!strcmp(str, argv[a])) {
+    if (a == argc - 1) {
+      printf("Argument missing for %s\n", str);
+      exit(1);
+    }
+    return a;
+  }
+  return -1;
+}
+
+// Reads and parses one shard; the lines are checked to be in strcmp order. A shard without the
+// first occurrence ranks (written before they were added) ranks its words in strcmp order.
+void *ReadShardThread(void *arg) {
+  struct vocab_shard *shard = (struct vocab_shard *)arg;
+  struct stat st;
+  long long max_entries = 1024;
+  char *pos, *end, *word;
+  int n, fd = open(shard->file_name, O_RDONLY);
+
+  if (fd < 0 || fstat(fd, &st) != 0) {
+    printf("ERROR: can't read %s\n", shard->file_name);
+    exit(1);
+  }
+  shard->text = (char *)malloc(st.st_size + 1);
+  if (shard->text == NULL || read(fd, shard->text, st.st_size) != st.st_size) {
+    printf("ERROR: can't read %s\n", shard->file_name);
+    exit(1);
+  }
+  close(fd);
+  shard->text[st.st_size] = 0;
+  if (sscanf(shard->text, VOCAB_HEADER " train_words %lld pruned %lld%n", &shard->train_words, &shard->pruned, &n) != 2) {
+    printf("ERROR: %s is not a vocab shard (no %s header)\n", shard->file_name, VOCAB_HEADER);
+    exit(1);
+  }
+  shard->entries = (struct vocab_entry *)malloc(max_entries * sizeof(struct vocab_entry));
+  pos = shard->text + n;
+  end = shard->text + st.st_size;
+  while (1) {
+    while (pos < end && (*pos == '\n' || *pos == ' ' || *pos == '\t' || *pos == '\r')) pos++;
+    if (pos >= end) break;
+    word = pos;
+    while (pos < end && *pos != ' ' && *pos != '\t' && *pos != '\n') pos++;
+    if (pos >= end || *pos == '\n') {
+      printf("ERROR: %s: no count for %.*s\n", shard->file_name, (int)(pos - word), word);
+      exit(1);
+    }
+    *pos++ = 0;
+    if (shard->num_entries == max_entries) {
+      max_entries *= 2;
+      shard->entries = (struct vocab_entry *)realloc(shard->entries, max_entries * sizeof(struct vocab_entry));
+    }
+    shard->entries[shard->num_entries].word = word;
+    shard->entries[shard->num_entries].cn = strtoll(pos, &pos, 10);
+    shard->entries[shard->num_entries].shard = shard->index;
+    while (pos < end && (*pos == ' ' || *pos == '\t')) pos++;
+    if (pos < end && *pos >= '0' && *pos <= '9') shard->entries[shard->num_entries].first = strtoll(pos, &pos, 10);
+    else shard->entries[shard->num_entries].first = shard->num_entries;
+    if (shard->num_entries == 0 ? strcmp(word, "</s>") != 0
+        : shard->num_entries > 1 && strcmp(shard->entries[shard->num_entries - 1].word, word) >= 0) {
+      printf("ERROR: %s is not a vocab shard (%s out of order)\n", shard->file_name, word);
+      exit(1);
+    }
+    shard->num_entries++;
+  }
+  if (shard->num_entries == 0) {
+    printf("ERROR: %s has no </s>\n", shard->file_name);
+    exit(1);
+  }
+  return NULL;
+}
+
+// First entry of shard (after </s>) whose word is >= word, num_entries if none
+long long LowerBound(struct vocab_shard *shard, const char *word) {
+  long long lo = 1, hi = shard->num_entries, mid;
+  if (word == NULL) return shard->num_entries;
+  while (lo < hi) {
+    mid = (lo + hi) / 2;
+    if (strcmp(shard->entries[mid].word, word) < 0) lo = mid + 1;
+    else hi = mid;
+  }
+  return lo;
+}
+
+// Order of first occurrence in the concatenated shards
+int FirstCompare(const void *a, const void *b) {
+  const struct vocab_entry *x = (const struct vocab_entry *)a, *y = (const struct vocab_entry *)b;
+  if (x->shard != y->shard) return x->shard < y->shard ? -1 : 1;
+  if (x->first != y->first) return x->first < y->first ? -1 : 1;
+  return 0;
+}
+
+// Heap of shard cursors ordered by their current word
+static void SiftDown(int *heap, int size, long long *cur, struct vocab_shard *shards, int i) {
+  int child, tmp;
+  while ((child = 2 * i + 1) < size) {
+    if (child + 1 < size && strcmp(shards[heap[child + 1]].entries[cur[heap[child + 1]]].word,
+                                   shards[heap[child]].entries[cur[heap[child]]].word) < 0) child++;
+    if (strcmp(shards[heap[child]].entries[cur[heap[child]]].word, shards[heap[i]].entries[cur[heap[i]]].word) >= 0) break;
+    tmp = heap[i];
+    heap[i] = heap[child];
+    heap[child] = tmp;
+    i = child;
+  }
+}
+
+void *MergeRangeThread(void *arg) {
+  struct merge_range *range = (struct merge_range *)arg;
+  struct vocab_shard *shards = range->shards;
+  long long *cur = (long long *)malloc(range->num_shards * sizeof(long long));
+  long long *stop = (long long *)malloc(range->num_shards * sizeof(long long));
+  long long max_merged = 1024, total = 0;
+  int *heap = (int *)malloc(range->num_shards * sizeof(int));
+  int s, size = 0;
+
+  for (s = 0; s < range->num_shards; s++) {
+    cur[s] = range->lo == NULL ? 1 : LowerBound(&shards[s], range->lo);
+    stop[s] = LowerBound(&shards[s], range->hi);
+    total += stop[s] - cur[s];
+    if (cur[s] < stop[s]) heap[size++] = s;
+  }
+  if (total < max_merged) max_merged = total + 1;
+  range->merged = (struct vocab_entry *)malloc(max_merged * sizeof(struct vocab_entry));
+  for (s = size / 2 - 1; s >= 0; s--) SiftDown(heap, size, cur, shards, s);
+  while (size > 0) {
+    s = heap[0];
+    if (range->num_merged > 0 && !strcmp(range->merged[range->num_merged - 1].word, shards[s].entries[cur[s]].word)) {
+      range->merged[range->num_merged - 1].cn += shards[s].entries[cur[s]].cn;
+      if (FirstCompare(&shards[s].entries[cur[s]], &range->merged[range->num_merged - 1]) < 0) {
+        range->merged[range->num_merged - 1].shard = shards[s].entries[cur[s]].shard;
+        range->merged[range->num_merged - 1].first = shards[s].entries[cur[s]].first;
+      }
+    } else {
+      if (range->num_merged == max_merged) {
+        max_merged *= 2;
+        range->merged = (struct vocab_entry *)realloc(range->merged, max_merged * sizeof(struct vocab_entry));
+      }
+      range->merged[range->num_merged++] = shards[s].entries[cur[s]];
+    }
+    if (++cur[s] == stop[s]) heap[0] = heap[--size];
+    SiftDown(heap, size, cur, shards, 0);
+  }
+  free(heap);
+  free(stop);
+  free(cur);
+  return NULL;
+}
+
+// Most frequent first, ties in order of first occurrence
+int CountCompare(const void *a, const void *b) {
+  const struct vocab_entry *x = (const struct vocab_entry *)a, *y = (const struct vocab_entry *)b;
+  if (x->cn != y->cn) return x->cn < y->cn ? 1 : -1;
+  return FirstCompare(a, b);
+}
+
+// A shard (with_first) also gets the first occurrence ranks, renumbered over all its words
+void WriteVocab(const char *file_name, struct vocab_entry *entries, long long n, long long train_words, long long pruned, int with_first) {
+  long long a, *rank = NULL;
+  struct vocab_entry *order;
+  FILE *fo = fopen(file_name, "wb");
+  if (fo == NULL) {
+    printf("ERROR: can't write %s\n", file_name);
+    exit(1);
+  }
+  if (with_first) {
+    order = (struct vocab_entry *)malloc(n * sizeof(struct vocab_entry));
+    rank = (long long *)malloc(n * sizeof(long long));
+    for (a = 0; a < n; a++) {
+      order[a] = entries[a];
+      order[a].cn = a; // back to the entry after sorting
+    }
+    qsort(order, n, sizeof(struct vocab_entry), FirstCompare);
+    for (a = 0; a < n; a++) rank[order[a].cn] = a;
+    free(order);
+  }
+  fprintf(fo, "%s train_words %lld pruned %lld\n", VOCAB_HEADER, train_words, pruned);
+  for (a = 0; a < n; a++) {
+    if (with_first) fprintf(fo, "%s %lld %lld\n", entries[a].word, entries[a].cn, rank[a]);
+    else fprintf(fo, "%s %lld\n", entries[a].word, entries[a].cn);
+  }
+  fclose(fo);
+  free(rank);
+}
+
+int main(int argc, char **argv) {
+  char output_file[MAX_STRING], shard_output_file[MAX_STRING];
+  struct vocab_shard *shards;
+  struct merge_range *ranges;
+  struct vocab_entry *merged, *vocab;
+  pthread_t *pt;
+  long long a, b, num_merged = 0, vocab_size, train_words = 0, pruned = 0, eos = 0;
+  int i, s, num_shards, first_shard, largest = 0, have_unk = 0;
+
+  if (argc == 1) {
+    printf("Merges vocab shards counted by bivec -vocab-shard 1\n\n");
+    printf("Usage: ./bivec-vocab-merge [options] <shard>...\n");
+    printf("Options:\n");
+    printf("\t-output <file>\n");
+    printf("\t\tWrite the vocab to train from to <file>, e.g. data.en.vocab.min5\n");
+    printf("\t-shard-output <file>\n");
+    printf("\t\tAlso write the merged raw counts to <file> as a shard that can be merged again\n");
+    printf("\t-min-count <int>\n");
+    printf("\t\tDiscard words that appear less than <int> times in all shards together; default is 5\n");
+    printf("\t-threads <int>\n");
+    printf("\t\tUse <int> threads (default 4)\n");
+    printf("\nGive the shards in corpus order: words with equal counts are ordered by where they first occur.\n");
+    printf("\nExamples:\n");
+    printf("./bivec-vocab-merge -output data.en.vocab.min5 -min-count 5 part1.en.vocab.shard part2.en.vocab.shard\n\n");
+    return 0;
+  }
+  output_file[0] = 0;
+  shard_output_file[0] = 0;
+  if ((i = ArgPos((char *)"-output", argc, argv)) > 0) strcpy(output_file, argv[i + 1]);
+  if ((i = ArgPos((char *)"-shard-output", argc, argv)) > 0) strcpy(shard_output_file, argv[i + 1]);
+  if ((i = ArgPos((char *)"-min-count", argc, argv)) > 0) min_count = atoll(argv[i + 1]);
+  if ((i = ArgPos((char *)"-threads", argc, argv)) > 0) num_threads = atoi(argv[i + 1]);
+  if (num_threads < 1) num_threads = 1;
+  if (output_file[0] == 0 && shard_output_file[0] == 0) {
+    printf("ERROR: nothing to write, give -output or -shard-output\n");
+    exit(1);
+  }
+  // shards are the arguments that are not options or their values
+  for (first_shard = 1; first_shard < argc && argv[first_shard][0] == '-' && argv[first_shard][1] != 0; first_shard += 2);
+  num_shards = argc - first_shard;
+  if (num_shards < 1) {
+    printf("ERROR: no vocab shards given\n");
+    exit(1);
+  }
+
+  shards = (struct vocab_shard *)calloc(num_shards, sizeof(struct vocab_shard));
+  pt = (pthread_t *)malloc((num_shards > num_threads ? num_shards : num_threads) * sizeof(pthread_t));
+  for (s = 0; s < num_shards; s++) {
+    shards[s].file_name = argv[first_shard + s];
+    shards[s].index = s;
+    pthread_create(&pt[s], NULL, ReadShardThread, (void *)&shards[s]);
+  }
+  for (s = 0; s < num_shards; s++) pthread_join(pt[s], NULL);
+  for (s = 0; s < num_shards; s++) {
+    train_words += shards[s].train_words;
+    pruned += shards[s].pruned; // a word may have been dropped from every shard
+    eos += shards[s].entries[0].cn;
+    if (shards[s].num_entries > shards[largest].num_entries) largest = s;
+  }
+
+  // thread t merges the words between the t-th and (t+1)-th splitters, taken from the largest shard
+  ranges = (struct merge_range *)calloc(num_threads, sizeof(struct merge_range));
+  for (i = 0; i < num_threads; i++) {
+    ranges[i].shards = shards;
+    ranges[i].num_shards = num_shards;
+    b = 1 + (shards[largest].num_entries - 1) * i / num_threads;
+    ranges[i].lo = (i == 0 || b >= shards[largest].num_entries) ? NULL : shards[largest].entries[b].word;
+    if (i > 0) ranges[i - 1].hi = ranges[i].lo;
+  }
+  for (i = 1; i < num_threads; i++) if (ranges[i].lo == NULL) ranges[i].lo = ranges[i].hi = ""; // nothing left to split
+  for (i = 0; i < num_threads; i++) pthread_create(&pt[i], NULL, MergeRangeThread, (void *)&ranges[i]);
+  for (i = 0; i < num_threads; i++) pthread_join(pt[i], NULL);
+  for (i = 0; i < num_threads; i++) num_merged += ranges[i].num_merged;
+
+  merged = (struct vocab_entry *)malloc((num_merged + 2) * sizeof(struct vocab_entry));
+  merged[0].word = "</s>";
+  merged[0].cn = eos;
+  merged[0].shard = 0;
+  merged[0].first = 0;
+  for (i = 0, a = 1; i < num_threads; i++) {
+    memcpy(&merged[a], ranges[i].merged, ranges[i].num_merged * sizeof(struct vocab_entry));
+    a += ranges[i].num_merged;
+    free(ranges[i].merged);
+  }
+  printf("Merged %d shards: %lld words, %lld tokens\n", num_shards, num_merged + 1, train_words);
+  if (pruned >= min_count) printf("! the shards were pruned at up to %lld occurrences in total, some words with min-count %lld may be missing\n", pruned, min_count);
+  if (shard_output_file[0] != 0) WriteVocab(shard_output_file, merged, num_merged + 1, train_words, pruned, 1);
+
+  if (output_file[0] != 0) {
+    vocab = (struct vocab_entry *)malloc((num_merged + 2) * sizeof(struct vocab_entry));
+    vocab[0] = merged[0];
+    vocab_size = 1;
+    for (a = 1; a <= num_merged; a++) {
+      if (!strcmp(merged[a].word, unk_word)) have_unk = 1;
+      if (merged[a].cn >= min_count) vocab[vocab_size++] = merged[a];
+      else if (!strcmp(merged[a].word, unk_word)) { // kept like bivec keeps an added <unk>
+        vocab[vocab_size] = merged[a];
+        vocab[vocab_size++].cn = min_count;
+      }
+    }
+    if (!have_unk) { // after all words of the corpus, as bivec appends it
+      vocab[vocab_size].word = unk_word;
+      vocab[vocab_size].shard = num_shards;
+      vocab[vocab_size].first = 0;
+      vocab[vocab_size++].cn = min_count;
+    }
+    qsort(&vocab[1], vocab_size - 1, sizeof(struct vocab_entry), CountCompare);
+    WriteVocab(output_file, vocab, vocab_size, train_words, pruned, 0);
+    printf("Vocab size: %lld (min-count %lld), saved to %s\n", vocab_size, min_count, output_file);
+    free(vocab);
+  }
+  return 0;
+}
@@ -32,6 +32,14 @@
 #include <pthread.h>
 #include <unistd.h>
 #include <assert.h>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sched.h>
+#include <zlib.h>
+#include "wordhash.h"
+#include "perfecthash.h"
+#include "veckernels.h"
 
 // PATH_MAX
 #include <limits.h>
@@ -41,20 +49,40 @@
   #define MAX_STRING 1000
 #endif
 
-#define EXP_TABLE_SIZE 1000
 #define MAX_EXP 6
 #define MAX_SENT_LEN 20000
 #define MAX_WORD_PER_SENT 1000
-#define MAX_CODE_LENGTH 40
 
-const int vocab_hash_size = 30000000;  // Maximum 30 * 0.7 = 21M words in the vocabulary
+const int vocab_hash_size = 30000000;  // Maximum 30 * 0.7 = 21M words in the vocabulary while it is learned (see ReduceVocab)
 
 typedef float real;                    // Precision of float numbers
 
 struct vocab_word {
   long long cn;
-  int *point;
-  char *word, *code, codelen;
+  char *word;
+};
+
+// One step down the Huffman path of a word: the inner node (its syn1 row) shifted left by one, with
+// the code bit of the step below it
+#define CODE_STEP_POINT(step) ((long long)((step) >> 1))
+#define CODE_STEP_CODE(step) ((int)((step) & 1))
+
+// One bucket of the negative sampler: a draw that lands in bucket i yields i when its position in
+// the bucket is below threshold (a fraction of 2^32), and alias otherwise
+struct alias_entry {
+  unsigned int threshold;
+  int alias;
+};
+
+struct vocab_hash_entry {
+  unsigned int hash; // GetWordHash of the word
+  int id;            // -1 for an empty bucket
+};
+
+// Word strings of a vocabulary, packed into large chunks
+struct string_arena {
+  char **chunks;
+  long long num_chunks, used, chunk_size; // used: bytes taken in the last chunk
 };
 
 // training structure, useful when training embeddings for multiple languages
@@ -65,16 +93,38 @@ struct train_params {
   char vocab_file[MAX_STRING];
   char config_file[MAX_STRING];
   struct vocab_word *vocab;
-  int *vocab_hash;
+  struct string_arena vocab_arena;
+  struct vocab_hash_entry *vocab_hash, *vocab_hash_old; // old: the table being moved into vocab_hash while it grows
+  long long vocab_hash_cap, vocab_hash_old_cap, vocab_hash_moved; // power-of-two sizes, buckets of the old table moved
+  long long vocab_hash_size; // ReduceVocab keeps the vocab under vocab_hash_size * 0.7 words
+  struct perfect_hash vocab_mph; // over the final vocab for ReadWordIndex, empty until FreezeVocab
+  // Huffman paths: word a takes the steps code_steps[code_offset[a]..code_offset[a + 1])
+  long long *code_offset; // vocab_size + 1 entries
+  unsigned int *code_steps;
+  char *code_block; // code_offset and code_steps as built by CreateBinaryTree (NULL when mapped from vocab_file.bin)
+  int min_reduce; // ReduceVocab threshold
   long long train_words, word_count_actual, file_size;
+  long long file_words; // tokens in train_file, -1 until they are counted
+  char vocab_bin_file[MAX_STRING]; // vocab_file.bin: the loaded vocab with its codes and noise distribution
+  double *noise_prob; // noise distribution of negative sampling, vocab_size + 1 entries (the last is 0)
+
+  // train_file mapped into memory (NULL when reading through stdio)
+  struct corpus_source *train_source;
+
+  // compiled corpus: train_file as a mapped stream of word ids (NULL when training from text)
+  char compiled_file[MAX_STRING];
+  int *ids;
+  long long num_ids;
+  long long *id_blocks;
 
   // syn0: input embeddings (both hs and negative)
   // syn1: output embeddings (hs)
   // syn1neg: output embeddings (negative)
-  // table, vocab_size corresponds to the output side.
+  // noise_alias, vocab_size corresponds to the output side.
   long long vocab_max_size, vocab_size;
   real *syn0, *syn1, *syn1neg;
-  int *table;
+  unsigned short *syn0_bf16, *syn1_bf16, *syn1neg_bf16; // -bf16: the three matrices, which are then NULL as floats
+  struct alias_entry *noise_alias; // negative sampling distribution, see InitNoiseSampler
 
   // line blocks
   long long num_lines;
@@ -83,22 +133,34 @@ struct train_params {
   long long unk_id; // index of the <unk> word
 };
 
-int binary = 0, debug_mode = 2, min_count = 5, num_threads = 12, min_reduce = 1;
+int binary = 0, debug_mode = 2, min_count = 5, num_threads = 12;
 long long layer1_size = 100;
+long long layer1_stride; // elements per row of syn0/syn1/syn1neg: layer1_size padded with zeros so rows start 64-byte aligned
 long long classes = 0;
 
 clock_t start;
 char prefix[MAX_STRING];
 char output_prefix[MAX_STRING]; // output_prefix.lang: stores embeddings
 int eval_freq = 0; // evaluation frequency 
+int use_mmap = 1; // 1: threads tokenize straight from memory-mapped corpus files, 0: read through stdio
+int compile_corpus = 0; // 1: train from train_file.ids.minN, a pre-tokenized stream of word ids
+int stream_input = 0; // 1: read src/tgt/align sequentially (pipes are fine) through a distributor thread
+int prefetch = 0; // sentence pairs each training thread's helper thread loads ahead, 0: load them in the training thread
+int vocab_sketch = 0; // MB of count-min sketch used to pick vocab candidates before exact counting, 0: count every word exactly
+int vocab_shard = 0; // 1: only count the train files into mergeable train_file.vocab.shard files
 
 // cbow or skipgram
 int cbow = 1, window = 5;
 
 // hierarchical softmax or negative sampling
 int hs = 0, negative = 5;
-real *expTable;
-const int table_size = 1e8;
+int shared_negatives = 0; // 1: skip-gram draws one negative set per center word and trains its context pairs as a block
+int minibatch = 0; // 1: skip-gram trains the context words of a center word as small matrix products (ProcessSkipBatch)
+int bf16 = 0; // 1: syn0, syn1 and syn1neg are stored as bfloat16 and updated with stochastic rounding, see UpdateRow
+
+// row kernels (dot, axpy) for the widest instruction set the CPU has, capped by -simd
+int simd = 2;
+struct vec_kernels vk;
 
 // training epoch & learning rate
 int num_train_iters = 1, cur_iter = 0, start_iter = 0; // run multiple iterations
@@ -124,33 +186,39 @@ int align_debug = 0;
 int align_opt = 0;
 long long align_num_lines;
 long long *align_line_blocks;
+struct corpus_source *align_source; // align_file mapped into memory (NULL when reading through stdio)
 
 real bi_weight = 1.0; // how much we weight the crosslingual predictions.
 real bi_alpha; // learning rate for crosslingual predictions, set to alpha * bi_weight;
 /** End For bilingual embeddings **/
 
 /** Debugging code **/
-// print stat of a real array
-void print_real_array(real* a_syn, long long num_elements, char* name){
+// print stat of the num_rows rows of a matrix, or of a_bf16 if not NULL; the padding past
+// layer1_size is left out
+void print_real_array(real* a_syn, unsigned short* a_bf16, long long num_rows, char* name){
   float min = 1000000;
   float max = -1000000;
   float avg = 0;
-  long long i;
-  for(i=0; i<num_elements; ++i){
-    if (a_syn[i]>max) max = a_syn[i];
-    if (a_syn[i]<min) min = a_syn[i];
-    avg += a_syn[i];
+  float x;
+  long long i, j;
+  for(i=0; i<num_rows; ++i){
+    for(j=0; j<layer1_size; ++j){
+      x = a_bf16 != NULL ? VecBf16ToFloat(a_bf16[i * layer1_stride + j]) : a_syn[i * layer1_stride + j];
+      if (x>max) max = x;
+      if (x<min) min = x;
+      avg += x;
+    }
   }
-  avg /= num_elements;
+  avg /= num_rows * layer1_size;
   printf("%s: min=%f, max=%f, avg=%f\n", name, min, max, avg);
 }
 
 // print stats of input and output embeddings
 void print_model_stat(struct train_params *params){
   printf("# model stats:\n");
-  print_real_array(params->syn0, params->vocab_size * layer1_size, (char*) "  syn0");
-  if (hs) print_real_array(params->syn1, params->vocab_size * layer1_size, (char*) "  syn1");
-  if (negative) print_real_array(params->syn1neg, params->vocab_size * layer1_size, (char*) "  syn1neg");
+  print_real_array(params->syn0, params->syn0_bf16, params->vocab_size, (char*) "  syn0");
+  if (hs) print_real_array(params->syn1, params->syn1_bf16, params->vocab_size, (char*) "  syn1");
+  if (negative) print_real_array(params->syn1neg, params->syn1neg_bf16, params->vocab_size, (char*) "  syn1neg");
 }
 
 // print a sent
@@ -224,25 +292,75 @@ void cldc(char* outPrefix, int iter) {
 }
 /** End Evaluation code **/
 
-void InitUnigramTable(struct train_params *params) {
-  printf("# Init unigram table\n");
-  int a, i;
-  long long train_words_pow = 0;
-  real d1, power = 0.75;
-  long long vocab_size = params->vocab_size;
-  struct vocab_word *vocab = params->vocab;
-  params->table = (int *)malloc(table_size * sizeof(int));
-  for (a = 0; a < vocab_size; a++) train_words_pow += pow(vocab[a].cn, power);
-  i = 0;
-  d1 = pow(vocab[i].cn, power) / (real)train_words_pow;
-  for (a = 0; a < table_size; a++) {
-    params->table[a] = i;
-    if (a / (real)table_size > d1) {
-      i++;
-      d1 += pow(vocab[i].cn, power) / (real)train_words_pow;
+// Unigram distribution raised to the 3/4rd power
+double *NoiseProbs(struct train_params *params) {
+  long long a, train_words_pow = 0;
+  real power = 0.75;
+  double *prob = (double *)calloc(params->vocab_size + 1, sizeof(double));
+  for (a = 0; a < params->vocab_size; a++) train_words_pow += pow(params->vocab[a].cn, power);
+  for (a = 0; a < params->vocab_size; a++) prob[a] = pow(params->vocab[a].cn, power) / (real)train_words_pow;
+  return prob;
+}
+
+// Vose's alias method: vocab_size buckets of equal mass, each split between its own word and at
+// most one other, so a draw is one multiplication and one 8-byte load from a table that stays in
+// cache, instead of a random read from a 1e8-entry unigram table. The noise distribution is the
+// same up to the 2^-32 resolution of the thresholds.
+void InitNoiseSampler(struct train_params *params) {
+  long long a, n = params->vocab_size, num_small = 0, num_large = 0, s, l;
+  long long *small = (long long *)malloc(n * sizeof(long long)), *large = (long long *)malloc(n * sizeof(long long));
+  double *mass = (double *)malloc(n * sizeof(double)), sum = 0;
+
+  printf("# Init noise sampler\n");
+  if (params->noise_prob == NULL) params->noise_prob = NoiseProbs(params);
+  params->noise_alias = (struct alias_entry *)malloc(n * sizeof(struct alias_entry));
+  for (a = 0; a < n; a++) sum += params->noise_prob[a];
+  for (a = 0; a < n; a++) {
+    mass[a] = params->noise_prob[a] * n / sum; // 1 is a full bucket
+    if (mass[a] < 1) small[num_small++] = a;
+    else large[num_large++] = a;
+  }
+  while (num_small > 0 && num_large > 0) {
+    s = small[--num_small];
+    l = large[num_large - 1];
+    params->noise_alias[s].threshold = (unsigned int)(mass[s] * 4294967296.0);
+    params->noise_alias[s].alias = l;
+    mass[l] -= 1 - mass[s]; // l fills the rest of bucket s
+    if (mass[l] < 1) {
+      num_large--;
+      small[num_small++] = l;
     }
-    if (i >= vocab_size) i = vocab_size - 1;
   }
+  // what is left is full up to rounding
+  while (num_large > 0) {
+    l = large[--num_large];
+    params->noise_alias[l].threshold = 0xffffffff;
+    params->noise_alias[l].alias = l;
+  }
+  while (num_small > 0) {
+    s = small[--num_small];
+    params->noise_alias[s].threshold = 0xffffffff;
+    params->noise_alias[s].alias = s;
+  }
+  free(mass);
+  free(large);
+  free(small);
+}
+
+// Advances next_random and draws a negative sample; </s> is replaced by a uniformly drawn word
+static inline long long DrawNegative(const struct train_params *params, unsigned long long *next_random) {
+  unsigned __int128 x;
+  const struct alias_entry *entry;
+  long long target;
+  *next_random = (*next_random) * (unsigned long long)25214903917 + 11;
+  // the 48 high bits of the LCG, scaled by vocab_size: the integer part is the bucket and the
+  // fraction the position in it
+  x = (unsigned __int128)((*next_random) >> 16) * (unsigned long long)params->vocab_size;
+  target = (long long)(x >> 48);
+  entry = &params->noise_alias[target];
+  if ((unsigned int)((unsigned long long)x >> 16) >= entry->threshold) target = entry->alias;
+  if (target == 0) target = (*next_random) % (params->vocab_size - 1) + 1;
+  return target;
 }
 
 // Reads a single word from a file, assuming space + tab + EOL to be word boundaries
@@ -271,48 +389,628 @@ int ReadWord(char *word, FILE *fin) {
   return a;
 }
 
-// Returns hash value of a word
-int GetWordHash(const char *word) {
-  unsigned long long a, hash = 0;
-  for (a = 0; a < strlen(word); a++) hash = hash * 257 + word[a];
-  hash = hash % vocab_hash_size;
-  return hash;
+/** Vocabulary store **/
+// The vocab hash is an open-addressing table of {hash, id} entries sized to the vocabulary: a
+// power of two kept at most half full. It doubles by incremental rehash: the old table stays
+// readable and every insert moves VOCAB_HASH_MOVE of its buckets into the new one, so no insert
+// pays for a full rehash, and lookups check the new table, then the old one. The stored hash skips
+// the strcmp on almost every mismatch. Word strings live in a chunked arena, repacked into one
+// contiguous block whenever the vocab is sorted or reduced.
+#define VOCAB_HASH_MIN_CAP 1024
+#define VOCAB_HASH_MOVE 16
+#define ARENA_CHUNK_SIZE (1 << 20)
+
+// Returns hash value of a word; the low bits of WordHash pick the bucket
+unsigned int GetWordHash(const char *word) {
+  return (unsigned int)WordHash(word, strlen(word));
+}
+
+static inline int VocabHashFind(const struct vocab_hash_entry *table, long long cap, unsigned int hash, const char *word,
+    const struct vocab_word *vocab) {
+  long long b = hash & (cap - 1);
+  while (table[b].id != -1) {
+    if (table[b].hash == hash && !strcmp(word, vocab[table[b].id].word)) return table[b].id;
+    b = (b + 1) & (cap - 1);
+  }
+  return -1;
+}
+
+static inline void VocabHashInsert(struct vocab_hash_entry *table, long long cap, unsigned int hash, int id) {
+  long long b = hash & (cap - 1);
+  while (table[b].id != -1) b = (b + 1) & (cap - 1);
+  table[b].hash = hash;
+  table[b].id = id;
+}
+
+struct vocab_hash_entry *AllocVocabHash(long long cap) {
+  struct vocab_hash_entry *table = (struct vocab_hash_entry *)malloc(cap * sizeof(struct vocab_hash_entry));
+  long long b;
+  if (table == NULL) {
+    printf("Memory allocation failed\n");
+    exit(1);
+  }
+  for (b = 0; b < cap; b++) table[b].id = -1;
+  return table;
+}
+
+// SearchVocab for a word whose GetWordHash is already known
+int SearchVocabHash(const char *word, unsigned int hash, const struct train_params *params) {
+  int id = VocabHashFind(params->vocab_hash, params->vocab_hash_cap, hash, word, params->vocab);
+  if (id == -1 && params->vocab_hash_old != NULL) id = VocabHashFind(params->vocab_hash_old, params->vocab_hash_old_cap, hash, word, params->vocab);
+  return id;
 }
 
 // Returns position of a word in the vocabulary; if the word is not found, returns -1
-int SearchVocab(char *word, const struct vocab_word *vocab, const int *vocab_hash) {
-  unsigned int hash = GetWordHash(word);
+int SearchVocab(const char *word, const struct train_params *params) {
+  return SearchVocabHash(word, GetWordHash(word), params);
+}
+
+// Moves up to n buckets of the old table into vocab_hash; frees the old table once all are moved
+void MoveVocabHash(struct train_params *params, long long n) {
+  struct vocab_hash_entry *old = params->vocab_hash_old;
+  for (; n > 0 && params->vocab_hash_moved < params->vocab_hash_old_cap; n--, params->vocab_hash_moved++) {
+    if (old[params->vocab_hash_moved].id != -1)
+      VocabHashInsert(params->vocab_hash, params->vocab_hash_cap, old[params->vocab_hash_moved].hash, old[params->vocab_hash_moved].id);
+  }
+  if (params->vocab_hash_moved == params->vocab_hash_old_cap) {
+    free(old);
+    params->vocab_hash_old = NULL;
+  }
+}
+
+// Adds word id to the hash, growing it as needed; the word must not be in the vocab yet
+void AddToVocabHash(struct train_params *params, const char *word, int id) {
+  if (params->vocab_size * 2 > params->vocab_hash_cap) {
+    if (params->vocab_hash_old != NULL) MoveVocabHash(params, params->vocab_hash_old_cap);
+    params->vocab_hash_old = params->vocab_hash;
+    params->vocab_hash_old_cap = params->vocab_hash_cap;
+    params->vocab_hash_moved = 0;
+    params->vocab_hash_cap *= 2;
+    params->vocab_hash = AllocVocabHash(params->vocab_hash_cap);
+  }
+  VocabHashInsert(params->vocab_hash, params->vocab_hash_cap, GetWordHash(word), id);
+  if (params->vocab_hash_old != NULL) MoveVocabHash(params, VOCAB_HASH_MOVE);
+}
+
+// Rebuilds the hash from scratch for the current vocab
+void ResetVocabHash(struct train_params *params) {
+  long long a, cap = VOCAB_HASH_MIN_CAP;
+  while (cap < params->vocab_size * 2) cap *= 2;
+  free(params->vocab_hash);
+  free(params->vocab_hash_old);
+  params->vocab_hash_old = NULL;
+  params->vocab_hash_cap = cap;
+  params->vocab_hash = AllocVocabHash(cap);
+  for (a = 0; a < params->vocab_size; a++) VocabHashInsert(params->vocab_hash, cap, GetWordHash(params->vocab[a].word), a);
+}
+
+char *ArenaAlloc(struct string_arena *arena, long long len) {
+  char *str;
+  if (arena->num_chunks == 0 || arena->used + len > arena->chunk_size) {
+    arena->chunk_size = len > ARENA_CHUNK_SIZE ? len : ARENA_CHUNK_SIZE;
+    arena->chunks = (char **)realloc(arena->chunks, (arena->num_chunks + 1) * sizeof(char *));
+    arena->chunks[arena->num_chunks] = (char *)malloc(arena->chunk_size);
+    if (arena->chunks[arena->num_chunks] == NULL) {
+      printf("Memory allocation failed\n");
+      exit(1);
+    }
+    arena->num_chunks++;
+    arena->used = 0;
+  }
+  str = arena->chunks[arena->num_chunks - 1] + arena->used;
+  arena->used += len;
+  return str;
+}
+
+void ArenaFree(struct string_arena *arena) {
+  long long a;
+  for (a = 0; a < arena->num_chunks; a++) free(arena->chunks[a]);
+  free(arena->chunks);
+  memset(arena, 0, sizeof(struct string_arena));
+}
+
+// Copies the words of the vocab into one block, dropping the strings of removed words
+void RepackVocabWords(struct train_params *params) {
+  struct string_arena arena;
+  long long a, len, total = 1;
+  char *str;
+
+  memset(&arena, 0, sizeof(arena));
+  for (a = 0; a < params->vocab_size; a++) total += strlen(params->vocab[a].word) + 1;
+  str = ArenaAlloc(&arena, total);
+  for (a = 0; a < params->vocab_size; a++) {
+    len = strlen(params->vocab[a].word) + 1;
+    memcpy(str, params->vocab[a].word, len);
+    params->vocab[a].word = str;
+    str += len;
+  }
+  ArenaFree(&params->vocab_arena);
+  params->vocab_arena = arena;
+}
+/** End Vocabulary store **/
+
+/** Corpus readers **/
+// Each training thread reads its block [start, end) of a corpus file through a corpus_reader.
+// With a corpus_source (the file mapped into memory), words are tokenized straight from memory and
+// the reader stops at end; otherwise it falls back to stdio and keeps going until eof.
+// A compiled corpus is read through ids instead, one word id per read. An in-memory reader with a
+// refill function asks it for more text whenever [pos, end) runs out; base is the text offset of
+// base_ptr, so base + (pos - base_ptr) is the reader's offset in the text.
+struct corpus_reader {
+  FILE *fi;
+  const char *pos, *end;
+  const int *ids, *ids_end;
+  int eof;
+  int (*refill)(struct corpus_reader *reader); // returns 0 at the end of the input
+  void *refill_arg;
+  const char *base_ptr;
+  long long base;
+};
+
+// A text file mapped into memory, either plain or BGZF-compressed (a series of independent gzip
+// members of at most 64KB of text each, as written by bgzip). Readers of a compressed file inflate
+// one block at a time, so all offsets (line_blocks, line index, vocab shards) are text offsets and
+// each thread decompresses only its own range.
+#define BGZF_MAX_BLOCK 65536
+
+struct corpus_source {
+  char *data;           // the file as stored on disk
+  long long data_size;
+  long long size;       // size of the text
+  long long num_blocks; // 0 for plain text
+  long long *coffsets, *uoffsets; // start of each block in the file and in the text, plus an end entry
+};
+
+// Maps a whole file read-only into memory; returns NULL if the file can't be mapped
+char *MapFile(const char *file_name, long long *size) {
+  struct stat st;
+  char *data;
+  int fd = open(file_name, O_RDONLY);
+  if (fd < 0) return NULL;
+  if (fstat(fd, &st) != 0 || st.st_size == 0) {
+    close(fd);
+    return NULL;
+  }
+  data = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+  close(fd);
+  if (data == MAP_FAILED) return NULL;
+  madvise(data, st.st_size, MADV_SEQUENTIAL);
+  *size = st.st_size;
+  return data;
+}
+
+// gzip member with a BGZF "BC" extra subfield
+int IsBgzf(const unsigned char *data, long long size) {
+  return size >= 18 && data[0] == 31 && data[1] == 139 && data[2] == 8 && (data[3] & 4)
+      && data[12] == 'B' && data[13] == 'C' && data[14] == 2 && data[15] == 0;
+}
+
+// Block offsets come from file.gzi (as written by bgzip -i) when it is newer than the file,
+// otherwise from walking the block headers, which hold each block's size and text length
+void IndexBgzf(struct corpus_source *source, const char *file_name) {
+  const unsigned char *data = (const unsigned char *)source->data;
+  char index_file[MAX_STRING + 4];
+  struct stat st, index_st;
+  unsigned long long n, offsets[2];
+  long long a, pos, max_blocks = 1024;
+  FILE *f;
+
+  sprintf(index_file, "%s.gzi", file_name);
+  if (stat(file_name, &st) == 0 && stat(index_file, &index_st) == 0 && index_st.st_mtime >= st.st_mtime
+      && (f = fopen(index_file, "rb")) != NULL) {
+    if (fread(&n, sizeof(n), 1, f) == 1) {
+      source->coffsets = (long long *)malloc((n + 2) * sizeof(long long));
+      source->uoffsets = (long long *)malloc((n + 2) * sizeof(long long));
+      source->coffsets[0] = source->uoffsets[0] = 0; // the first block is implicit
+      for (a = 1; a <= (long long)n && fread(offsets, sizeof(offsets), 1, f) == 1; a++) {
+        source->coffsets[a] = offsets[0];
+        source->uoffsets[a] = offsets[1];
+      }
+      if (a == (long long)n + 1) {
+        fclose(f);
+        // the last indexed block's text length is in its trailer; any block after it is the empty EOF block
+        source->num_blocks = n + 1;
+        source->coffsets[n + 1] = source->data_size;
+        pos = source->coffsets[n] + data[source->coffsets[n] + 16] + (data[source->coffsets[n] + 17] << 8) + 1;
+        source->uoffsets[n + 1] = source->uoffsets[n] + *(const unsigned int *)(data + pos - 4);
+        return;
+      }
+      free(source->coffsets);
+      free(source->uoffsets);
+    }
+    fclose(f);
+  }
+
+  source->coffsets = (long long *)malloc(max_blocks * sizeof(long long));
+  source->uoffsets = (long long *)malloc(max_blocks * sizeof(long long));
+  source->num_blocks = 0;
+  source->coffsets[0] = source->uoffsets[0] = 0;
+  for (pos = 0; pos < source->data_size; ) {
+    if (!IsBgzf(data + pos, source->data_size - pos)) {
+      printf("ERROR: %s is not block-compressed at offset %lld, recompress it with bgzip\n", file_name, pos);
+      exit(1);
+    }
+    if (source->num_blocks + 2 > max_blocks) {
+      max_blocks *= 2;
+      source->coffsets = (long long *)realloc(source->coffsets, max_blocks * sizeof(long long));
+      source->uoffsets = (long long *)realloc(source->uoffsets, max_blocks * sizeof(long long));
+    }
+    n = data[pos + 16] + (data[pos + 17] << 8) + 1; // BSIZE + 1 = block size
+    source->num_blocks++;
+    source->coffsets[source->num_blocks] = pos + n;
+    source->uoffsets[source->num_blocks] = source->uoffsets[source->num_blocks - 1] + *(const unsigned int *)(data + pos + n - 4);
+    pos += n;
+  }
+
+  // save it for the next run in the .gzi layout: count, then (file, text) offsets of blocks 1..n-1
+  f = fopen(index_file, "wb");
+  if (f != NULL) {
+    n = source->num_blocks - 1;
+    fwrite(&n, sizeof(n), 1, f);
+    for (a = 1; a < source->num_blocks; a++) {
+      offsets[0] = source->coffsets[a];
+      offsets[1] = source->uoffsets[a];
+      fwrite(offsets, sizeof(offsets), 1, f);
+    }
+    fclose(f);
+  }
+}
+
+// Maps file_name; returns NULL if it can't be mapped
+struct corpus_source *OpenSource(const char *file_name) {
+  struct corpus_source *source = (struct corpus_source *)calloc(1, sizeof(struct corpus_source));
+  const unsigned char *data;
+  source->data = MapFile(file_name, &source->data_size);
+  if (source->data == NULL) {
+    free(source);
+    return NULL;
+  }
+  data = (const unsigned char *)source->data;
+  if (source->data_size >= 2 && data[0] == 31 && data[1] == 139 && !IsBgzf(data, source->data_size)) {
+    // plain gzip has no block offsets to split the file at
+    printf("ERROR: %s is gzip but not block-compressed, recompress it with bgzip\n", file_name);
+    exit(1);
+  }
+  if (IsBgzf(data, source->data_size)) {
+    IndexBgzf(source, file_name);
+    source->size = source->uoffsets[source->num_blocks];
+    if (debug_mode > 1) printf("  %s: %lld BGZF blocks, %lld bytes of text\n", file_name, source->num_blocks, source->size);
+  } else source->size = source->data_size;
+  return source;
+}
+
+void CloseSource(struct corpus_source *source) {
+  munmap(source->data, source->data_size);
+  if (source->num_blocks) {
+    free(source->coffsets);
+    free(source->uoffsets);
+  }
+  free(source);
+}
+
+// Source the training threads read file_name from: NULL to read through stdio, which -mmap 0
+// asks for; compressed files are always read through their source
+struct corpus_source *OpenTrainSource(const char *file_name) {
+  struct corpus_source *source = OpenSource(file_name);
+  if (source == NULL) printf("! Can't mmap %s, reading through stdio\n", file_name);
+  else if (!use_mmap && source->num_blocks == 0) {
+    CloseSource(source);
+    source = NULL;
+  }
+  return source;
+}
+
+
+// Reader over [start, end) of text already in memory
+void OpenMemoryReader(struct corpus_reader *reader, const char *data, long long start, long long end) {
+  reader->eof = 0;
+  reader->fi = NULL;
+  reader->ids = reader->ids_end = NULL;
+  reader->refill = NULL;
+  reader->base_ptr = data;
+  reader->base = 0;
+  reader->pos = data + start;
+  reader->end = data + end;
+}
+
+// Reader through stdio from start to the end of file_name
+void OpenCorpusReader(struct corpus_reader *reader, const char *file_name, long long start) {
+  reader->eof = 0;
+  reader->ids = reader->ids_end = NULL;
+  reader->refill = NULL;
+  reader->fi = fopen(file_name, "rb");
+  if (reader->fi == NULL) {
+    printf("ERROR: file %s not found!\n", file_name);
+    exit(1);
+  }
+  fseek(reader->fi, start, SEEK_SET);
+  reader->pos = reader->end = NULL;
+}
+
+// Decompression state of a reader over a BGZF source
+struct bgzf_reader {
+  struct corpus_source *source;
+  long long block, end;
+  char buffer[BGZF_MAX_BLOCK];
+  z_stream zs;
+};
+
+// Inflates block into the buffer and points the reader at the part of it before end
+void BgzfLoadBlock(struct corpus_reader *reader, struct bgzf_reader *bgzf, long long block) {
+  struct corpus_source *source = bgzf->source;
+  long long len = source->uoffsets[block + 1] - source->uoffsets[block];
+
+  bgzf->block = block;
+  inflateReset(&bgzf->zs);
+  bgzf->zs.next_in = (unsigned char *)source->data + source->coffsets[block];
+  bgzf->zs.avail_in = source->coffsets[block + 1] - source->coffsets[block];
+  bgzf->zs.next_out = (unsigned char *)bgzf->buffer;
+  bgzf->zs.avail_out = BGZF_MAX_BLOCK;
+  if (inflate(&bgzf->zs, Z_FINISH) != Z_STREAM_END || bgzf->zs.total_out != len) {
+    printf("ERROR: corrupt BGZF block %lld\n", block);
+    exit(1);
+  }
+  if (source->uoffsets[block + 1] > bgzf->end) len = bgzf->end - source->uoffsets[block];
+  reader->base_ptr = reader->pos = bgzf->buffer;
+  reader->end = bgzf->buffer + len;
+  reader->base = source->uoffsets[block];
+}
+
+int BgzfRefill(struct corpus_reader *reader) {
+  struct bgzf_reader *bgzf = (struct bgzf_reader *)reader->refill_arg;
+  while (reader->pos >= reader->end) { // skips empty blocks, like the one bgzip ends a file with
+    if (bgzf->block + 1 >= bgzf->source->num_blocks || bgzf->source->uoffsets[bgzf->block + 1] >= bgzf->end) return 0;
+    BgzfLoadBlock(reader, bgzf, bgzf->block + 1);
+  }
+  return 1;
+}
+
+// Opens a reader over the text range [start, end) of source
+void OpenSourceReader(struct corpus_reader *reader, struct corpus_source *source, long long start, long long end) {
+  struct bgzf_reader *bgzf;
+  long long lo = 0, hi, mid;
+
+  if (end > source->size) end = source->size;
+  if (source->num_blocks == 0) {
+    OpenMemoryReader(reader, source->data, start, end);
+    return;
+  }
+  OpenMemoryReader(reader, "", 0, 0);
+  bgzf = (struct bgzf_reader *)calloc(1, sizeof(struct bgzf_reader));
+  bgzf->source = source;
+  bgzf->end = end;
+  inflateInit2(&bgzf->zs, 15 + 16); // gzip wrapper
+  reader->refill = BgzfRefill;
+  reader->refill_arg = bgzf;
+  if (start >= end) {
+    bgzf->block = source->num_blocks;
+    return;
+  }
+  for (hi = source->num_blocks - 1; lo < hi; ) { // block holding start
+    mid = (lo + hi + 1) / 2;
+    if (source->uoffsets[mid] <= start) lo = mid;
+    else hi = mid - 1;
+  }
+  BgzfLoadBlock(reader, bgzf, lo);
+  reader->pos += start - source->uoffsets[lo];
+}
+
+void CloseCorpusReader(struct corpus_reader *reader) {
+  if (reader->fi != NULL) fclose(reader->fi);
+  reader->fi = NULL;
+  if (reader->refill == BgzfRefill) {
+    inflateEnd(&((struct bgzf_reader *)reader->refill_arg)->zs);
+    free(reader->refill_arg);
+    reader->refill = NULL;
+  }
+}
+
+// Offset in the text of the next character an in-memory reader returns
+long long ReaderOffset(const struct corpus_reader *reader) {
+  return reader->base + (reader->pos - reader->base_ptr);
+}
+
+// Makes sure an in-memory reader has text in [pos, end); returns 0 at the end of the input
+static inline int ReaderFill(struct corpus_reader *reader) {
+  return reader->pos < reader->end || (reader->refill != NULL && reader->refill(reader));
+}
+
+// Next character of an in-memory reader, -1 at the end of the input
+static inline int ReaderGetc(struct corpus_reader *reader) {
+  if (!ReaderFill(reader)) return -1;
+  return (unsigned char)*reader->pos++;
+}
+
+// Skips past the next n newlines of an in-memory reader; returns how many it found
+long long ReaderSkipLines(struct corpus_reader *reader, long long n) {
+  const char *pos;
+  long long found = 0;
+  while (found < n && ReaderFill(reader)) {
+    pos = memchr(reader->pos, '\n', reader->end - reader->pos);
+    if (pos == NULL) reader->pos = reader->end;
+    else {
+      reader->pos = pos + 1;
+      found++;
+    }
+  }
+  return found;
+}
+
+// Same tokenization as ReadWord. Like feof(), eof is only set once a read runs past the end, so a
+// word cut off by the end of the range is dropped the same way ReadWord drops it. Also sets *hash to
+// WordHash of the word, hashed 8 bytes at a time as the scan copies them.
+int ReaderReadWord(char *word, struct corpus_reader *reader, unsigned long long *hash) {
+  int a = 0, truncated = 0;
+  int ch;
+  unsigned long long h = WORD_HASH_SEED, block = 0;
+
+  if (reader->fi != NULL) {
+    a = ReadWord(word, reader->fi);
+    if (feof(reader->fi)) reader->eof = 1;
+    *hash = WordHash(word, a);
+    return a;
+  }
+
   while (1) {
-    if (vocab_hash[hash] == -1) return -1;
-    if (!strcmp(word, vocab[vocab_hash[hash]].word)) {
-      return vocab_hash[hash];
+    ch = ReaderGetc(reader);
+    if (ch < 0) {
+      reader->eof = 1;
+      break;
+    }
+    if (ch == 13) continue;
+    if ((ch == ' ') || (ch == '\t') || (ch == '\n')) {
+      if (a > 0) {
+        if (ch == '\n') reader->pos--; // the newline was just read from the current buffer
+        break;
+      }
+      if (ch == '\n') {
+        strcpy(word, (char *)"</s>");
+        *hash = WordHash(word, 4);
+        return 4;
+      } else continue;
+    }
+    word[a] = ch;
+    block |= (unsigned long long)(unsigned char)ch << (8 * (a & 7));
+    a++;
+    if ((a & 7) == 0) {
+      h = WordHashBlock(h, block);
+      block = 0;
+    }
+    if (a >= MAX_STRING - 1) {   // Truncate too long words
+      a--;
+      truncated = 1;
     }
-    hash = (hash + 1) % vocab_hash_size;
   }
-  return -1;
+  word[a] = 0;
+  *hash = truncated ? WordHash(word, a) : WordHashEnd(h, block, a);
+
+  return a;
+}
+
+void OpenIdReader(struct corpus_reader *reader, const int *ids, long long start, long long end) {
+  reader->eof = 0;
+  reader->fi = NULL;
+  reader->pos = reader->end = NULL;
+  reader->refill = NULL;
+  reader->ids = ids + start;
+  reader->ids_end = ids + end;
 }
 
+// Per-thread direct-mapped cache of recent tokens for the vocab hash fallback: the few thousand most
+// frequent words make up most of the tokens, and a hit skips the probe into the 30M-slot table.
+// Entries are checked against the vocab word itself, so a stale or colliding entry is just a miss.
+#define TOKEN_CACHE_SIZE 4096
+struct token_cache_entry {
+  unsigned long long hash;
+  const struct train_params *params;
+  int id;
+};
+static __thread struct token_cache_entry token_cache[TOKEN_CACHE_SIZE];
+
 // Reads a word and returns its index in the vocabulary
-int ReadWordIndex(FILE *fin, const struct vocab_word *vocab, const int *vocab_hash) {
+int ReadWordIndex(struct corpus_reader *reader, const struct train_params *params) {
   char word[MAX_STRING];
-  int word_len = ReadWord(word, fin);
+  int word_len, id;
+  unsigned long long hash;
+  struct token_cache_entry *entry;
+
+  if (reader->ids != NULL) {
+    if (reader->ids >= reader->ids_end) {
+      reader->eof = 1;
+      return -1;
+    }
+    return *reader->ids++;
+  }
+
+  word_len = ReaderReadWord(word, reader, &hash);
   if(word_len >= MAX_STRING - 2) printf("! long word: %s\n", word);
 
-  if (feof(fin)) return -1;
-  return SearchVocab(word, vocab, vocab_hash);
+  if (reader->eof) return -1;
+  if (params->vocab_mph.num_slots > 0) return PerfectHashFind(&params->vocab_mph, hash);
+  entry = &token_cache[(hash >> 40) & (TOKEN_CACHE_SIZE - 1)]; // other bits than the vocab hash buckets
+  if (entry->params == params && entry->hash == hash && entry->id < params->vocab_size
+      && !strcmp(params->vocab[entry->id].word, word)) return entry->id;
+  id = SearchVocabHash(word, (unsigned int)hash, params);
+  if (id != -1) {
+    entry->hash = hash;
+    entry->params = params;
+    entry->id = id;
+  }
+  return id;
+}
+
+// Reads one line of "src_pos tgt_pos" alignment links into src_align_map
+void ReadAlignLine(struct corpus_reader *reader, int *src_align_map) {
+  int src_pos, tgt_pos, ch;
+  char c;
+
+  if (reader->fi != NULL) {
+    while (fscanf(reader->fi, "%d %d%c", &src_pos, &tgt_pos, &c)) {
+      src_align_map[src_pos] = tgt_pos;
+      if (c == '\n') break;
+    }
+    return;
+  }
+
+  ch = ReaderGetc(reader);
+  while (ch >= 0 && ch != '\n') {
+    if (ch < '0' || ch > '9') { // link separators
+      ch = ReaderGetc(reader);
+      continue;
+    }
+    src_pos = 0;
+    for (; ch >= '0' && ch <= '9'; ch = ReaderGetc(reader)) src_pos = src_pos * 10 + (ch - '0');
+    while (ch >= 0 && ch != '\n' && (ch < '0' || ch > '9')) ch = ReaderGetc(reader);
+    tgt_pos = 0;
+    for (; ch >= '0' && ch <= '9'; ch = ReaderGetc(reader)) tgt_pos = tgt_pos * 10 + (ch - '0');
+    if (src_pos < MAX_WORD_PER_SENT) src_align_map[src_pos] = tgt_pos;
+  }
+  if (ch < 0) reader->eof = 1;
+}
+
+// One alignment link; a line of the align file reduces to at most one link per src position
+struct align_link {
+  unsigned short src_pos, tgt_pos;
+};
+
+// Reads one line of alignment links the way ReadAlignLine applies them (the last link of a src
+// position wins); returns the number of links, at most MAX_WORD_PER_SENT
+int ReadAlignLinks(struct corpus_reader *reader, struct align_link *links) {
+  int src_align_map[MAX_WORD_PER_SENT + 1];
+  int src_pos, num_links = 0;
+
+  for (src_pos = 0; src_pos < MAX_WORD_PER_SENT; src_pos++) src_align_map[src_pos] = -1;
+  ReadAlignLine(reader, src_align_map);
+  for (src_pos = 0; src_pos < MAX_WORD_PER_SENT; src_pos++) {
+    if (src_align_map[src_pos] == -1) continue;
+    if (src_align_map[src_pos] > 65535) {
+      printf("ERROR: alignment link %d-%d is out of range\n", src_pos, src_align_map[src_pos]);
+      exit(1);
+    }
+    links[num_links].src_pos = src_pos;
+    links[num_links].tgt_pos = src_align_map[src_pos];
+    num_links++;
+  }
+  return num_links;
+}
+
+static inline void ApplyAlignLinks(const struct align_link *links, int num_links, int *src_align_map) {
+  int a;
+  for (a = 0; a < num_links; a++) src_align_map[links[a].src_pos] = links[a].tgt_pos;
 }
+/** End Corpus readers **/
 
 // Adds a word to the vocabulary
 int AddWordToVocab(const char *word, struct train_params *params) {
-  unsigned int hash, length = strlen(word) + 1;
+  unsigned int length = strlen(word) + 1;
   long long vocab_size = params->vocab_size;
   long long vocab_max_size = params->vocab_max_size;
   struct vocab_word *vocab = params->vocab;
-  int *vocab_hash = params->vocab_hash;
 
   if (length > MAX_STRING) length = MAX_STRING;
-  vocab[vocab_size].word = (char *)calloc(length, sizeof(char));
-  strcpy(vocab[vocab_size].word, word);
+  vocab[vocab_size].word = ArenaAlloc(&params->vocab_arena, length);
+  memcpy(vocab[vocab_size].word, word, length - 1);
+  vocab[vocab_size].word[length - 1] = 0;
   vocab[vocab_size].cn = 0;
   vocab_size++;
   // Reallocate memory if needed
@@ -320,86 +1018,281 @@ int AddWordToVocab(const char *word, struct train_params *params) {
     vocab_max_size += 1000;
     vocab = (struct vocab_word *)realloc(vocab, vocab_max_size * sizeof(struct vocab_word));
   }
-  hash = GetWordHash(word);
-  while (vocab_hash[hash] != -1) hash = (hash + 1) % vocab_hash_size;
-  vocab_hash[hash] = vocab_size - 1;
   params->vocab_size = vocab_size;
   params->vocab_max_size = vocab_max_size;
   params->vocab = vocab;
+  AddToVocabHash(params, vocab[vocab_size - 1].word, vocab_size - 1);
   return vocab_size - 1;
 }
 
-// Used later for sorting by word counts
-int VocabCompare(const void *a, const void *b) {
-    return ((struct vocab_word *)b)->cn - ((struct vocab_word *)a)->cn;
+/** Vocab finalization **/
+// SortVocab runs once per vocab at every start, on up to tens of millions of words, so its steps
+// are split over num_threads: a stable LSD radix sort of (count, index) pairs (stable, so words
+// with equal counts keep their order, as the merge sort behind glibc's qsort kept them), the
+// min_count cut, the copy of the kept words and their strings into one block, and the rehash with
+// compare-and-swap inserts. Codes and points of all words share one allocation.
+#define FINALIZE_MIN_PER_THREAD 65536 // smaller vocabs are finalized in the calling thread
+
+typedef void (*parallel_fn)(void *ctx, int t, int num_parts);
+
+struct parallel_task {
+  parallel_fn fn;
+  void *ctx;
+  int t, num_parts;
+};
+
+void *ParallelTaskThread(void *arg) {
+  struct parallel_task *task = (struct parallel_task *)arg;
+  task->fn(task->ctx, task->t, task->num_parts);
+  return NULL;
+}
+
+// Calls fn(ctx, t, num_parts) for t = 0..num_parts-1, each in its own thread
+void RunParallel(parallel_fn fn, void *ctx, int num_parts) {
+  struct parallel_task *tasks;
+  pthread_t *pt;
+  int t;
+  if (num_parts == 1) {
+    fn(ctx, 0, 1);
+    return;
+  }
+  tasks = (struct parallel_task *)malloc(num_parts * sizeof(struct parallel_task));
+  pt = (pthread_t *)malloc(num_parts * sizeof(pthread_t));
+  for (t = 0; t < num_parts; t++) {
+    tasks[t].fn = fn;
+    tasks[t].ctx = ctx;
+    tasks[t].t = t;
+    tasks[t].num_parts = num_parts;
+    pthread_create(&pt[t], NULL, ParallelTaskThread, (void *)&tasks[t]);
+  }
+  for (t = 0; t < num_parts; t++) pthread_join(pt[t], NULL);
+  free(pt);
+  free(tasks);
 }
 
-// Sorts the vocabulary by frequency using word counts
-void SortVocab(struct train_params *params) {
-  int a, size;
-  unsigned int hash;
-  int *vocab_hash = params->vocab_hash;
-  struct vocab_word *vocab = params->vocab;
-  long long vocab_size = params->vocab_size;
+// Start of part t of n items split into num_parts parts
+static inline long long PartStart(long long n, int t, int num_parts) {
+  return n * t / num_parts;
+}
 
-  // Sort the vocabulary and keep </s> at the first position
-  qsort(&vocab[1], vocab_size - 1, sizeof(struct vocab_word), VocabCompare);
-  for (a = 0; a < vocab_hash_size; a++) vocab_hash[a] = -1;
-  size = vocab_size;
-  params->train_words = 0;
-  for (a = 0; a < size; a++) {
-    // Words occuring less than min_count times will be discarded from the vocab
-    if ((vocab[a].cn < min_count) && (a != 0)){ // a=0 is </s> and we want to keep it.
-      vocab_size--;
-      free(vocab[a].word);
-    } else {
-      // Hash will be re-computed, as after the sorting it is not actual
-      hash=GetWordHash(vocab[a].word);
-      while (vocab_hash[hash] != -1) hash = (hash + 1) % vocab_hash_size;
-      vocab_hash[hash] = a;
-      params->train_words += vocab[a].cn;
+struct sort_pair {
+  unsigned long long key; // ~count, so ascending keys are descending counts
+  long long id;
+};
+
+struct finalize_ctx {
+  struct train_params *params;
+  struct sort_pair *pairs, *tmp;
+  long long num_pairs, (*hist)[256]; // hist[t][digit] of the current pass, then the scatter offsets
+  int shift;
+  struct vocab_word *vocab; // the new, sorted vocab
+  long long kept; // words in the new vocab
+  long long *word_offset; // offset of each kept word's string in words, kept + 1 entries
+  long long *part_sum; // counts of the kept words per part
+  char *words;
+};
+
+void RadixHistogramPart(void *arg, int t, int num_parts) {
+  struct finalize_ctx *ctx = (struct finalize_ctx *)arg;
+  long long i, end = PartStart(ctx->num_pairs, t + 1, num_parts);
+  memset(ctx->hist[t], 0, 256 * sizeof(long long));
+  for (i = PartStart(ctx->num_pairs, t, num_parts); i < end; i++) ctx->hist[t][(ctx->pairs[i].key >> ctx->shift) & 255]++;
+}
+
+void RadixScatterPart(void *arg, int t, int num_parts) {
+  struct finalize_ctx *ctx = (struct finalize_ctx *)arg;
+  long long i, end = PartStart(ctx->num_pairs, t + 1, num_parts), *offset = ctx->hist[t];
+  for (i = PartStart(ctx->num_pairs, t, num_parts); i < end; i++) ctx->tmp[offset[(ctx->pairs[i].key >> ctx->shift) & 255]++] = ctx->pairs[i];
+}
+
+// Stable sort of ctx->pairs by key, one pass per byte; passes whose byte is the same in all keys are skipped
+void RadixSortPairs(struct finalize_ctx *ctx, int num_parts) {
+  struct sort_pair *swap;
+  long long d, sum;
+  int t;
+  ctx->hist = (long long (*)[256])malloc(num_parts * sizeof(*ctx->hist));
+  ctx->tmp = (struct sort_pair *)malloc(ctx->num_pairs * sizeof(struct sort_pair));
+  for (ctx->shift = 0; ctx->shift < 64; ctx->shift += 8) {
+    RunParallel(RadixHistogramPart, ctx, num_parts);
+    for (d = 0; d < 256; d++) {
+      for (sum = 0, t = 0; t < num_parts; t++) sum += ctx->hist[t][d];
+      if (sum == ctx->num_pairs || sum != 0) break;
+    }
+    if (sum == ctx->num_pairs) continue;
+    // offsets: digits in order, and within a digit the parts in order
+    for (sum = 0, d = 0; d < 256; d++) for (t = 0; t < num_parts; t++) {
+      long long count = ctx->hist[t][d];
+      ctx->hist[t][d] = sum;
+      sum += count;
     }
+    RunParallel(RadixScatterPart, ctx, num_parts);
+    swap = ctx->pairs;
+    ctx->pairs = ctx->tmp;
+    ctx->tmp = swap;
   }
-  vocab = (struct vocab_word *)realloc(vocab, (vocab_size + 1) * sizeof(struct vocab_word));
-  // Allocate memory for the binary tree construction
-  for (a = 0; a < vocab_size; a++) {
-    vocab[a].code = (char *)calloc(MAX_CODE_LENGTH, sizeof(char));
-    vocab[a].point = (int *)calloc(MAX_CODE_LENGTH, sizeof(int));
+  free(ctx->tmp);
+  free(ctx->hist);
+}
+
+// Copies the kept words into the new vocab and sums their counts and string lengths
+void GatherVocabPart(void *arg, int t, int num_parts) {
+  struct finalize_ctx *ctx = (struct finalize_ctx *)arg;
+  long long a, end = PartStart(ctx->kept, t + 1, num_parts), sum = 0;
+  for (a = PartStart(ctx->kept, t, num_parts); a < end; a++) {
+    ctx->vocab[a] = ctx->params->vocab[a == 0 ? 0 : ctx->pairs[a - 1].id];
+    ctx->word_offset[a + 1] = strlen(ctx->vocab[a].word) + 1;
+    sum += ctx->vocab[a].cn;
+  }
+  ctx->part_sum[t] = sum;
+}
+
+void CopyWordsPart(void *arg, int t, int num_parts) {
+  struct finalize_ctx *ctx = (struct finalize_ctx *)arg;
+  long long a, end = PartStart(ctx->kept, t + 1, num_parts);
+  for (a = PartStart(ctx->kept, t, num_parts); a < end; a++) {
+    memcpy(ctx->words + ctx->word_offset[a], ctx->vocab[a].word, ctx->word_offset[a + 1] - ctx->word_offset[a]);
+    ctx->vocab[a].word = ctx->words + ctx->word_offset[a];
   }
+}
 
-  params->vocab = vocab;
-  params->vocab_size = vocab_size;
+// Inserts the words of part t into the (preallocated, empty) vocab hash, claiming buckets with compare-and-swap
+void RehashPart(void *arg, int t, int num_parts) {
+  struct finalize_ctx *ctx = (struct finalize_ctx *)arg;
+  struct train_params *params = ctx->params;
+  struct vocab_hash_entry entry, empty = {0, -1};
+  unsigned long long empty_bits, entry_bits, *bucket;
+  long long a, b, end = PartStart(params->vocab_size, t + 1, num_parts);
+  memcpy(&empty_bits, &empty, sizeof(empty_bits));
+  for (a = PartStart(params->vocab_size, t, num_parts); a < end; a++) {
+    entry.hash = GetWordHash(params->vocab[a].word);
+    entry.id = a;
+    memcpy(&entry_bits, &entry, sizeof(entry_bits));
+    b = entry.hash & (params->vocab_hash_cap - 1);
+    while (1) {
+      bucket = (unsigned long long *)&params->vocab_hash[b];
+      if (__sync_bool_compare_and_swap(bucket, empty_bits, entry_bits)) break;
+      b = (b + 1) & (params->vocab_hash_cap - 1);
+    }
+  }
+}
+
+void InitVocabHashPart(void *arg, int t, int num_parts) {
+  struct train_params *params = ((struct finalize_ctx *)arg)->params;
+  long long b, end = PartStart(params->vocab_hash_cap, t + 1, num_parts);
+  for (b = PartStart(params->vocab_hash_cap, t, num_parts); b < end; b++) {
+    params->vocab_hash[b].hash = 0; // RehashPart compares whole entries
+    params->vocab_hash[b].id = -1;
+  }
+}
+
+// Sorts the vocabulary by frequency (</s> stays first), drops words under min_count and rebuilds the hash
+void SortVocab(struct train_params *params) {
+  struct finalize_ctx ctx;
+  struct string_arena arena;
+  long long a, cap = VOCAB_HASH_MIN_CAP;
+  int t, num_parts = num_threads;
+
+  if (num_parts > params->vocab_size / FINALIZE_MIN_PER_THREAD) num_parts = params->vocab_size / FINALIZE_MIN_PER_THREAD;
+  if (num_parts < 1) num_parts = 1;
+  memset(&ctx, 0, sizeof(ctx));
+  ctx.params = params;
+
+  // sort the words after </s> by count, most frequent first
+  ctx.num_pairs = params->vocab_size - 1;
+  ctx.pairs = (struct sort_pair *)malloc((ctx.num_pairs + 1) * sizeof(struct sort_pair));
+  for (a = 0; a < ctx.num_pairs; a++) {
+    ctx.pairs[a].key = ~(unsigned long long)params->vocab[a + 1].cn;
+    ctx.pairs[a].id = a + 1;
+  }
+  RadixSortPairs(&ctx, num_parts);
+
+  // words occuring less than min_count times are discarded; </s> is kept
+  for (ctx.kept = 0; ctx.kept < ctx.num_pairs && params->vocab[ctx.pairs[ctx.kept].id].cn >= min_count; ctx.kept++);
+  ctx.kept++;
+  ctx.vocab = (struct vocab_word *)calloc(ctx.kept + 1, sizeof(struct vocab_word));
+  ctx.word_offset = (long long *)calloc(ctx.kept + 1, sizeof(long long));
+  ctx.part_sum = (long long *)calloc(num_parts, sizeof(long long));
+  RunParallel(GatherVocabPart, &ctx, num_parts);
+  params->train_words = 0;
+  for (t = 0; t < num_parts; t++) params->train_words += ctx.part_sum[t];
+  for (a = 0; a < ctx.kept; a++) ctx.word_offset[a + 1] += ctx.word_offset[a];
+
+  // the strings of the kept words go into one block that replaces the arena
+  memset(&arena, 0, sizeof(arena));
+  ctx.words = ArenaAlloc(&arena, ctx.word_offset[ctx.kept] + 1);
+  RunParallel(CopyWordsPart, &ctx, num_parts);
+  ArenaFree(&params->vocab_arena);
+  params->vocab_arena = arena;
+  free(params->vocab);
+  params->vocab = ctx.vocab;
+  params->vocab_size = ctx.kept;
+  params->vocab_max_size = ctx.kept + 1;
+
+  // hash will be re-computed, as after the sorting it is not actual
+  while (cap < params->vocab_size * 2) cap *= 2;
+  free(params->vocab_hash);
+  free(params->vocab_hash_old);
+  params->vocab_hash_old = NULL;
+  params->vocab_hash_cap = cap;
+  params->vocab_hash = (struct vocab_hash_entry *)malloc(cap * sizeof(struct vocab_hash_entry));
+  if (params->vocab_hash == NULL) {
+    printf("Memory allocation failed\n");
+    exit(1);
+  }
+  RunParallel(InitVocabHashPart, &ctx, num_parts);
+  RunParallel(RehashPart, &ctx, num_parts);
+
+  free(ctx.part_sum);
+  free(ctx.word_offset);
+  free(ctx.pairs);
+}
+/** End Vocab finalization **/
+
+// Builds the perfect hash ReadWordIndex uses once the vocab won't change any more; without it,
+// words keep being looked up in the vocab hash
+void FreezeVocab(struct train_params *params) {
+  unsigned long long *hashes = (unsigned long long *)malloc(params->vocab_size * sizeof(unsigned long long));
+  long long a;
+  for (a = 0; a < params->vocab_size; a++) hashes[a] = WordHash(params->vocab[a].word, strlen(params->vocab[a].word));
+  if (!PerfectHashBuild(&params->vocab_mph, hashes, params->vocab_size)) {
+    // no salt placed every bucket
+    printf("  Can't build a perfect hash over the vocab of %s\n", params->train_file);
+  } else if (params->vocab_mph.num_keys != params->vocab_size) {
+    // two words share a 64-bit hash, the perfect hash would only find one of them
+    printf("  Can't build a perfect hash over the vocab of %s: two words share a hash\n", params->train_file);
+    PerfectHashFree(&params->vocab_mph);
+  }
+  free(hashes);
 }
 
 // Reduces the vocabulary by removing infrequent tokens
 void ReduceVocab(struct train_params *params) {
   int a, b = 0;
-  unsigned int hash;
-  for (a = 0; a < params->vocab_size; a++) if (params->vocab[a].cn > min_reduce) {
+  for (a = 0; a < params->vocab_size; a++) if (params->vocab[a].cn > params->min_reduce) {
     params->vocab[b].cn = params->vocab[a].cn;
     params->vocab[b].word = params->vocab[a].word;
     b++;
-  } else free(params->vocab[a].word);
-  params->vocab_size = b;
-  for (a = 0; a < vocab_hash_size; a++) params->vocab_hash[a] = -1;
-  for (a = 0; a < params->vocab_size; a++) {
-    // Hash will be re-computed, as it is not actual
-    hash = GetWordHash(params->vocab[a].word);
-    while (params->vocab_hash[hash] != -1) hash = (hash + 1) % vocab_hash_size;
-    params->vocab_hash[hash] = a;
   }
+  params->vocab_size = b;
+  RepackVocabWords(params);
+  // Hash will be re-computed, as it is not actual
+  ResetVocabHash(params);
   fflush(stdout);
-  min_reduce++;
+  params->min_reduce++;
 }
 
 // Create binary Huffman tree using the word counts
 // Frequent words will have short uniqe binary codes
+// Inner nodes are numbered (their syn1 rows) in breadth-first order from the root, so the top levels,
+// which lie on most paths, share a small prefix of syn1 that stays in cache. syn1 starts at zero, so
+// the numbering does not change what is learned.
 void CreateBinaryTree(struct train_params *params) {
-  long long a, b, i, min1i, min2i, pos1, pos2, point[MAX_CODE_LENGTH];
-  char code[MAX_CODE_LENGTH];
+  long long a, b, i, min1i, min2i, pos1, pos2, num_steps = 0, head, tail;
   long long *count = (long long *)calloc(params->vocab_size * 2 + 1, sizeof(long long));
   long long *binary = (long long *)calloc(params->vocab_size * 2 + 1, sizeof(long long));
   long long *parent_node = (long long *)calloc(params->vocab_size * 2 + 1, sizeof(long long));
+  long long *child = (long long *)malloc((params->vocab_size * 2 + 1) * sizeof(long long)); // children of inner node a at 2a, 2a + 1
+  long long *order = (long long *)malloc((params->vocab_size + 1) * sizeof(long long)); // inner nodes breadth first, then their rank
   for (a = 0; a < params->vocab_size; a++) count[a] = params->vocab[a].cn;
   for (a = params->vocab_size; a < params->vocab_size * 2; a++) count[a] = 1e15;
   pos1 = params->vocab_size - 1;
@@ -435,98 +1328,345 @@ void CreateBinaryTree(struct train_params *params) {
     parent_node[min1i] = params->vocab_size + a;
     parent_node[min2i] = params->vocab_size + a;
     binary[min2i] = 1;
+    child[2 * a] = min1i;
+    child[2 * a + 1] = min2i;
   }
-  // Now assign binary code to each vocabulary word
+  // breadth-first order of the inner nodes (root: vocab_size - 2), turned in place into rank[node]
+  tail = 0;
+  if (params->vocab_size > 1) order[tail++] = params->vocab_size - 2;
+  for (head = 0; head < tail; head++) for (i = 0; i < 2; i++) {
+    b = child[2 * order[head] + i];
+    if (b >= params->vocab_size) order[tail++] = b - params->vocab_size;
+  }
+  for (head = 0; head < tail; head++) child[order[head]] = head;
+  for (a = 0; a < tail; a++) order[a] = child[a];
+  // Now assign binary code to each vocabulary word. A parent comes after its children, so the depths
+  // (reusing count) fill in from the root down, and give every word its place in code_steps
+  count[params->vocab_size * 2 - 2] = 0;
+  for (b = params->vocab_size * 2 - 3; b >= 0; b--) count[b] = count[parent_node[b]] + 1;
+  for (a = 0; a < params->vocab_size; a++) num_steps += count[a];
+  free(params->code_block);
+  params->code_block = (char *)malloc((params->vocab_size + 1) * sizeof(long long) + num_steps * sizeof(unsigned int));
+  if (params->code_block == NULL) {
+    printf("Memory allocation failed\n");
+    exit(1);
+  }
+  params->code_offset = (long long *)params->code_block;
+  params->code_steps = (unsigned int *)(params->code_offset + params->vocab_size + 1);
+  params->code_offset[0] = 0;
+  for (a = 0; a < params->vocab_size; a++) params->code_offset[a + 1] = params->code_offset[a] + count[a];
+  // walking up from the leaf, the node at depth i is reached by step i - 1, taken at its parent
   for (a = 0; a < params->vocab_size; a++) {
-    b = a;
-    i = 0;
-    while (1) {
-      code[i] = binary[b];
-      point[i] = b;
-      i++;
-      b = parent_node[b];
-      if (b == params->vocab_size * 2 - 2) break;
-    }
-    params->vocab[a].codelen = i;
-    params->vocab[a].point[0] = params->vocab_size - 2;
-    for (b = 0; b < i; b++) {
-      params->vocab[a].code[i - b - 1] = code[b];
-      params->vocab[a].point[i - b] = point[b] - params->vocab_size;
-    }
+    i = params->code_offset[a + 1];
+    for (b = a; b != params->vocab_size * 2 - 2; b = parent_node[b])
+      params->code_steps[--i] = (unsigned int)order[parent_node[b] - params->vocab_size] << 1 | binary[b];
   }
   free(count);
   free(binary);
   free(parent_node);
+  free(child);
+  free(order);
 }
 
-void CountWordsFromTrainFile(struct train_params *params) {
-  char word[MAX_STRING];
-  FILE *fin;
+struct train_params *InitTrainParams(long long hash_size) {
+  struct train_params *params = calloc(1, sizeof(struct train_params));
 
-  if (debug_mode > 0) printf("# Count words from %s\n", params->train_file);
+  params->train_words = 0;
+  params->word_count_actual = 0;
+  params->file_size = 0;
+  params->file_words = -1;
+  params->num_lines = 0;
+  params->train_source = NULL;
+  params->ids = NULL;
+  params->num_ids = 0;
 
-  fin = fopen(params->train_file, "rb");
-  if (fin == NULL) {
-    printf("ERROR: training data file not found!\n");
-    exit(1);
-  }
+  params->vocab_size = 0;
+  params->vocab_max_size = 1000;
+  params->vocab = (struct vocab_word *)calloc(params->vocab_max_size, sizeof(struct vocab_word));
+  params->vocab_hash_size = hash_size;
+  params->vocab_hash_cap = VOCAB_HASH_MIN_CAP;
+  params->vocab_hash = AllocVocabHash(params->vocab_hash_cap);
+  params->vocab_hash_old = NULL;
+  params->min_reduce = 1;
 
-  while (1) {
-    ReadWord(word, fin);
-    if (feof(fin)) break;
-    params->train_words++;
-    if ((debug_mode > 1) && (params->train_words % 100000 == 0)) {
-      printf("%lldK%c", params->train_words / 1000, 13);
-      fflush(stdout);
-    }
-  }
-  if (debug_mode > 0) {
-    printf("  Words in train file: %lld\n", params->train_words);
-  }
-  params->file_size = ftell(fin);
-  fclose(fin);
+  return params;
 }
 
+// Frees the vocabulary of a thread-local train_params
+void FreeTrainParams(struct train_params *params) {
+  ArenaFree(&params->vocab_arena);
+  free(params->vocab);
+  free(params->code_block);
+  free(params->vocab_hash);
+  free(params->vocab_hash_old);
+  free(params);
+}
 
-void LearnVocabFromTrainFile(struct train_params *params) {
-  char word[MAX_STRING];
-  FILE *fin;
-  long long a, i;
-
-  if (debug_mode > 0) printf("# Learn vocab from %s\n", params->train_file);
+/** Sketch vocab counting **/
+// With -vocab-sketch, LearnVocabFromTrainFile reads the training file twice. The first pass only adds
+// every token to a count-min sketch: SKETCH_DEPTH rows of saturating counters indexed by independent
+// hashes of the word, shared by all threads. A row counter never under-counts a word, so the minimum
+// over the rows is an upper bound of its count. The second pass counts exactly only the words whose
+// estimate reaches min_count; every word that survives the min_count cut in the exact mode is among
+// them and gets its exact count, so the vocab file is unchanged while the hash only holds candidates.
+#define SKETCH_DEPTH 4
+
+struct count_sketch {
+  unsigned int *counts; // SKETCH_DEPTH rows of width counters
+  long long width; // a power of two
+  unsigned int limit; // counters stop at limit, only "below min_count or not" matters
+};
 
-  for (a = 0; a < vocab_hash_size; a++) params->vocab_hash[a] = -1;
-  fin = fopen(params->train_file, "rb");
-  if (fin == NULL) {
-    printf("ERROR: training data file not found!\n");
+struct count_sketch *CreateSketch(long long mb, unsigned int limit) {
+  struct count_sketch *sketch = (struct count_sketch *)calloc(1, sizeof(struct count_sketch));
+  sketch->width = 1;
+  while (sketch->width * 2 * SKETCH_DEPTH * sizeof(unsigned int) <= (unsigned long long)mb << 20) sketch->width *= 2;
+  sketch->counts = (unsigned int *)calloc(sketch->width * SKETCH_DEPTH, sizeof(unsigned int));
+  if (sketch->counts == NULL) {
+    printf("ERROR: can't allocate a %lldMB vocab sketch\n", mb);
     exit(1);
   }
+  sketch->limit = limit;
+  return sketch;
+}
 
-  params->vocab_size = 0;
-  AddWordToVocab((char *)"</s>", params);
+void FreeSketch(struct count_sketch *sketch) {
+  free(sketch->counts);
+  free(sketch);
+}
+
+// Counter of word in row r: double hashing over the two halves of WordHash
+static inline unsigned int *SketchCell(struct count_sketch *sketch, unsigned long long hash, int r) {
+  unsigned long long h1 = hash & 0xffffffffULL, h2 = (hash >> 32) | 1;
+  return sketch->counts + r * sketch->width + ((h1 + r * h2) & (sketch->width - 1));
+}
+
+void SketchAdd(struct count_sketch *sketch, unsigned long long hash) {
+  unsigned int *cell;
+  int r;
+  for (r = 0; r < SKETCH_DEPTH; r++) {
+    cell = SketchCell(sketch, hash, r);
+    // saturated cells are only read, so frequent words don't bounce cache lines between threads
+    if (*cell < sketch->limit) __sync_fetch_and_add(cell, 1);
+  }
+}
+
+unsigned int SketchEstimate(struct count_sketch *sketch, unsigned long long hash) {
+  unsigned int c, est = *SketchCell(sketch, hash, 0);
+  int r;
+  for (r = 1; r < SKETCH_DEPTH; r++) if ((c = *SketchCell(sketch, hash, r)) < est) est = c;
+  return est;
+}
+/** End Sketch vocab counting **/
+
+/** Parallel vocab learning **/
+// The training file is split into num_threads byte ranges snapped to line starts. Each worker
+// counts its range into a thread-local vocab (with its own ReduceVocab pruning under a 1/num_threads
+// share of the usual hash memory), and the shards are merged in file order, so the merged vocab lists
+// words in first-occurrence order exactly like a sequential pass and sorts to the same vocab file.
+struct vocab_shard {
+  struct train_params *params; // thread-local vocab, NULL when only counting words
+  char *train_file;
+  struct corpus_source *source; // mapped train_file, NULL to read the whole file through stdio
+  struct count_sketch *sketch; // filled when params is NULL, otherwise only its candidates are counted
+  long long start, end;
+  long long words;
+  long long skipped; // words left out as non-candidates
+};
+
+long long vocab_words_read; // progress over all shards
+
+// Offset of the first line that starts at or after pos
+long long NextLineStart(struct corpus_source *source, long long pos) {
+  struct corpus_reader reader;
+  int ch;
+  if (pos <= 0 || pos >= source->size) return pos;
+  OpenSourceReader(&reader, source, pos - 1, source->size);
+  while ((ch = ReaderGetc(&reader)) >= 0 && ch != '\n');
+  pos = (ch < 0) ? source->size : ReaderOffset(&reader);
+  CloseCorpusReader(&reader);
+  return pos;
+}
+
+// Splits the text of source into num_parts ranges that start right after a newline
+void SplitAtLines(struct corpus_source *source, int num_parts, long long *starts) {
+  long long pos;
+  int b;
+  starts[0] = 0;
+  for (b = 1; b < num_parts; b++) {
+    pos = source->size * b / num_parts;
+    if (pos < starts[b - 1]) pos = starts[b - 1];
+    starts[b] = NextLineStart(source, pos);
+  }
+  starts[num_parts] = source->size;
+}
+
+void *LearnVocabThread(void *arg) {
+  struct vocab_shard *shard = (struct vocab_shard *)arg;
+  struct train_params *params = shard->params;
+  struct corpus_reader reader;
+  char word[MAX_STRING];
+  long long a, i, total;
+  unsigned long long hash;
+
+  if (shard->source != NULL) OpenSourceReader(&reader, shard->source, shard->start, shard->end);
+  else OpenCorpusReader(&reader, shard->train_file, 0);
+  if (params != NULL) AddWordToVocab((char *)"</s>", params);
   while (1) {
-    ReadWord(word, fin);
-    if (feof(fin)) break;
-    params->train_words++;
-    if ((debug_mode > 1) && (params->train_words % 100000 == 0)) {
-      printf("%lldK%c", params->train_words / 1000, 13);
-      fflush(stdout);
+    ReaderReadWord(word, &reader, &hash);
+    if (reader.eof) break;
+    shard->words++;
+    if (shard->words % 100000 == 0) {
+      total = __sync_add_and_fetch(&vocab_words_read, 100000);
+      if (debug_mode > 1) {
+        printf("%lldK%c", total / 1000, 13);
+        fflush(stdout);
+      }
     }
-    i = SearchVocab(word, params->vocab, params->vocab_hash);
+    if (shard->sketch != NULL) {
+      if (params == NULL) {
+        SketchAdd(shard->sketch, hash);
+        continue;
+      }
+      if (SketchEstimate(shard->sketch, hash) < (unsigned int)min_count) {
+        shard->skipped++;
+        continue;
+      }
+    }
+    if (params == NULL) continue;
+    i = SearchVocabHash(word, (unsigned int)hash, params);
 
     if (i == -1) {
       a = AddWordToVocab(word, params);
       params->vocab[a].cn = 1;
     } else params->vocab[i].cn++;
-    if (params->vocab_size > vocab_hash_size * 0.7) ReduceVocab(params);
+    if (params->vocab_size > params->vocab_hash_size * 0.7) ReduceVocab(params);
   }
+  CloseCorpusReader(&reader);
+  return NULL;
+}
+
+// Runs LearnVocabThread over the training file; learn = 0 only counts words (and fills sketch if given),
+// learn = 1 with a sketch only counts its candidates.
+// Returns the shards, whose vocabs the caller merges and frees; *num_shards is set to their number.
+struct vocab_shard *RunVocabShards(struct train_params *params, int learn, struct count_sketch *sketch, int *num_shards) {
+  long long *starts;
+  struct corpus_source *source = OpenSource(params->train_file);
+  struct vocab_shard *shards;
+  pthread_t *pt;
+  int b;
+
+  if (access(params->train_file, R_OK) != 0) {
+    printf("ERROR: training data file not found!\n");
+    exit(1);
+  }
+  *num_shards = (source == NULL) ? 1 : num_threads; // without a mapping, read the whole file through stdio
+  starts = (long long *)malloc((*num_shards + 1) * sizeof(long long));
+  if (source != NULL) SplitAtLines(source, *num_shards, starts);
+  else starts[0] = starts[1] = 0;
+
+  shards = (struct vocab_shard *)calloc(*num_shards, sizeof(struct vocab_shard));
+  pt = (pthread_t *)malloc(*num_shards * sizeof(pthread_t));
+  vocab_words_read = 0;
+  for (b = 0; b < *num_shards; b++) {
+    shards[b].params = learn ? InitTrainParams(params->vocab_hash_size / *num_shards) : NULL;
+    shards[b].train_file = params->train_file;
+    shards[b].source = source;
+    shards[b].sketch = sketch;
+    shards[b].start = starts[b];
+    shards[b].end = starts[b + 1];
+    pthread_create(&pt[b], NULL, LearnVocabThread, (void *)&shards[b]);
+  }
+  for (b = 0; b < *num_shards; b++) pthread_join(pt[b], NULL);
+
+  if (source != NULL) {
+    params->file_size = source->size;
+    CloseSource(source);
+  } else {
+    struct stat st;
+    if (stat(params->train_file, &st) == 0) params->file_size = st.st_size;
+  }
+  free(starts);
+  free(pt);
+  return shards;
+}
+
+void CountWordsFromTrainFile(struct train_params *params) {
+  struct vocab_shard *shards;
+  int b, num_shards;
+
+  if (debug_mode > 0) printf("# Count words from %s\n", params->train_file);
+
+  shards = RunVocabShards(params, 0, NULL, &num_shards);
+  params->train_words = 0;
+  for (b = 0; b < num_shards; b++) params->train_words += shards[b].words;
+  params->file_words = params->train_words;
+  free(shards);
+  if (debug_mode > 0) {
+    printf("  Words in train file: %lld\n", params->train_words);
+  }
+}
+
+
+// Counts every word of train_file into the vocab (unsorted, no min_count cut) and sets file_words.
+// Returns the highest ReduceVocab threshold hit, 0 if the counts are exact.
+long long CountVocabFromTrainFile(struct train_params *params) {
+  struct vocab_shard *shards;
+  struct train_params *shard;
+  struct count_sketch *sketch = NULL;
+  long long a, i, skipped = 0, pruned = 0;
+  int b, num_shards;
+
+  params->vocab_size = 0;
+  ResetVocabHash(params);
+  AddWordToVocab((char *)"</s>", params);
+
+  if (vocab_sketch > 0) {
+    sketch = CreateSketch(vocab_sketch, min_count);
+    free(RunVocabShards(params, 0, sketch, &num_shards));
+  }
+  shards = RunVocabShards(params, 1, sketch, &num_shards);
+  for (b = 0; b < num_shards; b++) {
+    params->train_words += shards[b].words;
+    skipped += shards[b].skipped;
+    shard = shards[b].params;
+    for (a = 0; a < shard->vocab_size; a++) {
+      i = SearchVocab(shard->vocab[a].word, params);
+      if (i == -1) i = AddWordToVocab(shard->vocab[a].word, params);
+      params->vocab[i].cn += shard->vocab[a].cn;
+      if (params->vocab_size > params->vocab_hash_size * 0.7) ReduceVocab(params);
+    }
+    if (shard->min_reduce - 1 > pruned) pruned = shard->min_reduce - 1;
+    FreeTrainParams(shard);
+  }
+  free(shards);
+  if (params->min_reduce - 1 > pruned) pruned = params->min_reduce - 1;
+  if (sketch != NULL) {
+    // Count-min bound: an estimate exceeds the true count by at most e*N/width with probability
+    // at least 1 - e^-depth, N being the number of tokens
+    if (debug_mode > 0) {
+      printf("  Vocab sketch: %d x %lld counters, estimates within +%.1f of the counts with probability %.4f\n",
+          SKETCH_DEPTH, sketch->width, exp(1) * params->train_words / sketch->width, 1 - exp(-SKETCH_DEPTH));
+      printf("  Vocab sketch: %lld candidate words, %lld tokens of other words skipped\n", params->vocab_size, skipped);
+    }
+    FreeSketch(sketch);
+  }
+  params->file_words = params->train_words;
+  return pruned;
+}
+
+void LearnVocabFromTrainFile(struct train_params *params) {
+  long long a;
+
+  if (debug_mode > 0) printf("# Learn vocab from %s\n", params->train_file);
+  CountVocabFromTrainFile(params);
 
   // check <unk>
-  int unk_id = params->vocab_hash[GetWordHash(unk_word)];
+  int unk_id = SearchVocab(unk_word, params);
   if (unk_id<0){
     fprintf(stderr, "! Can't find %s in the vocab file %s, adding ...\n", unk_word, params->train_file);
     a = AddWordToVocab(unk_word, params);
-    unk_id = params->vocab_hash[GetWordHash(unk_word)];
+    unk_id = a;
     fprintf(stderr, "  unk_id = %d\n", unk_id);
     params->vocab[a].cn = min_count;
   }
@@ -536,9 +1676,56 @@ void LearnVocabFromTrainFile(struct train_params *params) {
     printf("  Vocab size: %lld\n", params->vocab_size);
     printf("  Words in train file: %lld\n", params->train_words);
   }
-  params->file_size = ftell(fin);
-  fclose(fin);
 }
+/** End Parallel vocab learning **/
+
+/** Vocab shards **/
+// A vocab shard holds the raw counts of one corpus shard, so vocabs counted on several machines can
+// be summed by bivec-vocab-merge, which applies min_count only at the end. It is a vocab file with
+// a header line "#bivec-vocab train_words <tokens> pruned <threshold>" and </s> first, the other
+// words in strcmp order, each line "word count rank" with rank the word's place in order of first
+// occurrence (its id before the sort), which lets the merge break count ties as SortVocab does;
+// pruned is the ReduceVocab threshold hit while counting (words with up to that many occurrences
+// may be missing), 0 when the counts are exact. ReadVocab accepts the header, so a merged vocab
+// with it also tells MonoInit the number of tokens in the corpus.
+#define VOCAB_HEADER "#bivec-vocab"
+
+struct train_params *vocab_sort_params; // qsort has no context argument
+
+int VocabWordCompare(const void *a, const void *b) {
+  return strcmp(vocab_sort_params->vocab[*(long long *)a].word, vocab_sort_params->vocab[*(long long *)b].word);
+}
+
+void SaveVocabShard(struct train_params *params, const char *file_name, long long pruned) {
+  long long a, *order = (long long *)malloc(params->vocab_size * sizeof(long long));
+  FILE *fo = fopen(file_name, "wb");
+  if (fo == NULL) {
+    printf("ERROR: can't write %s\n", file_name);
+    exit(1);
+  }
+  for (a = 0; a < params->vocab_size; a++) order[a] = a;
+  vocab_sort_params = params;
+  qsort(&order[1], params->vocab_size - 1, sizeof(long long), VocabWordCompare); // vocab[0] is </s>
+  fprintf(fo, "%s train_words %lld pruned %lld\n", VOCAB_HEADER, params->file_words, pruned);
+  for (a = 0; a < params->vocab_size; a++) fprintf(fo, "%s %lld %lld\n", params->vocab[order[a]].word, params->vocab[order[a]].cn, order[a]);
+  fclose(fo);
+  free(order);
+}
+
+// -vocab-shard 1: writes train_file.vocab.shard with the raw counts of train_file
+void CountVocabShard(struct train_params *params) {
+  char file_name[MAX_STRING + 16];
+  long long pruned;
+  if (debug_mode > 0) printf("# Count vocab shard of %s\n", params->train_file);
+  pruned = CountVocabFromTrainFile(params);
+  sprintf(file_name, "%s.vocab.shard", params->train_file);
+  SaveVocabShard(params, file_name, pruned);
+  if (debug_mode > 0) {
+    printf("  Words: %lld, tokens: %lld, pruned: %lld\n", params->vocab_size, params->file_words, pruned);
+    printf("# Saved vocab shard %s\n", file_name);
+  }
+}
+/** End Vocab shards **/
 
 void SaveVocab(struct train_params *params) {
   long long i;
@@ -548,7 +1735,7 @@ void SaveVocab(struct train_params *params) {
 }
 
 void ReadVocab(struct train_params *params) {
-  long long a, i = 0;
+  long long a, i = 0, file_words, pruned;
   char c;
   char word[MAX_STRING];
   FILE *fin = fopen(params->vocab_file, "rb");
@@ -556,8 +1743,12 @@ void ReadVocab(struct train_params *params) {
     printf("Vocabulary file not found\n");
     exit(1);
   }
-  for (a = 0; a < vocab_hash_size; a++) params->vocab_hash[a] = -1;
   params->vocab_size = 0;
+  ResetVocabHash(params);
+  if (fscanf(fin, VOCAB_HEADER " train_words %lld pruned %lld%c", &file_words, &pruned, &c) == 3) {
+    params->file_words = file_words;
+    if (pruned >= min_count) printf("! %s was pruned at %lld occurrences, some words with min-count %d may be missing\n", params->vocab_file, pruned, min_count);
+  } else rewind(fin);
   while (1) {
     ReadWord(word, fin);
     if (feof(fin)) break;
@@ -570,90 +1761,990 @@ void ReadVocab(struct train_params *params) {
     printf("Vocab size: %lld\n", params->vocab_size);
     printf("Words in train file: %lld\n", params->train_words);
   }
-  fin = fopen(params->train_file, "rb");
-  if (fin == NULL) {
+  struct stat st; // stat rather than fopen, which would block on a named pipe
+  if (stat(params->train_file, &st) == 0) params->file_size = st.st_size;
+  else if (!stream_input) {
     printf("ERROR: training data file not found!\n");
     exit(1);
   }
-  fseek(fin, 0, SEEK_END);
-  params->file_size = ftell(fin);
-  fclose(fin);
 }
 
+/** Binary vocab **/
+// vocab_file.bin holds the vocab as MonoInit leaves it: the sorted words and counts, train_words,
+// the Huffman codes and points and the negative sampling distribution, so a restart maps one file
+// instead of parsing and sorting the text vocab, rebuilding the tree and rescanning train_file for
+// its word count. It is tied to the text vocab (size and mtime) and to min_count; the token count of
+// train_file is only reused while train_file is unchanged. Layout: header | long long cn[vocab_size]
+// | double noise_prob[vocab_size + 1] | long long code_offset[vocab_size + 1] | unsigned int code_steps[]
+// | char words[], each section starting on an 8-byte boundary. The Huffman paths are used in place.
+#define BINARY_VOCAB_MAGIC "BVCVOC03"
+
+struct binary_vocab_header {
+  char magic[8];
+  long long vocab_size, min_count;
+  long long vocab_file_size, vocab_file_mtime;
+  long long train_words; // sum of the vocab counts
+  long long file_words, source_size, source_mtime; // tokens in train_file (-1: unknown) when it had this size and mtime
+  long long noise_offset, code_offset_offset, code_step_offset, word_offset, total_size;
+};
+
+static long long Align8(long long pos) {
+  return (pos + 7) & ~7LL;
+}
+
+// Maps vocab_bin_file if it matches vocab_file and min_count; returns 0 otherwise
+int LoadBinaryVocab(struct train_params *params) {
+  struct binary_vocab_header header;
+  struct stat st, train_st;
+  long long a, size, *cn;
+  char *data, *words;
+
+  if (stat(params->vocab_file, &st) != 0) return 0;
+  data = MapFile(params->vocab_bin_file, &size);
+  if (data == NULL) return 0;
+  if (size < (long long)sizeof(header)) {
+    munmap(data, size);
+    return 0;
+  }
+  memcpy(&header, data, sizeof(header));
+  if (memcmp(header.magic, BINARY_VOCAB_MAGIC, 8) || header.min_count != min_count
+      || header.vocab_file_size != (long long)st.st_size || header.vocab_file_mtime != (long long)st.st_mtime
+      || header.total_size != size) {
+    printf("  %s is stale\n", params->vocab_bin_file);
+    munmap(data, size);
+    return 0;
+  }
+  madvise(data, size, MADV_WILLNEED);
+
+  cn = (long long *)(data + sizeof(header));
+  words = data + header.word_offset;
+  params->vocab_size = header.vocab_size;
+  params->vocab_max_size = header.vocab_size + 1;
+  params->vocab = (struct vocab_word *)realloc(params->vocab, params->vocab_max_size * sizeof(struct vocab_word));
+  for (a = 0; a < params->vocab_size; a++) {
+    params->vocab[a].cn = cn[a];
+    params->vocab[a].word = words;
+    words += strlen(words) + 1;
+  }
+  free(params->code_block);
+  params->code_block = NULL;
+  params->code_offset = (long long *)(data + header.code_offset_offset);
+  params->code_steps = (unsigned int *)(data + header.code_step_offset);
+  memset(&params->vocab[params->vocab_size], 0, sizeof(struct vocab_word));
+  ResetVocabHash(params);
+  params->noise_prob = (double *)(data + header.noise_offset);
+  params->train_words = header.train_words;
+  if (header.file_words >= 0 && stat(params->train_file, &train_st) == 0
+      && header.source_size == (long long)train_st.st_size && header.source_mtime == (long long)train_st.st_mtime)
+    params->file_words = header.file_words;
+  if (stat(params->train_file, &train_st) == 0) params->file_size = train_st.st_size;
+  if (debug_mode > 0) printf("# Loaded binary vocab %s: %lld words\n", params->vocab_bin_file, params->vocab_size);
+  return 1;
+}
+
+// Writes vocab_bin_file for the current vocab, whose codes must be built; a failed write only costs the next run time
+void SaveBinaryVocab(struct train_params *params) {
+  struct binary_vocab_header header;
+  struct stat st, train_st;
+  char tmp_file[MAX_STRING + 4], pad[8];
+  long long a, pos, num_steps = params->code_offset[params->vocab_size];
+  FILE *fo;
+
+  if (stat(params->vocab_file, &st) != 0) return;
+  if (params->noise_prob == NULL) params->noise_prob = NoiseProbs(params);
+
+  memset(&header, 0, sizeof(header));
+  memcpy(header.magic, BINARY_VOCAB_MAGIC, 8);
+  header.vocab_size = params->vocab_size;
+  header.min_count = min_count;
+  header.vocab_file_size = st.st_size;
+  header.vocab_file_mtime = st.st_mtime;
+  header.train_words = 0;
+  for (a = 0; a < params->vocab_size; a++) header.train_words += params->vocab[a].cn;
+  header.file_words = -1;
+  if (params->file_words >= 0 && stat(params->train_file, &train_st) == 0 && S_ISREG(train_st.st_mode)) {
+    header.file_words = params->file_words;
+    header.source_size = train_st.st_size;
+    header.source_mtime = train_st.st_mtime;
+  }
+  header.noise_offset = sizeof(header) + params->vocab_size * sizeof(long long);
+  header.code_offset_offset = header.noise_offset + (params->vocab_size + 1) * sizeof(double);
+  header.code_step_offset = header.code_offset_offset + (params->vocab_size + 1) * sizeof(long long);
+  header.word_offset = Align8(header.code_step_offset + num_steps * sizeof(unsigned int));
+  header.total_size = header.word_offset;
+  for (a = 0; a < params->vocab_size; a++) header.total_size += strlen(params->vocab[a].word) + 1;
+
+  sprintf(tmp_file, "%s.tmp", params->vocab_bin_file);
+  fo = fopen(tmp_file, "wb");
+  if (fo == NULL) {
+    printf("  can't write %s\n", tmp_file);
+    return;
+  }
+  memset(pad, 0, sizeof(pad));
+  fwrite(&header, sizeof(header), 1, fo);
+  for (a = 0; a < params->vocab_size; a++) fwrite(&params->vocab[a].cn, sizeof(long long), 1, fo);
+  fwrite(params->noise_prob, sizeof(double), params->vocab_size + 1, fo);
+  fwrite(params->code_offset, sizeof(long long), params->vocab_size + 1, fo);
+  fwrite(params->code_steps, sizeof(unsigned int), num_steps, fo);
+  pos = header.code_step_offset + num_steps * sizeof(unsigned int);
+  fwrite(pad, 1, header.word_offset - pos, fo);
+  for (a = 0; a < params->vocab_size; a++) fwrite(params->vocab[a].word, 1, strlen(params->vocab[a].word) + 1, fo);
+  if (fclose(fo) != 0 || rename(tmp_file, params->vocab_bin_file) != 0) {
+    printf("  can't write %s\n", params->vocab_bin_file);
+    unlink(tmp_file);
+    return;
+  }
+  if (debug_mode > 0) printf("# Saved binary vocab %s\n", params->vocab_bin_file);
+}
+/** End Binary vocab **/
+
+// With -bf16 the matrices are allocated as bfloat16 only; syn0 is drawn as floats, one row at a time
+// through row, and rounded to bf16 with its own random stream so the draws are those of the float run.
 void InitNet(struct train_params *params) {
   long long a, b;
-  unsigned long long next_random = 1;
-  a = posix_memalign((void **)&params->syn0, 128, (long long)params->vocab_size * layer1_size * sizeof(real));
+  unsigned long long next_random = 1, round_random = 1;
+  real row[layer1_stride];
+  if (bf16) {
+    a = posix_memalign((void **)&params->syn0_bf16, 128, (long long)params->vocab_size * layer1_stride * sizeof(unsigned short));
+    if (params->syn0_bf16 == NULL) {printf("Memory allocation failed\n"); exit(1);}
+    if (hs) {
+      a = posix_memalign((void **)&params->syn1_bf16, 128, (long long)params->vocab_size * layer1_stride * sizeof(unsigned short));
+      if (params->syn1_bf16 == NULL) {printf("Memory allocation failed\n"); exit(1);}
+      memset(params->syn1_bf16, 0, (long long)params->vocab_size * layer1_stride * sizeof(unsigned short));
+    }
+    if (negative > 0) {
+      a = posix_memalign((void **)&params->syn1neg_bf16, 128, (long long)params->vocab_size * layer1_stride * sizeof(unsigned short));
+      if (params->syn1neg_bf16 == NULL) {printf("Memory allocation failed\n"); exit(1);}
+      memset(params->syn1neg_bf16, 0, (long long)params->vocab_size * layer1_stride * sizeof(unsigned short));
+    }
+    for (a = 0; a < params->vocab_size; a++) {
+      for (b = 0; b < layer1_stride; b++) {
+        if (b >= layer1_size) {
+          row[b] = 0;
+          continue;
+        }
+        next_random = next_random * (unsigned long long)25214903917 + 11;
+        row[b] = (((next_random & 0xFFFF) / (real)65536) - 0.5) / layer1_size;
+      }
+      vk.store_bf16(row, params->syn0_bf16 + a * layer1_stride, layer1_stride, &round_random);
+    }
+    return;
+  }
+  a = posix_memalign((void **)&params->syn0, 128, (long long)params->vocab_size * layer1_stride * sizeof(real));
   if (params->syn0 == NULL) {printf("Memory allocation failed\n"); exit(1);}
   if (hs) {
     // this is because the number of nodes in a tree is approximately the number of words.
-    a = posix_memalign((void **)&params->syn1, 128, (long long)params->vocab_size * layer1_size * sizeof(real));
+    a = posix_memalign((void **)&params->syn1, 128, (long long)params->vocab_size * layer1_stride * sizeof(real));
     if (params->syn1 == NULL) {printf("Memory allocation failed\n"); exit(1);}
-    for (a = 0; a < params->vocab_size; a++) for (b = 0; b < layer1_size; b++)
-     params->syn1[a * layer1_size + b] = 0;
+    for (a = 0; a < params->vocab_size; a++) for (b = 0; b < layer1_stride; b++)
+     params->syn1[a * layer1_stride + b] = 0;
   }
   if (negative>0) {
-    a = posix_memalign((void **)&params->syn1neg, 128, (long long)params->vocab_size * layer1_size * sizeof(real));
+    a = posix_memalign((void **)&params->syn1neg, 128, (long long)params->vocab_size * layer1_stride * sizeof(real));
     if (params->syn1neg == NULL) {printf("Memory allocation failed\n"); exit(1);}
-    for (a = 0; a < params->vocab_size; a++) for (b = 0; b < layer1_size; b++)
-     params->syn1neg[a * layer1_size + b] = 0;
+    for (a = 0; a < params->vocab_size; a++) for (b = 0; b < layer1_stride; b++)
+     params->syn1neg[a * layer1_stride + b] = 0;
   }
-  for (a = 0; a < params->vocab_size; a++) for (b = 0; b < layer1_size; b++) {
+  for (a = 0; a < params->vocab_size; a++) for (b = 0; b < layer1_stride; b++) {
+    if (b >= layer1_size) {
+      params->syn0[a * layer1_stride + b] = 0; // padding, stays 0 in all three matrices
+      continue;
+    }
     next_random = next_random * (unsigned long long)25214903917 + 11;
-    params->syn0[a * layer1_size + b] = (((next_random & 0xFFFF) / (real)65536) - 0.5) / layer1_size;
+    params->syn0[a * layer1_stride + b] = (((next_random & 0xFFFF) / (real)65536) - 0.5) / layer1_size;
+  }
+}
+
+/** Line index **/
+// Block start points come from a sparse line index: the byte offset of (roughly) every
+// LINE_INDEX_STRIDE-th line, built with one parallel newline scan over the mapped file and kept in
+// a file.lines sidecar so later runs, with any number of threads, skip the scan. The offset of any
+// line is then a binary search plus a scan over at most 2 * LINE_INDEX_STRIDE lines. Offsets are
+// text offsets, so the index of a BGZF file is built and used through its readers.
+#define LINE_INDEX_MAGIC "BVCLIX01"
+#define LINE_INDEX_STRIDE 4096
+
+struct line_index_header {
+  char magic[8];
+  long long file_size, file_mtime; // of the indexed file
+  long long num_lines, num_entries;
+};
+
+// offset is where line starts
+struct line_index_entry {
+  long long line, offset;
+};
+
+struct line_scan {
+  struct corpus_source *source;
+  long long start, end;
+  long long num_lines; // newlines in [start, end)
+  long long num_entries, max_entries;
+  struct line_index_entry *entries; // line relative to start
+};
+
+void *ScanLinesThread(void *arg) {
+  struct line_scan *scan = (struct line_scan *)arg;
+  struct corpus_reader reader;
+
+  scan->num_lines = 0;
+  scan->num_entries = 0;
+  scan->max_entries = 64;
+  scan->entries = (struct line_index_entry *)malloc(scan->max_entries * sizeof(struct line_index_entry));
+  OpenSourceReader(&reader, scan->source, scan->start, scan->end);
+  while (ReaderSkipLines(&reader, 1)) {
+    if (++scan->num_lines % LINE_INDEX_STRIDE == 0) {
+      if (scan->num_entries == scan->max_entries) {
+        scan->max_entries *= 2;
+        scan->entries = (struct line_index_entry *)realloc(scan->entries, scan->max_entries * sizeof(struct line_index_entry));
+      }
+      scan->entries[scan->num_entries].line = scan->num_lines;
+      scan->entries[scan->num_entries].offset = ReaderOffset(&reader);
+      scan->num_entries++;
+    }
   }
-  CreateBinaryTree(params);
+  CloseCorpusReader(&reader);
+  return NULL;
 }
 
-// To find split points in a file, so that later each thread can handle one chunk of the data
+// Builds the index of source with num_threads parallel scans; returns the entries, sorted by line
+struct line_index_entry *BuildLineIndex(struct corpus_source *source, long long *num_lines, long long *num_entries) {
+  struct line_scan *scans = (struct line_scan *)calloc(num_threads, sizeof(struct line_scan));
+  pthread_t *pt = (pthread_t *)malloc(num_threads * sizeof(pthread_t));
+  struct line_index_entry *entries;
+  long long a, n = 1;
+  int b;
+
+  for (b = 0; b < num_threads; b++) {
+    scans[b].source = source;
+    scans[b].start = source->size * b / num_threads;
+    scans[b].end = source->size * (b + 1) / num_threads;
+    pthread_create(&pt[b], NULL, ScanLinesThread, (void *)&scans[b]);
+  }
+  for (b = 0; b < num_threads; b++) pthread_join(pt[b], NULL);
+
+  for (b = 0; b < num_threads; b++) n += scans[b].num_entries;
+  entries = (struct line_index_entry *)malloc(n * sizeof(struct line_index_entry));
+  entries[0].line = entries[0].offset = 0;
+  *num_lines = 0;
+  n = 1;
+  for (b = 0; b < num_threads; b++) {
+    for (a = 0; a < scans[b].num_entries; a++) {
+      entries[n].line = *num_lines + scans[b].entries[a].line;
+      entries[n].offset = scans[b].entries[a].offset;
+      n++;
+    }
+    *num_lines += scans[b].num_lines;
+    free(scans[b].entries);
+  }
+  *num_entries = n;
+  free(scans);
+  free(pt);
+  return entries;
+}
+
+// Loads file.lines if it was built from the current file; returns NULL otherwise
+struct line_index_entry *LoadLineIndex(const char *index_file, const struct stat *st, long long *num_lines, long long *num_entries) {
+  struct line_index_header header;
+  struct line_index_entry *entries;
+  FILE *fin = fopen(index_file, "rb");
+
+  if (fin == NULL) return NULL;
+  if (fread(&header, sizeof(header), 1, fin) != 1 || memcmp(header.magic, LINE_INDEX_MAGIC, 8)
+      || header.file_size != (long long)st->st_size || header.file_mtime != (long long)st->st_mtime) {
+    fclose(fin);
+    return NULL;
+  }
+  entries = (struct line_index_entry *)malloc(header.num_entries * sizeof(struct line_index_entry));
+  if (fread(entries, sizeof(struct line_index_entry), header.num_entries, fin) != header.num_entries) {
+    free(entries);
+    fclose(fin);
+    return NULL;
+  }
+  fclose(fin);
+  *num_lines = header.num_lines;
+  *num_entries = header.num_entries;
+  return entries;
+}
+
+void SaveLineIndex(const char *index_file, const struct stat *st, long long num_lines, const struct line_index_entry *entries, long long num_entries) {
+  struct line_index_header header;
+  char tmp_file[MAX_STRING + 4];
+  FILE *fo;
+
+  if (snprintf(tmp_file, sizeof(tmp_file), "%s.tmp", index_file) >= (int)sizeof(tmp_file)) {
+    printf("! Can't write %s: path too long\n", index_file);
+    return;
+  }
+  fo = fopen(tmp_file, "wb");
+  if (fo == NULL) {
+    printf("! Can't write %s\n", index_file);
+    return;
+  }
+  memset(&header, 0, sizeof(header));
+  memcpy(header.magic, LINE_INDEX_MAGIC, 8);
+  header.file_size = st->st_size;
+  header.file_mtime = st->st_mtime;
+  header.num_lines = num_lines;
+  header.num_entries = num_entries;
+  fwrite(&header, sizeof(header), 1, fo);
+  fwrite(entries, sizeof(struct line_index_entry), num_entries, fo);
+  fclose(fo);
+  rename(tmp_file, index_file);
+}
+
+// Text offset where line starts (line <= num_lines; line num_lines starts right after the last newline)
+long long LineOffset(struct corpus_source *source, const struct line_index_entry *entries, long long num_entries, long long line) {
+  struct corpus_reader reader;
+  long long lo = 0, hi = num_entries - 1, mid, pos;
+  while (lo < hi) { // last entry with entries[lo].line <= line
+    mid = (lo + hi + 1) / 2;
+    if (entries[mid].line <= line) lo = mid;
+    else hi = mid - 1;
+  }
+  if (entries[lo].line == line) return entries[lo].offset;
+  OpenSourceReader(&reader, source, entries[lo].offset, source->size);
+  ReaderSkipLines(&reader, line - entries[lo].line);
+  pos = ReaderOffset(&reader);
+  CloseCorpusReader(&reader);
+  return pos;
+}
+/** End Line index **/
+
+// To find split points in a file, so that later each thread can handle one chunk of the data.
+// Block b holds lines [b * block_size, (b + 1) * block_size), so files with the same number of
+// lines (src, tgt and align) are split into the same line ranges.
 void ComputeBlockStartPoints(char* file_name, int num_blocks, long long **blocks, long long *num_lines) {
   printf("# ComputeBlockStartPoints %s, num_blocks=%d\n", file_name, num_blocks);
-  long long block_size;
-  int line_count = 0;
-  int curr_block = 0;
-  char line[MAX_SENT_LEN];
-  FILE *file;
+  char index_file[MAX_STRING + 8];
+  struct line_index_entry *entries;
+  long long block_size, line, num_entries;
+  struct corpus_source *source;
+  struct stat st;
+  int b;
+
+  source = OpenSource(file_name);
+  if (source == NULL || stat(file_name, &st) != 0) {
+    printf("ERROR: can't map %s\n", file_name);
+    exit(1);
+  }
+  sprintf(index_file, "%s.lines", file_name);
+  entries = LoadLineIndex(index_file, &st, num_lines, &num_entries);
+  if (entries != NULL) printf("  loaded line index %s\n", index_file);
+  else {
+    entries = BuildLineIndex(source, num_lines, &num_entries);
+    SaveLineIndex(index_file, &st, *num_lines, entries, num_entries);
+  }
 
-  *num_lines = 0;
-  file = fopen(file_name, "r");
+  block_size = (*num_lines - 1) / num_blocks + 1;
+  printf("  num_lines=%lld, block_size=%lld lines\n  blocks = [0", *num_lines, block_size);
+  *blocks = malloc((num_blocks+1) * sizeof(long long));
+  for (b = 0; b <= num_blocks; b++) {
+    line = b * block_size;
+    if (line > *num_lines) line = *num_lines;
+    (*blocks)[b] = LineOffset(source, entries, num_entries, line);
+    if (b > 0) printf(" %lld", (*blocks)[b]);
+  }
+  printf("]\n");
+
+  free(entries);
+  CloseSource(source);
+}
+
+/** Compiled corpus **/
+// With -compile-corpus 1, train_file is tokenized once into train_file.ids.minN: the word ids that
+// ReadWordIndex returns (-1 for unknown words, 0 = </s> ends a sentence), so later epochs and runs
+// skip tokenization and hash lookups. Layout: header | int ids[num_ids] | long long index[], where
+// index[k] is the id offset of line k * index_stride, padded to start on an 8-byte boundary.
+#define COMPILED_CORPUS_MAGIC "BVCIDS01"
+#define COMPILED_INDEX_STRIDE 1024
+
+struct compiled_corpus_header {
+  char magic[8];
+  unsigned long long vocab_fingerprint;
+  long long train_words;
+  long long source_size, source_mtime; // train_file when it was compiled
+  long long num_ids, num_lines, index_stride;
+};
+
+// Fingerprint of the vocabulary (words and counts), ties a compiled corpus to the vocab it was built with
+unsigned long long VocabFingerprint(struct train_params *params) {
+  unsigned long long hash = 14695981039346656037ULL; // FNV-1a
+  long long a;
+  char *ch;
+  for (a = 0; a < params->vocab_size; a++) {
+    for (ch = params->vocab[a].word; *ch; ch++) hash = (hash ^ (unsigned char)*ch) * 1099511628211ULL;
+    hash = (hash ^ (unsigned long long)params->vocab[a].cn) * 1099511628211ULL;
+  }
+  return hash;
+}
+
+long long CompiledIndexOffset(long long num_ids) {
+  return (sizeof(struct compiled_corpus_header) + num_ids * sizeof(int) + 7) & ~7LL;
+}
+
+// Maps train_file.ids.minN if it matches both train_file and the current vocab; returns 0 otherwise
+int LoadCompiledCorpus(struct train_params *params, long long *train_words) {
+  struct compiled_corpus_header header;
+  struct stat st;
+  char *data;
+  long long size;
+
+  if (stat(params->train_file, &st) != 0) return 0;
+  data = MapFile(params->compiled_file, &size);
+  if (data == NULL) return 0;
+  if (size < (long long)sizeof(header)) {
+    munmap(data, size);
+    return 0;
+  }
+  memcpy(&header, data, sizeof(header));
+  if (memcmp(header.magic, COMPILED_CORPUS_MAGIC, 8) || header.vocab_fingerprint != VocabFingerprint(params)
+      || header.source_size != (long long)st.st_size || header.source_mtime != (long long)st.st_mtime
+      || size < CompiledIndexOffset(header.num_ids) + (header.num_lines / header.index_stride + 1) * (long long)sizeof(long long)) {
+    printf("  %s is stale\n", params->compiled_file);
+    munmap(data, size);
+    return 0;
+  }
+
+  params->ids = (int *)(data + sizeof(header));
+  params->num_ids = header.num_ids;
+  params->num_lines = header.num_lines;
+  *train_words = header.train_words;
+  if (debug_mode > 0) printf("# Loaded compiled corpus %s: %lld ids, %lld lines\n", params->compiled_file, params->num_ids, params->num_lines);
+  return 1;
+}
+
+void CompileCorpus(struct train_params *params) {
+  struct compiled_corpus_header header;
+  struct corpus_reader reader;
+  struct stat st;
+  char tmp_file[MAX_STRING + 4];
+  long long num_index = 1, max_index = 1024, buf_len = 0;
+  long long *index = (long long *)malloc(max_index * sizeof(long long));
+  int *buf = (int *)malloc(1000000 * sizeof(int));
+  struct corpus_source *source = OpenSource(params->train_file);
+  FILE *fo;
+  int word;
+
+  if (debug_mode > 0) printf("# Compile %s into %s\n", params->train_file, params->compiled_file);
+  if (stat(params->train_file, &st) != 0) {
+    printf("ERROR: training data file not found!\n");
+    exit(1);
+  }
+  sprintf(tmp_file, "%s.tmp", params->compiled_file);
+  fo = fopen(tmp_file, "wb");
+  if (fo == NULL) {
+    printf("ERROR: can't write %s\n", tmp_file);
+    exit(1);
+  }
+
+  memset(&header, 0, sizeof(header));
+  memcpy(header.magic, COMPILED_CORPUS_MAGIC, 8);
+  header.vocab_fingerprint = VocabFingerprint(params);
+  header.train_words = params->train_words;
+  header.source_size = st.st_size;
+  header.source_mtime = st.st_mtime;
+  header.index_stride = COMPILED_INDEX_STRIDE;
+  fwrite(&header, sizeof(header), 1, fo);
+
+  index[0] = 0;
+  if (source != NULL) OpenSourceReader(&reader, source, 0, source->size);
+  else OpenCorpusReader(&reader, params->train_file, 0);
   while (1) {
-    fgets(line, MAX_SENT_LEN, file);
-    if (feof(file)) break;
-    ++(*num_lines);
+    word = ReadWordIndex(&reader, params);
+    if (reader.eof) break;
+    buf[buf_len++] = word;
+    header.num_ids++;
+    if (word == 0 && ++header.num_lines % COMPILED_INDEX_STRIDE == 0) {
+      if (num_index == max_index) {
+        max_index *= 2;
+        index = (long long *)realloc(index, max_index * sizeof(long long));
+      }
+      index[num_index++] = header.num_ids;
+    }
+    if (buf_len == 1000000) {
+      fwrite(buf, sizeof(int), buf_len, fo);
+      buf_len = 0;
+    }
   }
-  printf("  num_lines=%lld, eof position %lld\n", *num_lines, (long long) ftell(file));
+  fwrite(buf, sizeof(int), buf_len, fo);
+  CloseCorpusReader(&reader);
+  if (source != NULL) CloseSource(source);
+
+  // index, then the header again now that the counts are known
+  for (buf_len = sizeof(header) + header.num_ids * sizeof(int); buf_len < CompiledIndexOffset(header.num_ids); buf_len++) fputc(0, fo);
+  fwrite(index, sizeof(long long), num_index, fo);
+  fseek(fo, 0, SEEK_SET);
+  fwrite(&header, sizeof(header), 1, fo);
+  fclose(fo);
+  rename(tmp_file, params->compiled_file);
+  if (debug_mode > 0) printf("  %lld ids, %lld lines\n", header.num_ids, header.num_lines);
 
-  fseek(file, 0, SEEK_SET);
-  block_size = (*num_lines - 1) / num_blocks + 1;
-  printf("  block_size=%lld lines\n  blocks = [0", block_size);
+  free(index);
+  free(buf);
+}
 
-  *blocks = malloc((num_blocks+1) * sizeof(long long));
-  (*blocks)[0] = 0;
-  curr_block = 0;
-  long long int cur_size = 0;
+// Same split as ComputeBlockStartPoints, in id offsets: block b starts at line b * block_size
+void ComputeIdBlocks(struct train_params *params, int num_blocks) {
+  long long b, line, pos, block_size = (params->num_lines - 1) / num_blocks + 1;
+  const long long *index = (const long long *)((char *)params->ids - sizeof(struct compiled_corpus_header) + CompiledIndexOffset(params->num_ids));
+
+  params->id_blocks = malloc((num_blocks + 1) * sizeof(long long));
+  for (b = 0; b < num_blocks; b++) {
+    line = b * block_size;
+    if (line >= params->num_lines) {
+      params->id_blocks[b] = params->num_ids;
+      continue;
+    }
+    // jump to the closest indexed line, then skip sentence ends up to the block start
+    pos = index[line / COMPILED_INDEX_STRIDE];
+    for (line = line % COMPILED_INDEX_STRIDE; line > 0; pos++) if (params->ids[pos] == 0) line--;
+    params->id_blocks[b] = pos;
+  }
+  params->id_blocks[num_blocks] = params->num_ids;
+}
+/** End Compiled corpus **/
+
+/** Corpus bundle **/
+// With -bundle <file>, bilingual training reads each sentence pair as one record of a bundle file
+// instead of advancing the src, tgt and align readers in lockstep. A record is
+//   src_len, tgt_len, num_links, int src ids[src_len], int tgt ids[tgt_len], align_link links[num_links]
+// with the ids as ReadWordIndex returns them (no </s>) and one 4-byte link per aligned src position.
+// Layout: header | int records[num_ints] | long long index[], where index[k] is the offset of record
+// k * index_stride, padded to start on an 8-byte boundary. The bundle is built from the three files
+// the first time (and again when they or the vocabs change), which also checks in that one pass
+// that they have the same number of lines.
+#define BUNDLE_MAGIC "BVCBND01"
+#define BUNDLE_INDEX_STRIDE 1024
+
+struct bundle_header {
+  char magic[8];
+  unsigned long long src_fingerprint, tgt_fingerprint;
+  long long src_size, src_mtime, tgt_size, tgt_mtime; // train files when it was built
+  long long align_size, align_mtime; // align_file, both 0 when it was built without links
+  long long num_pairs, num_ints, index_stride;
+};
+
+char bundle_file[MAX_STRING];
+const int *bundle_records; // NULL when not training from a bundle
+long long bundle_num_pairs, bundle_num_ints;
+long long *bundle_blocks; // record offset where each thread's pairs start
+
+long long BundleIndexOffset(long long num_ints) {
+  return (sizeof(struct bundle_header) + num_ints * sizeof(int) + 7) & ~7LL;
+}
+
+static inline const int *NextBundleRecord(const int *record) {
+  return record + 3 + record[0] + record[1] + record[2];
+}
+
+// Maps bundle_file if it matches the training files and vocabs; returns 0 otherwise
+int LoadBundle() {
+  struct bundle_header header;
+  struct stat src_st, tgt_st, align_st;
+  char *data;
+  long long size;
+
+  if (stat(src->train_file, &src_st) != 0 || stat(tgt->train_file, &tgt_st) != 0) return 0;
+  if (align_opt && stat(align_file, &align_st) != 0) return 0;
+  data = MapFile(bundle_file, &size);
+  if (data == NULL) return 0;
+  if (size < (long long)sizeof(header)) {
+    munmap(data, size);
+    return 0;
+  }
+  memcpy(&header, data, sizeof(header));
+  if (memcmp(header.magic, BUNDLE_MAGIC, 8) || header.src_fingerprint != VocabFingerprint(src) || header.tgt_fingerprint != VocabFingerprint(tgt)
+      || header.src_size != (long long)src_st.st_size || header.src_mtime != (long long)src_st.st_mtime
+      || header.tgt_size != (long long)tgt_st.st_size || header.tgt_mtime != (long long)tgt_st.st_mtime
+      || (align_opt && (header.align_size != (long long)align_st.st_size || header.align_mtime != (long long)align_st.st_mtime))
+      || size < BundleIndexOffset(header.num_ints) + (header.num_pairs / header.index_stride + 1) * (long long)sizeof(long long)) {
+    printf("  %s is stale\n", bundle_file);
+    munmap(data, size);
+    return 0;
+  }
+
+  bundle_records = (const int *)(data + sizeof(header));
+  bundle_num_pairs = header.num_pairs;
+  bundle_num_ints = header.num_ints;
+  if (debug_mode > 0) printf("# Loaded bundle %s: %lld sentence pairs\n", bundle_file, bundle_num_pairs);
+  return 1;
+}
+
+// Reads the ids of one sentence (up to MAX_WORD_PER_SENT, the most training looks at); returns their number
+int ReadSentenceIds(struct corpus_reader *reader, struct train_params *params, int *ids) {
+  int word, len = 0;
   while (1) {
-    fgets(line, MAX_SENT_LEN, file);
-    line_count++;
-    cur_size++;
-
-    // done with a block or reach eof
-    if (cur_size == block_size || line_count==(*num_lines)) {
-      curr_block++;
-      (*blocks)[curr_block] = (long long)ftell(file);
-      printf(" %lld", (*blocks)[curr_block]);
-      if (line_count==(*num_lines)) { // eof
-        break;
+    word = ReadWordIndex(reader, params);
+    if (reader->eof || word == 0) break;
+    if (len < MAX_WORD_PER_SENT) ids[len++] = word;
+  }
+  return len;
+}
+
+// Opens a reader over a whole training file for BuildBundle
+void OpenBundleInput(struct corpus_reader *reader, struct corpus_source **source, const char *file_name) {
+  *source = OpenSource(file_name);
+  if (*source == NULL) {
+    printf("ERROR: can't map %s\n", file_name);
+    exit(1);
+  }
+  OpenSourceReader(reader, *source, 0, (*source)->size);
+}
+
+void BuildBundle() {
+  struct bundle_header header;
+  struct corpus_reader src_reader, tgt_reader, align_reader;
+  struct corpus_source *src_source, *tgt_source, *align_source = NULL;
+  struct stat st;
+  char tmp_file[MAX_STRING + 4];
+  long long num_index = 1, max_index = 1024, pos;
+  long long *index = (long long *)malloc(max_index * sizeof(long long));
+  int *record = (int *)malloc((3 + 3 * (MAX_WORD_PER_SENT + 1)) * sizeof(int));
+  int src_end, tgt_end, align_end, len;
+  FILE *fo;
+
+  if (debug_mode > 0) printf("# Bundle %s%s%s and %s into %s\n", src->train_file, align_opt ? ", " : "", align_opt ? tgt->train_file : "",
+                             align_opt ? align_file : tgt->train_file, bundle_file);
+  sprintf(tmp_file, "%s.tmp", bundle_file);
+  fo = fopen(tmp_file, "wb");
+  if (fo == NULL) {
+    printf("ERROR: can't write %s\n", tmp_file);
+    exit(1);
+  }
+
+  memset(&header, 0, sizeof(header));
+  memcpy(header.magic, BUNDLE_MAGIC, 8);
+  header.src_fingerprint = VocabFingerprint(src);
+  header.tgt_fingerprint = VocabFingerprint(tgt);
+  stat(src->train_file, &st);
+  header.src_size = st.st_size;
+  header.src_mtime = st.st_mtime;
+  stat(tgt->train_file, &st);
+  header.tgt_size = st.st_size;
+  header.tgt_mtime = st.st_mtime;
+  OpenBundleInput(&src_reader, &src_source, src->train_file);
+  OpenBundleInput(&tgt_reader, &tgt_source, tgt->train_file);
+  if (align_opt) {
+    stat(align_file, &st);
+    header.align_size = st.st_size;
+    header.align_mtime = st.st_mtime;
+    OpenBundleInput(&align_reader, &align_source, align_file);
+  }
+  header.index_stride = BUNDLE_INDEX_STRIDE;
+  fwrite(&header, sizeof(header), 1, fo);
+
+  index[0] = 0;
+  while (1) {
+    record[0] = ReadSentenceIds(&src_reader, src, record + 3);
+    src_end = src_reader.eof && record[0] == 0;
+    record[1] = ReadSentenceIds(&tgt_reader, tgt, record + 3 + record[0]);
+    tgt_end = tgt_reader.eof && record[1] == 0;
+    record[2] = 0;
+    align_end = 1;
+    if (align_opt) {
+      record[2] = ReadAlignLinks(&align_reader, (struct align_link *)(record + 3 + record[0] + record[1]));
+      align_end = align_reader.eof && record[2] == 0;
+    }
+    if (src_end && tgt_end && align_end) break;
+    if (src_end || tgt_end || (align_opt && align_end)) {
+      printf("ERROR: %s%s%s and %s don't have the same number of lines, one ends after %lld\n", src->train_file,
+             align_opt ? ", " : "", align_opt ? tgt->train_file : "", align_opt ? align_file : tgt->train_file, header.num_pairs);
+      exit(1);
+    }
+
+    len = NextBundleRecord(record) - record;
+    fwrite(record, sizeof(int), len, fo);
+    header.num_ints += len;
+    if (++header.num_pairs % BUNDLE_INDEX_STRIDE == 0) {
+      if (num_index == max_index) {
+        max_index *= 2;
+        index = (long long *)realloc(index, max_index * sizeof(long long));
       }
+      index[num_index++] = header.num_ints;
+    }
+  }
+  CloseCorpusReader(&src_reader);
+  CloseCorpusReader(&tgt_reader);
+  CloseSource(src_source);
+  CloseSource(tgt_source);
+  if (align_opt) {
+    CloseCorpusReader(&align_reader);
+    CloseSource(align_source);
+  }
 
-      // reset
-      cur_size = 0;
+  // index, then the header again now that the counts are known
+  for (pos = sizeof(header) + header.num_ints * sizeof(int); pos < BundleIndexOffset(header.num_ints); pos++) fputc(0, fo);
+  fwrite(index, sizeof(long long), num_index, fo);
+  fseek(fo, 0, SEEK_SET);
+  fwrite(&header, sizeof(header), 1, fo);
+  fclose(fo);
+  rename(tmp_file, bundle_file);
+  if (debug_mode > 0) printf("  %lld sentence pairs, %lld bytes of records\n", header.num_pairs, header.num_ints * (long long)sizeof(int));
+
+  free(index);
+  free(record);
+}
+
+// Splits the pairs into num_blocks ranges of whole lines, the same ones ComputeBlockStartPoints gives
+void ComputeBundleBlocks(int num_blocks) {
+  long long b, pair, block_size = (bundle_num_pairs - 1) / num_blocks + 1;
+  const long long *index = (const long long *)((const char *)bundle_records - sizeof(struct bundle_header) + BundleIndexOffset(bundle_num_ints));
+  const int *record;
+
+  bundle_blocks = malloc((num_blocks + 1) * sizeof(long long));
+  for (b = 0; b < num_blocks; b++) {
+    pair = b * block_size;
+    if (pair >= bundle_num_pairs) {
+      bundle_blocks[b] = bundle_num_ints;
+      continue;
     }
+    // jump to the closest indexed record, then skip records up to the block start
+    record = bundle_records + index[pair / BUNDLE_INDEX_STRIDE];
+    for (pair = pair % BUNDLE_INDEX_STRIDE; pair > 0; pair--) record = NextBundleRecord(record);
+    bundle_blocks[b] = record - bundle_records;
+  }
+  bundle_blocks[num_blocks] = bundle_num_ints;
+}
+/** End Corpus bundle **/
+
+/** Compiled alignments **/
+// Alignment links can be read from a binary file instead of being parsed from text on every
+// sentence of every epoch. With -compile-corpus 1, align_file is converted once into
+// align_file.links; an -align file that already is in this format is used as is. Layout:
+// header | per line: unsigned short num_links, then num_links align_links | long long index[],
+// where index[k] is the byte offset of line k * index_stride, padded to an 8-byte boundary.
+#define COMPILED_ALIGN_MAGIC "BVCALN01"
+#define COMPILED_ALIGN_STRIDE 1024
+
+struct compiled_align_header {
+  char magic[8];
+  long long source_size, source_mtime; // align_file when it was compiled, 0 for a file given directly
+  long long num_lines, links_size, index_stride; // links_size: bytes of per-line records
+};
+
+char align_links_file[MAX_STRING];
+const char *align_links; // per-line records, NULL when reading alignments from text
+
+long long CompiledAlignIndexOffset(long long links_size) {
+  return (sizeof(struct compiled_align_header) + links_size + 7) & ~7LL;
+}
+
+// Maps file_name if it holds compiled alignments (built from the file source_st describes, when
+// given) and splits its lines into num_blocks ranges like ComputeBlockStartPoints; returns 0 otherwise
+int LoadCompiledAlign(const char *file_name, const struct stat *source_st, int num_blocks) {
+  struct compiled_align_header header;
+  const long long *index;
+  const char *pos;
+  char *data;
+  long long size, line, block_size;
+  int b;
+
+  data = MapFile(file_name, &size);
+  if (data == NULL) return 0;
+  if (size < (long long)sizeof(header) || memcmp(data, COMPILED_ALIGN_MAGIC, 8)) {
+    munmap(data, size);
+    return 0;
+  }
+  memcpy(&header, data, sizeof(header));
+  if ((source_st != NULL && (header.source_size != (long long)source_st->st_size || header.source_mtime != (long long)source_st->st_mtime))
+      || size < CompiledAlignIndexOffset(header.links_size) + (header.num_lines / header.index_stride + 1) * (long long)sizeof(long long)) {
+    printf("  %s is stale\n", file_name);
+    munmap(data, size);
+    return 0;
+  }
+
+  align_links = data + sizeof(header);
+  align_num_lines = header.num_lines;
+  index = (const long long *)(data + CompiledAlignIndexOffset(header.links_size));
+  block_size = (align_num_lines - 1) / num_blocks + 1;
+  align_line_blocks = malloc((num_blocks + 1) * sizeof(long long));
+  for (b = 0; b < num_blocks; b++) {
+    line = b * block_size;
+    if (line >= align_num_lines) {
+      align_line_blocks[b] = header.links_size;
+      continue;
+    }
+    // jump to the closest indexed line, then skip lines up to the block start
+    pos = align_links + index[line / header.index_stride];
+    for (line = line % header.index_stride; line > 0; line--) pos += sizeof(unsigned short) + *(const unsigned short *)pos * sizeof(struct align_link);
+    align_line_blocks[b] = pos - align_links;
+  }
+  align_line_blocks[num_blocks] = header.links_size;
+  if (debug_mode > 0) printf("# Loaded compiled alignments %s: %lld lines\n", file_name, align_num_lines);
+  return 1;
+}
+
+void CompileAlign(const char *file_name, const struct stat *source_st) {
+  struct compiled_align_header header;
+  struct corpus_reader reader;
+  struct corpus_source *source = OpenSource(align_file);
+  struct align_link links[MAX_WORD_PER_SENT];
+  char tmp_file[MAX_STRING + 4];
+  long long num_index = 1, max_index = 1024, pos;
+  long long *index = (long long *)malloc(max_index * sizeof(long long));
+  unsigned short num_links;
+  FILE *fo;
+
+  if (debug_mode > 0) printf("# Compile %s into %s\n", align_file, file_name);
+  if (source == NULL) {
+    printf("ERROR: can't map %s\n", align_file);
+    exit(1);
+  }
+  sprintf(tmp_file, "%s.tmp", file_name);
+  fo = fopen(tmp_file, "wb");
+  if (fo == NULL) {
+    printf("ERROR: can't write %s\n", tmp_file);
+    exit(1);
   }
-  printf("]\n");
-  assert(curr_block==num_blocks);
-  assert(line_count==(*num_lines));
 
-  fclose(file);
+  memset(&header, 0, sizeof(header));
+  memcpy(header.magic, COMPILED_ALIGN_MAGIC, 8);
+  header.source_size = source_st->st_size;
+  header.source_mtime = source_st->st_mtime;
+  header.index_stride = COMPILED_ALIGN_STRIDE;
+  fwrite(&header, sizeof(header), 1, fo);
+
+  index[0] = 0;
+  OpenSourceReader(&reader, source, 0, source->size);
+  while (1) {
+    num_links = ReadAlignLinks(&reader, links);
+    if (reader.eof && num_links == 0) break;
+    fwrite(&num_links, sizeof(num_links), 1, fo);
+    fwrite(links, sizeof(struct align_link), num_links, fo);
+    header.links_size += sizeof(num_links) + num_links * sizeof(struct align_link);
+    if (++header.num_lines % COMPILED_ALIGN_STRIDE == 0) {
+      if (num_index == max_index) {
+        max_index *= 2;
+        index = (long long *)realloc(index, max_index * sizeof(long long));
+      }
+      index[num_index++] = header.links_size;
+    }
+  }
+  CloseCorpusReader(&reader);
+  CloseSource(source);
+
+  // index, then the header again now that the counts are known
+  for (pos = sizeof(header) + header.links_size; pos < CompiledAlignIndexOffset(header.links_size); pos++) fputc(0, fo);
+  fwrite(index, sizeof(long long), num_index, fo);
+  fseek(fo, 0, SEEK_SET);
+  fwrite(&header, sizeof(header), 1, fo);
+  fclose(fo);
+  rename(tmp_file, file_name);
+  if (debug_mode > 0) printf("  %lld lines, %lld bytes of links\n", header.num_lines, header.links_size);
+
+  free(index);
+}
+/** End Compiled alignments **/
+
+// out_word, then the negatives drawn for it that differ from it; returns how many
+static inline int DrawTargets(long long out_word, long long *targets, unsigned long long *next_random,
+    const struct train_params *out_params) {
+  int d, num_targets = 1;
+  targets[0] = out_word;
+  for (d = 0; d < negative; d++) {
+    targets[num_targets] = DrawNegative(out_params, next_random);
+    if (targets[num_targets] != out_word) num_targets++;
+  }
+  return num_targets;
+}
+
+/** Row access **/
+// -bf16 stores syn0, syn1 and syn1neg as bfloat16, which halves their memory and the bytes every
+// update moves. The output rows of hs and negative sampling are scored and updated where they are
+// stored, with the bf16 kernels (dot_bf16, axpy2_bf16, sgns_bf16). A step that reads rows again
+// after scoring them (the input rows, -shared-negatives and -minibatch) loads them into float copies
+// (buf, on its stack), and a word listed twice gets one copy. Updates go to the stored rows with
+// UpdateRow, one read and one write rounded stochastically, so updates far below the bf16 resolution
+// still add up on average. Without -bf16 the rows are used where they are.
+real *LoadRow(real *m, unsigned short *m_bf16, long long word, real *buf) {
+  if (m_bf16 == NULL) return m + word * layer1_stride;
+  vk.load_bf16(m_bf16 + word * layer1_stride, buf, layer1_stride);
+  return buf;
+}
+
+// rows[i] = row words[i] of m, the copies going to buf (n rows) with -bf16
+void LoadRows(real *m, unsigned short *m_bf16, long long *words, int n, real **rows, real *buf) {
+  int i, j;
+  for (i = 0; i < n; i++) {
+    for (j = 0; m_bf16 != NULL && j < i; j++) if (words[j] == words[i]) break;
+    rows[i] = m_bf16 != NULL && j < i ? rows[j] : LoadRow(m, m_bf16, words[i], buf + i * layer1_stride);
+  }
+}
+
+// Asks for the stored rows words[0..n) of m_bf16 ahead of the bf16 kernels that read them one by one
+void PrefetchRows(unsigned short *m_bf16, long long *words, int n) {
+  long long c;
+  int i;
+  for (i = 0; i < n; i++) for (c = 0; c < layer1_stride; c += 32) __builtin_prefetch(m_bf16 + words[i] * layer1_stride + c, 1);
+}
+
+// Adds g * x to row word of m
+void UpdateRow(real *m, unsigned short *m_bf16, long long word, real g, real *x, unsigned long long *next_random) {
+  if (m_bf16 != NULL) vk.axpy_bf16(g, x, m_bf16 + word * layer1_stride, layer1_size, next_random);
+  else vk.axpy(g, x, m + word * layer1_stride, layer1_size);
+}
+/** End Row access **/
+
+// Hierarchical softmax of hidden vector h for out_word, the error going to e: all nodes of the path
+// are scored first (h doesn't change and the nodes are distinct, so the scores are the ones of the
+// node by node loop), one sigmoid pass takes all of them, then the nodes are updated. A node whose
+// score is beyond MAX_EXP is skipped.
+void TrainHsPath(real *h, real *e, long long out_word, unsigned long long *next_random, struct train_params *out_params, real alpha) {
+  long long d, start = out_params->code_offset[out_word], len = out_params->code_offset[out_word + 1] - start;
+  long long nodes[len + 1];
+  real f[len + 1], sig[len + 1], *rows[len + 1], g;
+  unsigned short *m_bf16 = out_params->syn1_bf16;
+  for (d = 0; d < len; d++) nodes[d] = CODE_STEP_POINT(out_params->code_steps[start + d]);
+  // Propagate hidden -> output
+  if (m_bf16 != NULL) {
+    PrefetchRows(m_bf16, nodes, len);
+    for (d = 0; d < len; d++) f[d] = vk.dot_bf16(h, m_bf16 + nodes[d] * layer1_stride, layer1_size);
+  } else {
+    for (d = 0; d < len; d++) rows[d] = out_params->syn1 + nodes[d] * layer1_stride;
+    for (d = 0; d + 4 <= len; d += 4) vk.dot4(h, rows + d, layer1_size, f + d);
+    for (; d < len; d++) f[d] = vk.dot(h, rows[d], layer1_size);
+  }
+  vk.sigmoid(f, sig, len);
+  for (d = 0; d < len; d++) {
+    if (f[d] <= -MAX_EXP || f[d] >= MAX_EXP) continue;
+    // 'g' is the gradient multiplied by the learning rate
+    g = (1 - CODE_STEP_CODE(out_params->code_steps[start + d]) - sig[d]) * alpha;
+    // Propagate errors output -> hidden, learn weights hidden -> output
+    if (m_bf16 != NULL) vk.axpy2_bf16(g, h, m_bf16 + nodes[d] * layer1_stride, e, layer1_size, next_random);
+    else vk.axpy2(g, h, rows[d], e, layer1_size);
+  }
+}
+
+// Negative sampling of hidden vector h against targets[0] (the positive) and the negatives
+// targets[1..num_targets), the error going to e; scores, one sigmoid pass, then the updates
+void TrainTargets(real *h, real *e, long long *targets, int num_targets, unsigned long long *next_random,
+    struct train_params *out_params, real alpha) {
+  real f[num_targets], sig[num_targets], *rows[num_targets], g;
+  unsigned short *m_bf16 = out_params->syn1neg_bf16;
+  int t;
+  if (m_bf16 != NULL && vk.sgns_bf16 != NULL) {
+    vk.sgns_bf16(h, e, m_bf16, targets, num_targets, alpha, MAX_EXP, next_random);
+    return;
+  }
+  if (m_bf16 == NULL && vk.sgns != NULL) {
+    vk.sgns(h, e, out_params->syn1neg, targets, num_targets, alpha, MAX_EXP);
+    return;
+  }
+  if (m_bf16 != NULL) {
+    PrefetchRows(m_bf16, targets, num_targets);
+    for (t = 0; t < num_targets; t++) f[t] = vk.dot_bf16(h, m_bf16 + targets[t] * layer1_stride, layer1_size);
+  } else {
+    for (t = 0; t < num_targets; t++) rows[t] = out_params->syn1neg + targets[t] * layer1_stride;
+    for (t = 0; t + 4 <= num_targets; t += 4) vk.dot4(h, rows + t, layer1_size, f + t);
+    for (; t < num_targets; t++) f[t] = vk.dot(h, rows[t], layer1_size);
+  }
+  vk.sigmoid(f, sig, num_targets);
+  for (t = 0; t < num_targets; t++) {
+    g = VecLogitError(f[t], sig[t], t == 0, MAX_EXP) * alpha;
+    if (m_bf16 != NULL) vk.axpy2_bf16(g, h, m_bf16 + targets[t] * layer1_stride, e, layer1_size, next_random);
+    else vk.axpy2(g, h, rows[t], e, layer1_size);
+  }
 }
 
 // neu1: avg context embedding
@@ -665,10 +2756,10 @@ void ComputeBlockStartPoints(char* file_name, int num_blocks, long long **blocks
 void ProcessCbow(int in_sent_pos, int in_sent_len, long long *in_sent, long long out_word, int b, unsigned long long *next_random,
     struct train_params *in_params, struct train_params *out_params, real *neu1, real *neu1e) {
 
-  int a, c, d;
-  long long l2, target, label, in_word;
-  real f, g;
-  int cw;
+  int a, c;
+  long long in_words[window * 2], targets[negative + 1];
+  real *in_rows[window * 2], in_buf[in_params->syn0_bf16 != NULL ? window * 2 * layer1_stride : 1];
+  int cw, num_targets;
 
   for (c = 0; c < layer1_size; c++) neu1[c] = 0;
   for (c = 0; c < layer1_size; c++) neu1e[c] = 0;
@@ -683,62 +2774,25 @@ void ProcessCbow(int in_sent_pos, int in_sent_len, long long *in_sent, long long
     c = in_sent_pos - window + a;
     if (c < 0) continue;
     if (c >= in_sent_len) continue;
-    in_word = in_sent[c];
-    if (in_word == -1) continue;
-    for (c = 0; c < layer1_size; c++) neu1[c] += in_params->syn0[c + in_word * layer1_size];
-    cw++;
+    if (in_sent[c] == -1) continue;
+    in_words[cw++] = in_sent[c];
   }
+  LoadRows(in_params->syn0, in_params->syn0_bf16, in_words, cw, in_rows, in_buf);
+  for (c = 0; c < cw; c++) vk.axpy(1, in_rows[c], neu1, layer1_size);
 
   if(cw){
     for (c = 0; c < layer1_size; c++) neu1[c] /= cw; // average word vectors
 
     // hidden -> output -> hidden
-    if (hs) for (d = 0; d < out_params->vocab[out_word].codelen; d++) {
-      f = 0;
-      l2 = out_params->vocab[out_word].point[d] * layer1_size;
-      // Propagate hidden -> output
-      for (c = 0; c < layer1_size; c++) f += neu1[c] * out_params->syn1[c + l2];
-      if (f <= -MAX_EXP) continue;
-      else if (f >= MAX_EXP) continue;
-      else f = expTable[(int)((f + MAX_EXP) * (EXP_TABLE_SIZE / MAX_EXP / 2))];
-      // 'g' is the gradient multiplied by the learning rate
-      g = (1 - out_params->vocab[out_word].code[d] - f) * alpha;
-      // Propagate errors output -> hidden
-      for (c = 0; c < layer1_size; c++) neu1e[c] += g * out_params->syn1[c + l2];
-      // Learn weights hidden -> output
-      for (c = 0; c < layer1_size; c++) out_params->syn1[c + l2] += g * neu1[c];
-    }
+    if (hs) TrainHsPath(neu1, neu1e, out_word, next_random, out_params, alpha);
     // NEGATIVE SAMPLING
-    if (negative > 0) for (d = 0; d < negative + 1; d++) {
-      if (d == 0) {
-        target = out_word;
-        label = 1;
-      } else {
-        *next_random = (*next_random) * (unsigned long long)25214903917 + 11;
-        target = out_params->table[((*next_random) >> 16) % table_size];
-        if (target == 0) target = (*next_random) % (out_params->vocab_size - 1) + 1;
-        if (target == out_word) continue;
-        label = 0;
-      }
-      l2 = target * layer1_size;
-      f = 0;
-      for (c = 0; c < layer1_size; c++) f += neu1[c] * out_params->syn1neg[c + l2];
-      if (f > MAX_EXP) g = (label - 1) * alpha;
-      else if (f < -MAX_EXP) g = (label - 0) * alpha;
-      else g = (label - expTable[(int)((f + MAX_EXP) * (EXP_TABLE_SIZE / MAX_EXP / 2))]) * alpha;
-      for (c = 0; c < layer1_size; c++) neu1e[c] += g * out_params->syn1neg[c + l2];
-      for (c = 0; c < layer1_size; c++) out_params->syn1neg[c + l2] += g * neu1[c];
+    if (negative > 0) {
+      num_targets = DrawTargets(out_word, targets, next_random, out_params);
+      TrainTargets(neu1, neu1e, targets, num_targets, next_random, out_params, alpha);
     }
 
     // hidden -> in
-    for (a = b; a < window * 2 + 1 - b; a++) if (a != window) {
-      c = in_sent_pos - window + a;
-      if (c < 0) continue;
-      if (c >= in_sent_len) continue;
-      in_word = in_sent[c];
-      if (in_word == -1) continue;
-      for (c = 0; c < layer1_size; c++) in_params->syn0[c + in_word * layer1_size] += neu1e[c];
-    }
+    for (c = 0; c < cw; c++) UpdateRow(in_params->syn0, in_params->syn0_bf16, in_words[c], 1, neu1e, next_random);
   }
 }
 
@@ -748,56 +2802,158 @@ void ProcessCbow(int in_sent_pos, int in_sent_len, long long *in_sent, long long
 // neu1e: hidden vector error
 void ProcessSkipPair(long long in_word, long long out_word, unsigned long long *next_random,
     struct train_params *in_params, struct train_params *out_params, real *neu1e, real skip_alpha) {
-  long long d;
-  long long l1, l2, c, target, label;
-  real f, g;
+  long long c, targets[negative + 1];
+  real *h, in_buf[in_params->syn0_bf16 != NULL ? layer1_stride : 1];
+  int num_targets;
 
 #ifdef DEBUG
     printf("  skip %s -> %s\n", in_params->vocab[in_word].word, out_params->vocab[out_word].word); fflush(stdout);
 #endif
 
-  l1 = in_word * layer1_size;
+  h = LoadRow(in_params->syn0, in_params->syn0_bf16, in_word, in_buf);
   for (c = 0; c < layer1_size; c++) neu1e[c] = 0;
 
   // HIERARCHICAL SOFTMAX
-  if (hs) for (d = 0; d < out_params->vocab[out_word].codelen; d++) {
-    f = 0;
-    l2 = out_params->vocab[out_word].point[d] * layer1_size;
-    // Propagate hidden -> output
-    for (c = 0; c < layer1_size; c++) f += in_params->syn0[c + l1] * out_params->syn1[c + l2];
-    if (f <= -MAX_EXP) continue;
-    else if (f >= MAX_EXP) continue;
-    else f = expTable[(int)((f + MAX_EXP) * (EXP_TABLE_SIZE / MAX_EXP / 2))];
-    // 'g' is the gradient multiplied by the learning rate
-    g = (1 - out_params->vocab[out_word].code[d] - f) * skip_alpha;
-    // Propagate errors output -> hidden
-    for (c = 0; c < layer1_size; c++) neu1e[c] += g * out_params->syn1[c + l2];
-    // Learn weights hidden -> output
-    for (c = 0; c < layer1_size; c++) out_params->syn1[c + l2] += g * in_params->syn0[c + l1];
+  if (hs) TrainHsPath(h, neu1e, out_word, next_random, out_params, skip_alpha);
+  // NEGATIVE SAMPLING
+  if (negative > 0) {
+    num_targets = DrawTargets(out_word, targets, next_random, out_params);
+    TrainTargets(h, neu1e, targets, num_targets, next_random, out_params, skip_alpha);
+  }
+  // Learn weights input -> hidden
+  UpdateRow(in_params->syn0, in_params->syn0_bf16, in_word, 1, neu1e, next_random);
+}
+
+// -shared-negatives: trains num_pairs skip-gram pairs (in_words[i] -> out_words[i]) that share one
+// set of negatives, drawn once. All scores are taken from the weights as they were before the
+// block, so the negative rows are read from memory once and updated with the gradient of all
+// pairs, and each pair's error goes to its own row of neu1e.
+void ProcessSkipBlock(int num_pairs, long long *in_words, long long *out_words, unsigned long long *next_random,
+    struct train_params *in_params, struct train_params *out_params, real *neu1e, real skip_alpha) {
+  long long d, c, words[num_pairs + negative], *negs = words + num_pairs;
+  real *err, f_pos[num_pairs], g_pos[num_pairs], f_neg[num_pairs][negative > 0 ? negative : 1], g_neg[num_pairs][negative > 0 ? negative : 1];
+  real *in_rows[num_pairs], *rows[num_pairs + negative], **neg_rows = rows + num_pairs;
+  real in_buf[in_params->syn0_bf16 != NULL ? num_pairs * layer1_stride : 1];
+  real buf[out_params->syn1neg_bf16 != NULL ? (num_pairs + negative) * layer1_stride : 1];
+  real delta[out_params->syn1neg_bf16 != NULL ? layer1_stride : 1];
+  int i, num_negs = 0;
+
+  LoadRows(in_params->syn0, in_params->syn0_bf16, in_words, num_pairs, in_rows, in_buf);
+  for (i = 0; i < num_pairs; i++) {
+    err = neu1e + i * layer1_stride;
+    for (c = 0; c < layer1_size; c++) err[c] = 0;
+    // HIERARCHICAL SOFTMAX, pair by pair as in ProcessSkipPair
+    if (hs) TrainHsPath(in_rows[i], err, out_words[i], next_random, out_params, skip_alpha);
   }
+
   // NEGATIVE SAMPLING
-  if (negative > 0) for (d = 0; d < negative + 1; d++) {
-    if (d == 0) {
-      target = out_word;
-      label = 1;
-    } else {
-      *next_random = (*next_random) * (unsigned long long)25214903917 + 11;
-      target = out_params->table[((*next_random) >> 16) % table_size];
-      if (target == 0) target = (*next_random) % (out_params->vocab_size - 1) + 1;
-      if (target == out_word) continue;
-      label = 0;
-    }
-    l2 = target * layer1_size;
-    f = 0;
-    for (c = 0; c < layer1_size; c++) f += in_params->syn0[c + l1] * out_params->syn1neg[c + l2];
-    if (f > MAX_EXP) g = (label - 1) * skip_alpha;
-    else if (f < -MAX_EXP) g = (label - 0) * skip_alpha;
-    else g = (label - expTable[(int)((f + MAX_EXP) * (EXP_TABLE_SIZE / MAX_EXP / 2))]) * skip_alpha;
-    for (c = 0; c < layer1_size; c++) neu1e[c] += g * out_params->syn1neg[c + l2];
-    for (c = 0; c < layer1_size; c++) out_params->syn1neg[c + l2] += g * in_params->syn0[c + l1];
+  if (negative > 0) {
+    for (d = 0; d < negative; d++) negs[num_negs++] = DrawNegative(out_params, next_random);
+    // the out words, then the negatives, so that a word that is both gets one copy with -bf16
+    for (i = 0; i < num_pairs; i++) words[i] = out_words[i];
+    LoadRows(out_params->syn1neg, out_params->syn1neg_bf16, words, num_pairs + num_negs, rows, buf);
+    // gradients: one positive per pair, then the shared negatives (skipped where one is the pair's out word)
+    for (i = 0; i < num_pairs; i++) f_pos[i] = vk.dot(in_rows[i], rows[i], layer1_size);
+    for (d = 0; d < num_negs; d++) {
+      for (i = 0; i < num_pairs; i++)
+        f_neg[i][d] = negs[d] == out_words[i] ? 0 : vk.dot(in_rows[i], neg_rows[d], layer1_size);
+    }
+    vk.sigmoid(f_pos, g_pos, num_pairs);
+    vk.sigmoid(&f_neg[0][0], &g_neg[0][0], num_pairs * num_negs);
+    for (i = 0; i < num_pairs; i++) {
+      g_pos[i] = VecLogitError(f_pos[i], g_pos[i], 1, MAX_EXP) * skip_alpha;
+      for (d = 0; d < num_negs; d++)
+        g_neg[i][d] = negs[d] == out_words[i] ? 0 : VecLogitError(f_neg[i][d], g_neg[i][d], 0, MAX_EXP) * skip_alpha;
+    }
+    // errors of the pairs, from the output rows before their update
+    for (i = 0; i < num_pairs; i++) {
+      err = neu1e + i * layer1_stride;
+      vk.axpy(g_pos[i], rows[i], err, layer1_size);
+      for (d = 0; d < num_negs; d++) vk.axpy(g_neg[i][d], neg_rows[d], err, layer1_size);
+    }
+    // output rows; with -bf16 a negative's updates from all pairs are summed in delta and stored at once
+    for (i = 0; i < num_pairs; i++) UpdateRow(out_params->syn1neg, out_params->syn1neg_bf16, words[i], g_pos[i], in_rows[i], next_random);
+    for (d = 0; d < num_negs; d++) {
+      if (out_params->syn1neg_bf16 == NULL) {
+        for (i = 0; i < num_pairs; i++) vk.axpy(g_neg[i][d], in_rows[i], neg_rows[d], layer1_size);
+        continue;
+      }
+      for (c = 0; c < layer1_size; c++) delta[c] = 0;
+      for (i = 0; i < num_pairs; i++) vk.axpy(g_neg[i][d], in_rows[i], delta, layer1_size);
+      UpdateRow(out_params->syn1neg, out_params->syn1neg_bf16, negs[d], 1, delta, next_random);
+    }
+  }
+  // Learn weights input -> hidden
+  for (i = 0; i < num_pairs; i++) UpdateRow(in_params->syn0, in_params->syn0_bf16, in_words[i], 1, neu1e + i * layer1_stride, next_random);
+}
+
+// -minibatch: the HogBatch form of skip-gram with negative sampling. The num_in input words are all
+// trained against the num_pos positive words and one shared set of negatives: with In the input rows
+// and Out the output rows, the scores S = In Out^T give G = (label - sigmoid(S)) * alpha, and the
+// updates In += G Out and Out += G^T In are accumulated in neu1e (input rows first, then output
+// rows) and added to syn0 and syn1neg once per batch. The products are done four rows at a time with
+// dot4 and axpy4. Each input makes a pair with every positive, and the negatives count once per pair
+// as in ProcessSkipPair. Hierarchical softmax, if on, is trained pair by pair before.
+void ProcessSkipBatch(int num_in, long long *in_words, int num_pos, long long *pos_words, unsigned long long *next_random,
+    struct train_params *in_params, struct train_params *out_params, real *neu1e, real skip_alpha) {
+  long long c, d, target, out_words[num_pos + (negative > 0 ? negative : 0)];
+  real g, *err, *in_rows[num_in], *out_rows[num_pos + (negative > 0 ? negative : 0)];
+  real in_buf[in_params->syn0_bf16 != NULL ? num_in * layer1_stride : 1];
+  real *out_err = neu1e + window * 2 * layer1_stride;
+  int i, k, num_out = 0;
+
+  LoadRows(in_params->syn0, in_params->syn0_bf16, in_words, num_in, in_rows, in_buf);
+  for (i = 0; i < num_in; i++) {
+    err = neu1e + i * layer1_stride;
+    for (c = 0; c < layer1_size; c++) err[c] = 0;
+    // HIERARCHICAL SOFTMAX, pair by pair as in ProcessSkipPair
+    if (hs) for (k = 0; k < num_pos; k++) TrainHsPath(in_rows[i], err, pos_words[k], next_random, out_params, skip_alpha);
+  }
+
+  // NEGATIVE SAMPLING
+  if (negative > 0) {
+    // output words: the positives, then the negatives that are none of them
+    for (k = 0; k < num_pos; k++) out_words[num_out++] = pos_words[k];
+    for (d = 0; d < negative; d++) {
+      target = DrawNegative(out_params, next_random);
+      for (k = 0; k < num_pos; k++) if (target == pos_words[k]) break;
+      if (k == num_pos) out_words[num_out++] = target;
+    }
+    real scores[num_in][num_out], grad[num_in][num_out], grad_t[num_out][num_in];
+    real out_buf[out_params->syn1neg_bf16 != NULL ? num_out * layer1_stride : 1];
+    LoadRows(out_params->syn1neg, out_params->syn1neg_bf16, out_words, num_out, out_rows, out_buf);
+
+    // S = In Out^T, then G
+    for (i = 0; i < num_in; i++) {
+      for (k = 0; k + 4 <= num_out; k += 4) vk.dot4(in_rows[i], out_rows + k, layer1_size, &scores[i][k]);
+      for (; k < num_out; k++) scores[i][k] = vk.dot(in_rows[i], out_rows[k], layer1_size);
+    }
+    vk.sigmoid(&scores[0][0], &grad[0][0], num_in * num_out);
+    for (i = 0; i < num_in; i++) {
+      for (k = 0; k < num_out; k++) {
+        g = VecLogitError(scores[i][k], grad[i][k], k < num_pos, MAX_EXP);
+        if (k >= num_pos) g *= num_pos; // a negative of all num_pos (input, positive) pairs
+        grad[i][k] = g * skip_alpha;
+        grad_t[k][i] = g * skip_alpha;
+      }
+    }
+    // In errors: G Out, from the output rows before their update
+    for (i = 0; i < num_in; i++) {
+      err = neu1e + i * layer1_stride;
+      for (k = 0; k + 4 <= num_out; k += 4) vk.axpy4(&grad[i][k], out_rows + k, err, layer1_size);
+      for (; k < num_out; k++) vk.axpy(grad[i][k], out_rows[k], err, layer1_size);
+    }
+    // Out errors: G^T In, then one write back per output row
+    for (k = 0; k < num_out; k++) {
+      err = out_err + k * layer1_stride;
+      for (c = 0; c < layer1_size; c++) err[c] = 0;
+      for (i = 0; i + 4 <= num_in; i += 4) vk.axpy4(&grad_t[k][i], in_rows + i, err, layer1_size);
+      for (; i < num_in; i++) vk.axpy(grad_t[k][i], in_rows[i], err, layer1_size);
+    }
+    for (k = 0; k < num_out; k++) UpdateRow(out_params->syn1neg, out_params->syn1neg_bf16, out_words[k], 1, out_err + k * layer1_stride, next_random);
   }
   // Learn weights input -> hidden
-  for (c = 0; c < layer1_size; c++) in_params->syn0[c + l1] += neu1e[c];
+  for (i = 0; i < num_in; i++) UpdateRow(in_params->syn0, in_params->syn0_bf16, in_words[i], 1, neu1e + i * layer1_stride, next_random);
 }
 
 /** Monolingual predictions **/
@@ -809,8 +2965,8 @@ void ProcessSkipPair(long long in_word, long long out_word, unsigned long long *
 // syn1: output embeddings (hs)
 // syn1neg: output embeddings (negative)
 void ProcessSentence(int sentence_length, long long *sen, struct train_params *src, unsigned long long *next_random, real *neu1, real *neu1e) {
-  int a, b, c, sentence_position;
-  long long out_word, in_word;
+  int a, b, c, sentence_position, num_pairs;
+  long long out_word, in_word, in_words[window * 2], out_words[window * 2];
 
   for (sentence_position = 0; sentence_position < sentence_length; ++sentence_position) {
     out_word = sen[sentence_position];
@@ -822,6 +2978,7 @@ void ProcessSentence(int sentence_length, long long *sen, struct train_params *s
     if (cbow) {  //train the cbow architecture
       ProcessCbow(sentence_position, sentence_length, sen, out_word, b, next_random, src, src, neu1, neu1e);
     } else {  //train skip-gram
+      num_pairs = 0;
       for (a = b; a < window * 2 + 1 - b; a++) if (a != window) {
         c = sentence_position - window + a; // sentence - (window - b) -> sentence + (window - b)
         if (c < 0) continue;
@@ -829,8 +2986,13 @@ void ProcessSentence(int sentence_length, long long *sen, struct train_params *s
         in_word = sen[c];
         if (in_word == -1) continue;
 
-        ProcessSkipPair(in_word, out_word, next_random, src, src, neu1e, alpha);
+        if (minibatch || shared_negatives) {
+          in_words[num_pairs] = in_word;
+          out_words[num_pairs++] = out_word;
+        } else ProcessSkipPair(in_word, out_word, next_random, src, src, neu1e, alpha);
       } // for a (skipgram)
+      if (num_pairs > 0 && minibatch) ProcessSkipBatch(num_pairs, in_words, 1, &out_word, next_random, src, src, neu1e, alpha);
+      else if (num_pairs > 0) ProcessSkipBlock(num_pairs, in_words, out_words, next_random, src, src, neu1e, alpha);
     } // end if cbow
   } // sentence
 }
@@ -839,7 +3001,8 @@ void ProcessSentence(int sentence_length, long long *sen, struct train_params *s
 void ProcessSentenceAlign(struct train_params *src, long long src_word, int src_pos, //int *tgt_id_map,
                           struct train_params *tgt, long long* tgt_sent, int tgt_len, int tgt_pos,
                           unsigned long long *next_random, real *neu1, real *neu1e) {
-  int neighbor_pos, a;
+  int neighbor_pos, a, num_pairs = 0;
+  long long in_words[window * 2], out_words[window * 2];
   //int neighbor_pos, neighbor_count;
   real b;
 
@@ -861,264 +3024,607 @@ void ProcessSentenceAlign(struct train_params *src, long long src_word, int src_
       // src -> tgt neighbor
       neighbor_pos = tgt_pos -window + a;
       if (neighbor_pos >= 0 && neighbor_pos < tgt_len) {
-        ProcessSkipPair(src_word, tgt_sent[neighbor_pos], next_random, src, tgt, neu1e, bi_alpha);
+        if (minibatch || shared_negatives) {
+          in_words[num_pairs] = src_word;
+          out_words[num_pairs++] = tgt_sent[neighbor_pos];
+        } else ProcessSkipPair(src_word, tgt_sent[neighbor_pos], next_random, src, tgt, neu1e, bi_alpha);
       }
     }
+    if (num_pairs > 0 && minibatch) ProcessSkipBatch(1, &src_word, num_pairs, out_words, next_random, src, tgt, neu1e, bi_alpha);
+    else if (num_pairs > 0) ProcessSkipBlock(num_pairs, in_words, out_words, next_random, src, tgt, neu1e, bi_alpha);
   } // end for if (cbow)
 }
 
 
-void *TrainModelThread(void *id) {
-  long long word;
-  int src_sentence_length = 0, tgt_sentence_length = 0;
-  long long src_word_count = 0, src_last_word_count = 0, src_sen[MAX_WORD_PER_SENT + 1];
-  long long tgt_word_count = 0, tgt_sen[MAX_WORD_PER_SENT + 1];
-  unsigned long long next_random = (long long)id;
-  clock_t now;
-  FILE *src_fi = NULL, *tgt_fi = NULL, *align_fi=NULL;
-  long long int sent_id = 0;
+/** Streaming input **/
+// With -stream 1 the inputs don't need to be seekable: one distributor thread reads aligned
+// (src, tgt, align) lines from files, named pipes or stdin ("-") and hands them to the training
+// threads in batches of STREAM_BATCH_LINES lines through a bounded lock-free ring (a single-producer
+// version of Vyukov's MPMC queue). Each training thread tokenizes a batch from memory, then takes
+// the next one; training stops once the inputs are exhausted.
+#define STREAM_BATCH_LINES 1024
 
-  // for align
-  int src_sentence_orig_length=0, tgt_sentence_orig_length=0;
-  int src_id_map[MAX_WORD_PER_SENT + 1], tgt_id_map[MAX_WORD_PER_SENT + 1]; // map from original indices to new indices if id_map[j]==0, word j is deleted
-#ifdef DEBUG
-  long long src_sen_orig[MAX_WORD_PER_SENT + 1], tgt_sen_orig[MAX_WORD_PER_SENT + 1];
-#endif
-  int src_align_map[MAX_WORD_PER_SENT + 1]; // map from src positions to tgt positions and vice versa
-  int count;
-  int src_pos, tgt_pos;
-  char ch;
+struct stream_batch {
+  char *data; // src lines, then tgt lines, then align lines
+  long long src_len, tgt_len, align_len;
+};
+
+struct stream_slot {
+  unsigned long long seq;
+  struct stream_batch *batch;
+};
+
+struct stream_queue {
+  struct stream_slot *slots;
+  unsigned long long mask;
+  unsigned long long head, tail; // next slot to fill, next slot to take
+  int closed;                    // set once the last batch is in
+};
+
+struct stream_queue stream_queue;
+
+void StreamQueueInit(struct stream_queue *queue, long long size) {
+  long long a;
+  queue->slots = (struct stream_slot *)calloc(size, sizeof(struct stream_slot));
+  for (a = 0; a < size; a++) queue->slots[a].seq = a;
+  queue->mask = size - 1;
+  queue->head = queue->tail = 0;
+  queue->closed = 0;
+}
+
+// Single producer: waits for the slot to be free, then publishes the batch
+void StreamPush(struct stream_queue *queue, struct stream_batch *batch) {
+  struct stream_slot *slot = &queue->slots[queue->head & queue->mask];
+  while (__atomic_load_n(&slot->seq, __ATOMIC_ACQUIRE) != queue->head) sched_yield();
+  slot->batch = batch;
+  __atomic_store_n(&slot->seq, queue->head + 1, __ATOMIC_RELEASE);
+  queue->head++;
+}
+
+void StreamClose(struct stream_queue *queue) {
+  __atomic_store_n(&queue->closed, 1, __ATOMIC_RELEASE);
+}
 
-  real *neu1 = (real *)calloc(layer1_size, sizeof(real)); // cbow
-  real *neu1e = (real *)calloc(layer1_size, sizeof(real)); // skipgram
+// Multiple consumers: returns the next batch, or NULL once the queue is closed and drained
+struct stream_batch *StreamPop(struct stream_queue *queue) {
+  unsigned long long pos;
+  struct stream_slot *slot;
+  long long dif;
+  int closed;
 
-  // src
-  src_fi = fopen(src->train_file, "rb");
-  fseek(src_fi, src->line_blocks[(long long)id], SEEK_SET);
-  // tgt
-  if(is_bi) {
-    tgt_fi = fopen(tgt->train_file, "rb");
-    fseek(tgt_fi, tgt->line_blocks[(long long)id], SEEK_SET);
+  while (1) {
+    pos = __atomic_load_n(&queue->tail, __ATOMIC_RELAXED);
+    slot = &queue->slots[pos & queue->mask];
+    closed = __atomic_load_n(&queue->closed, __ATOMIC_ACQUIRE);
+    dif = (long long)__atomic_load_n(&slot->seq, __ATOMIC_ACQUIRE) - (long long)(pos + 1);
+    if (dif == 0) {
+      if (__atomic_compare_exchange_n(&queue->tail, &pos, pos + 1, 0, __ATOMIC_RELAXED, __ATOMIC_RELAXED)) {
+        struct stream_batch *batch = slot->batch;
+        __atomic_store_n(&slot->seq, pos + queue->mask + 1, __ATOMIC_RELEASE);
+        return batch;
+      }
+    } else if (dif < 0) { // empty; closed was read before seq, so nothing more is coming
+      if (closed) return NULL;
+      sched_yield();
+    }
   }
-  // align
-  if(align_opt){
-    align_fi = fopen(align_file, "rb");
-    fseek(align_fi, align_line_blocks[(long long)id], SEEK_SET);
+}
+
+FILE *OpenStream(const char *file_name) {
+  FILE *fi = strcmp(file_name, "-") ? fopen(file_name, "rb") : stdin;
+  if (fi == NULL) {
+    printf("ERROR: can't open %s\n", file_name);
+    exit(1);
   }
+  return fi;
+}
 
-  while (1) {
-#ifdef DEBUG
-    printf("# Load sentence %lld, src_word_count %lld, src_last_word_count %lld\n", sent_id, src_word_count, src_last_word_count); fflush(stdout);
-    printf("  src, sample=%g, dropping words:", sample); fflush(stdout);
-#endif
+// Appends the next line of fi (with its newline) to the batch buffer; returns 0 at eof
+int StreamReadLine(FILE *fi, char **line, size_t *line_size, char **data, long long *len, long long *max_len) {
+  ssize_t n = getline(line, line_size, fi);
+  if (n <= 0) return 0;
+  if ((*line)[n - 1] != '\n') (*line)[n++] = '\n'; // getline leaves room for the terminator
+  if (*len + n > *max_len) {
+    *max_len = (*len + n) * 2;
+    *data = (char *)realloc(*data, *max_len);
+  }
+  memcpy(*data + *len, *line, n);
+  *len += n;
+  return 1;
+}
 
-    if (src_word_count - src_last_word_count > 10000) {
-      src->word_count_actual += src_word_count - src_last_word_count;
-      src_last_word_count = src_word_count;
-      if ((debug_mode > 1)) {
-        now=clock();
-        if (is_bi){
-          printf("%cAlpha: %f, bi_alpha: %f,  Progress: %.2f%%  Words/thread/sec: %.2fk  ", 13, alpha, bi_alpha,
-                   (src->word_count_actual - (src->word_count_actual / src->train_words) * src->train_words)/ (real)(src->train_words + 1) * 100,
-                   src->word_count_actual / ((real)(now - start + 1) / (real)CLOCKS_PER_SEC * 1000));
-        } else {
-          printf("%cAlpha: %f  Progress: %.2f%%  Words/thread/sec: %.2fk  ", 13, alpha,
-                             (src->word_count_actual - (src->word_count_actual / src->train_words) * src->train_words)/ (real)(src->train_words + 1) * 100,
-                             src->word_count_actual / ((real)(now - start + 1) / (real)CLOCKS_PER_SEC * 1000));
-        }
-        fflush(stdout);
-      }
+void *StreamDistributorThread(void *arg) {
+  FILE *src_fi = OpenStream(src->train_file), *tgt_fi = NULL, *align_fi = NULL;
+  char *line = NULL, *tgt_data = NULL, *align_data = NULL;
+  long long tgt_max = 0, align_max = 0, src_max, lines;
+  size_t line_size = 0;
+  struct stream_batch *batch;
 
-      alpha = starting_alpha * (1 - (cur_iter * src->train_words + src->word_count_actual) / (real)(num_train_iters * src->train_words + 1));
-      if (alpha < starting_alpha * 0.0001) alpha = starting_alpha * 0.0001;
-      if (is_bi) bi_alpha = alpha*bi_weight;
+  if (is_bi) tgt_fi = OpenStream(tgt->train_file);
+  if (align_opt) align_fi = OpenStream(align_file);
+  while (1) {
+    batch = (struct stream_batch *)calloc(1, sizeof(struct stream_batch));
+    src_max = 0;
+    batch->tgt_len = batch->align_len = 0;
+    for (lines = 0; lines < STREAM_BATCH_LINES; lines++) {
+      if (!StreamReadLine(src_fi, &line, &line_size, &batch->data, &batch->src_len, &src_max)) break;
+      if (is_bi && !StreamReadLine(tgt_fi, &line, &line_size, &tgt_data, &batch->tgt_len, &tgt_max)) {
+        printf("ERROR: %s has fewer lines than %s\n", tgt->train_file, src->train_file);
+        exit(1);
+      }
+      if (align_opt && !StreamReadLine(align_fi, &line, &line_size, &align_data, &batch->align_len, &align_max)) {
+        printf("ERROR: %s has fewer lines than %s\n", align_file, src->train_file);
+        exit(1);
+      }
+    }
+    if (lines == 0) {
+      free(batch->data);
+      free(batch);
+      break;
     }
+    batch->data = (char *)realloc(batch->data, batch->src_len + batch->tgt_len + batch->align_len);
+    memcpy(batch->data + batch->src_len, tgt_data, batch->tgt_len);
+    memcpy(batch->data + batch->src_len + batch->tgt_len, align_data, batch->align_len);
+    StreamPush(&stream_queue, batch);
+  }
+  StreamClose(&stream_queue);
+
+  if (src_fi != stdin) fclose(src_fi);
+  if (tgt_fi != NULL && tgt_fi != stdin) fclose(tgt_fi);
+  if (align_fi != NULL && align_fi != stdin) fclose(align_fi);
+  free(line);
+  free(tgt_data);
+  free(align_data);
+  return NULL;
+}
 
+// Per-thread streaming state: the batch being trained on and the readers that share it
+struct stream_state {
+  struct stream_batch *batch;
+  struct corpus_reader *src, *tgt, *align;
+};
 
-    // load src sentence
-    src_sentence_length = 0;
-    src_sentence_orig_length = 0;
-    while (1) {
-      word = ReadWordIndex(src_fi, src->vocab, src->vocab_hash);
-      if (feof(src_fi) || word == 0) break; // end of file or sentence
-      if(src_sentence_orig_length>=MAX_WORD_PER_SENT) continue; // read enough
+// Refill of the src reader: src is read first for every sentence pair, so running out of src text
+// means tgt and align are done with the batch too, and all three move on to the next one together
+int StreamRefill(struct corpus_reader *reader) {
+  struct stream_state *state = (struct stream_state *)reader->refill_arg;
+  struct stream_batch *batch;
+
+  if (state->batch != NULL) {
+    free(state->batch->data);
+    free(state->batch);
+  }
+  batch = state->batch = StreamPop(&stream_queue);
+  if (batch == NULL) return 0;
+  OpenMemoryReader(state->src, batch->data, 0, batch->src_len);
+  state->src->refill = StreamRefill;
+  state->src->refill_arg = state;
+  if (state->tgt != NULL) OpenMemoryReader(state->tgt, batch->data, batch->src_len, batch->src_len + batch->tgt_len);
+  if (state->align != NULL) OpenMemoryReader(state->align, batch->data, batch->src_len + batch->tgt_len,
+                                                batch->src_len + batch->tgt_len + batch->align_len);
+  return 1;
+}
+
+void OpenStreamReaders(struct stream_state *state, struct corpus_reader *src_reader, struct corpus_reader *tgt_reader, struct corpus_reader *align_reader) {
+  static const char empty[1] = "";
+  state->batch = NULL;
+  state->src = src_reader;
+  state->tgt = is_bi ? tgt_reader : NULL;
+  state->align = align_opt ? align_reader : NULL;
+  OpenMemoryReader(src_reader, empty, 0, 0);
+  src_reader->refill = StreamRefill;
+  src_reader->refill_arg = state;
+  if (is_bi) OpenMemoryReader(tgt_reader, empty, 0, 0);
+  if (align_opt) OpenMemoryReader(align_reader, empty, 0, 0);
+}
+/** End Streaming input **/
 
-      // keep the orig src
+// Opens the reader over block id of the training corpus, compiled or text
+void OpenTrainReader(struct corpus_reader *reader, struct train_params *params, long long id) {
+  if (params->ids != NULL) OpenIdReader(reader, params->ids, params->id_blocks[id], params->id_blocks[id + 1]);
+  else if (params->train_source != NULL) OpenSourceReader(reader, params->train_source, params->line_blocks[id], params->line_blocks[id + 1]);
+  else OpenCorpusReader(reader, params->train_file, params->line_blocks[id]);
+}
+
+/** Sentence loading **/
+// A sentence_loader reads the sentence pairs of one training thread: it tokenizes and subsamples the
+// src and tgt sentences and reads their alignment links. With -prefetch N, a helper thread per
+// training thread loads the next N pairs into one of two batches while the training thread works
+// through the other, so I/O and tokenization overlap with the SGD updates.
+struct sentence_pair {
+  long long src_sen[MAX_WORD_PER_SENT + 1], tgt_sen[MAX_WORD_PER_SENT + 1];
+  int src_sentence_length, tgt_sentence_length;
+  int src_sentence_orig_length, tgt_sentence_orig_length;
+  int src_id_map[MAX_WORD_PER_SENT + 1], tgt_id_map[MAX_WORD_PER_SENT + 1]; // map from original indices to new indices if id_map[j]==-1, word j is deleted
+  int src_align_map[MAX_WORD_PER_SENT + 1]; // map from src positions to tgt positions
 #ifdef DEBUG
-      if (word==-1) src_sen_orig[src_sentence_orig_length] = src->unk_id;
-      else src_sen_orig[src_sentence_orig_length] = word;
+  long long src_sen_orig[MAX_WORD_PER_SENT + 1], tgt_sen_orig[MAX_WORD_PER_SENT + 1];
 #endif
-      src_sentence_orig_length++;
+  long long src_word_count, tgt_word_count; // words read by the thread so far, this pair included
+  int src_eof;
+  int stop; // 0: more pairs follow, 1: last pair, 2: last pair, stop before its alignment links
+};
 
-      // unknown token. IMPORTANT: this line needs to be after the one where we store src_sen_orig (for bilingual models to work)
-      if (word == -1) {
-        src_id_map[src_sentence_orig_length-1] = -1;
-        continue;
-      }
-      src_word_count++;
+struct sentence_batch {
+  struct sentence_pair *pairs;
+  int num_pairs;
+  int ready; // filled by the loader and not yet consumed
+};
 
-      // The subsampling randomly discards frequent words while keeping the ranking same
-      if (sample > 0) {
-        // larger sample means larger ran, which means discard less frequent
-        // [ sqrt(freq) / sqrt(sample * N) + 1 ] * (sample * N / freq) = sqrt(sample * N / freq) + (sample * N / freq)
-        real ran = (sqrt(src->vocab[word].cn / (sample * src->train_words)) + 1) * (sample * src->train_words) / src->vocab[word].cn;
-        next_random = next_random * (unsigned long long)25214903917 + 11;
-        if (ran < (next_random & 0xFFFF) / (real)65536) { // discard
+struct sentence_loader {
+  long long id;
+  struct corpus_reader src_reader, tgt_reader, align_reader;
+  struct stream_state stream_state;
+  const int *bundle_pos, *bundle_end, *record; // records of the thread and the one being loaded, with -bundle
+  const char *align_pos, *align_end; // compiled alignment lines of the thread
+  long long src_word_count, tgt_word_count, sent_id;
+  unsigned long long next_random; // subsampling draws of the helper thread
+  int done;
+
+  // prefetching
+  pthread_t pt;
+  pthread_mutex_t mutex;
+  pthread_cond_t cond;
+  struct sentence_batch batches[2];
+  int cur_batch, cur_pair;
+};
+
+// Reads one sentence of params into sen, subsampling frequent words; returns 1 at the end of the reader
+int LoadSentence(struct corpus_reader *reader, struct train_params *params, real sample, long long *sen, int *sentence_length,
+    int *sentence_orig_length, int *id_map, long long *sen_orig, long long *word_count, unsigned long long *next_random) {
+  long long word;
+
+  *sentence_length = 0;
+  *sentence_orig_length = 0;
+  while (1) {
+    word = ReadWordIndex(reader, params);
+    if (reader->eof || word == 0) break; // end of file or sentence
+    if (*sentence_orig_length >= MAX_WORD_PER_SENT) continue; // read enough
 
+    // keep the orig sentence
 #ifdef DEBUG
-          printf(" %s", src->vocab[word].word);
+    if (word == -1) sen_orig[*sentence_orig_length] = params->unk_id;
+    else sen_orig[*sentence_orig_length] = word;
 #endif
+    (*sentence_orig_length)++;
 
-          src_id_map[src_sentence_orig_length-1] = -1;
-          continue;
-        } else {
-          src_id_map[src_sentence_orig_length-1] = src_sentence_length;
-        }
+    // unknown token. IMPORTANT: this line needs to be after the one where we store sen_orig (for bilingual models to work)
+    if (word == -1) {
+      id_map[*sentence_orig_length - 1] = -1;
+      continue;
+    }
+    (*word_count)++;
+
+    // The subsampling randomly discards frequent words while keeping the ranking same
+    if (sample > 0) {
+      // larger sample means larger ran, which means discard less frequent
+      // [ sqrt(freq) / sqrt(sample * N) + 1 ] * (sample * N / freq) = sqrt(sample * N / freq) + (sample * N / freq)
+      real ran = (sqrt(params->vocab[word].cn / (sample * params->train_words)) + 1) * (sample * params->train_words) / params->vocab[word].cn;
+      *next_random = *next_random * (unsigned long long)25214903917 + 11;
+      if (ran < (*next_random & 0xFFFF) / (real)65536) { // discard
+#ifdef DEBUG
+        printf(" %s", params->vocab[word].word); fflush(stdout);
+#endif
+        id_map[*sentence_orig_length - 1] = -1;
+        continue;
       }
-
-      src_sen[src_sentence_length] = word;
-      src_sentence_length++;
     }
+    id_map[*sentence_orig_length - 1] = *sentence_length;
+
+    sen[*sentence_length] = word;
+    (*sentence_length)++;
+  }
+  return reader->eof;
+}
 
+// Loads the src sentence of the next pair
+void LoadSrcSentence(struct sentence_loader *loader, struct sentence_pair *pair, unsigned long long *next_random) {
+  long long *src_sen_orig = NULL;
+
+#ifdef DEBUG
+  src_sen_orig = pair->src_sen_orig;
+  printf("# Load sentence %lld, src_word_count %lld\n", loader->sent_id, loader->src_word_count); fflush(stdout);
+  printf("  src, sample=%g, dropping words:", sample); fflush(stdout);
+#endif
+  if (bundle_records != NULL) { // an id reader over the record, empty once the thread's records run out
+    loader->record = NULL;
+    if (loader->bundle_pos < loader->bundle_end) {
+      loader->record = loader->bundle_pos;
+      loader->bundle_pos = NextBundleRecord(loader->record);
+      OpenIdReader(&loader->src_reader, loader->record + 3, 0, loader->record[0]);
+    } else OpenIdReader(&loader->src_reader, loader->bundle_end, 0, 0);
+  }
+  pair->src_eof = LoadSentence(&loader->src_reader, src, sample, pair->src_sen, &pair->src_sentence_length,
+      &pair->src_sentence_orig_length, pair->src_id_map, src_sen_orig, &loader->src_word_count, next_random);
+  if (loader->record != NULL) pair->src_eof = 0;
 #ifdef DEBUG
-      sprintf(prefix, "\n  src orig %lld, len %d:", sent_id, src_sentence_orig_length);
-      print_sent(src_sen_orig, src_sentence_orig_length, src->vocab, prefix);
-      sprintf(prefix, "  src %lld, len %d:", sent_id, src_sentence_length);
-      print_sent(src_sen, src_sentence_length, src->vocab, prefix);
+  sprintf(prefix, "\n  src orig %lld, len %d:", loader->sent_id, pair->src_sentence_orig_length);
+  print_sent(pair->src_sen_orig, pair->src_sentence_orig_length, src->vocab, prefix);
+  sprintf(prefix, "  src %lld, len %d:", loader->sent_id, pair->src_sentence_length);
+  print_sent(pair->src_sen, pair->src_sentence_length, src->vocab, prefix);
 #endif
+}
 
-    ProcessSentence(src_sentence_length, src_sen, src, &next_random, neu1, neu1e);
-    
-    if (is_bi) {
-      // load tgt sentence
-      tgt_sentence_length = 0;
-      tgt_sentence_orig_length = 0;
+// Loads the tgt sentence and alignment links of the pair whose src sentence was just loaded
+void LoadTgtSentence(struct sentence_loader *loader, struct sentence_pair *pair, unsigned long long *next_random) {
+  long long *tgt_sen_orig = NULL;
+  int tgt_eof, src_pos, num_links;
 
 #ifdef DEBUG
-      printf("  tgt, sample=%g, dropping words:", tgt_sample); fflush(stdout);
+  tgt_sen_orig = pair->tgt_sen_orig;
+#endif
+  pair->stop = 0;
+  if (is_bi) {
+#ifdef DEBUG
+    printf("  tgt, sample=%g, dropping words:", tgt_sample); fflush(stdout);
 #endif
-      while (1) {
-        word = ReadWordIndex(tgt_fi, tgt->vocab, tgt->vocab_hash);
-        if (feof(tgt_fi) || word == 0) break; // end of file or sentence
-        if(tgt_sentence_orig_length>=MAX_WORD_PER_SENT) continue; // read enough
-
-        // keep the orig tgt
-#ifdef DEBUG 
-        if (word==-1) tgt_sen_orig[tgt_sentence_orig_length] = tgt->unk_id;
-        else tgt_sen_orig[tgt_sentence_orig_length] = word;
+    if (bundle_records != NULL) {
+      if (loader->record != NULL) OpenIdReader(&loader->tgt_reader, loader->record + 3 + loader->record[0], 0, loader->record[1]);
+      else OpenIdReader(&loader->tgt_reader, loader->bundle_end, 0, 0);
+    }
+    tgt_eof = LoadSentence(&loader->tgt_reader, tgt, tgt_sample, pair->tgt_sen, &pair->tgt_sentence_length,
+        &pair->tgt_sentence_orig_length, pair->tgt_id_map, tgt_sen_orig, &loader->tgt_word_count, next_random);
+    if (loader->record != NULL) tgt_eof = 0;
+#ifdef DEBUG
+    sprintf(prefix, "\n  tgt orig %lld, len %d:", loader->sent_id, pair->tgt_sentence_orig_length);
+    print_sent(pair->tgt_sen_orig, pair->tgt_sentence_orig_length, tgt->vocab, prefix);
+    sprintf(prefix, "  tgt %lld, len %d:", loader->sent_id, pair->tgt_sentence_length);
+    print_sent(pair->tgt_sen, pair->tgt_sentence_length, tgt->vocab, prefix);
 #endif
+    if (tgt_eof) pair->stop = 2;
+    if (!stream_input && loader->tgt_word_count > tgt->train_words / num_threads) pair->stop = 2; // a streaming thread must drain the queue
+
+    if (align_opt && !pair->stop) { // use unsupervised alignments
+      for (src_pos = 0; src_pos < pair->src_sentence_orig_length; ++src_pos) pair->src_align_map[src_pos] = -1;
+      if (loader->record != NULL) ApplyAlignLinks((const struct align_link *)(loader->record + 3 + loader->record[0] + loader->record[1]),
+                                                  loader->record[2], pair->src_align_map);
+      else if (align_links != NULL) {
+        if (loader->align_pos < loader->align_end) {
+          num_links = *(const unsigned short *)loader->align_pos;
+          ApplyAlignLinks((const struct align_link *)(loader->align_pos + sizeof(unsigned short)), num_links, pair->src_align_map);
+          loader->align_pos += sizeof(unsigned short) + num_links * sizeof(struct align_link);
+        }
+      } else ReadAlignLine(&loader->align_reader, pair->src_align_map);
+    }
+  }
 
-        tgt_sentence_orig_length++;
+  if (!pair->stop && pair->src_eof) pair->stop = 1;
+  if (!pair->stop && !stream_input && loader->src_word_count > src->train_words / num_threads) pair->stop = 1;
+  pair->src_word_count = loader->src_word_count;
+  pair->tgt_word_count = loader->tgt_word_count;
+  if (pair->stop) loader->done = 1;
+  loader->sent_id++;
+}
 
-        // unknown token. IMPORTANT: this line needs to be after the one where we store sen_orig for bilingual models to work
-        if (word == -1) {
-          tgt_id_map[tgt_sentence_orig_length-1] = -1;
-          continue;
-        }
-        tgt_word_count++;
+void LoadSentencePair(struct sentence_loader *loader, struct sentence_pair *pair, unsigned long long *next_random) {
+  LoadSrcSentence(loader, pair, next_random);
+  LoadTgtSentence(loader, pair, next_random);
+}
 
+void *PrefetchThread(void *arg) {
+  struct sentence_loader *loader = (struct sentence_loader *)arg;
+  struct sentence_batch *batch;
+  int b = 0;
+
+  while (!loader->done) {
+    batch = &loader->batches[b];
+    pthread_mutex_lock(&loader->mutex);
+    while (batch->ready) pthread_cond_wait(&loader->cond, &loader->mutex);
+    pthread_mutex_unlock(&loader->mutex);
+
+    for (batch->num_pairs = 0; batch->num_pairs < prefetch && !loader->done; batch->num_pairs++)
+      LoadSentencePair(loader, &batch->pairs[batch->num_pairs], &loader->next_random);
+
+    pthread_mutex_lock(&loader->mutex);
+    batch->ready = 1;
+    pthread_cond_signal(&loader->cond);
+    pthread_mutex_unlock(&loader->mutex);
+    b ^= 1;
+  }
+  return NULL;
+}
 
-        // The subsampling randomly discards frequent words while keeping the ranking same
-        if (tgt_sample > 0) {
-          real ran = (sqrt(tgt->vocab[word].cn / (tgt_sample * tgt->train_words)) + 1) * (tgt_sample * tgt->train_words) / tgt->vocab[word].cn;
-          next_random = next_random * (unsigned long long)25214903917 + 11;
-          if (ran < (next_random & 0xFFFF) / (real)65536) {
+// Opens the readers over block id of the corpus and, with -prefetch, starts the helper thread
+void OpenSentenceLoader(struct sentence_loader *loader, long long id) {
+  int b;
+
+  loader->id = id;
+  loader->src_word_count = loader->tgt_word_count = loader->sent_id = 0;
+  loader->done = 0;
+  loader->record = NULL;
+  if (bundle_records != NULL) {
+    loader->bundle_pos = bundle_records + bundle_blocks[id];
+    loader->bundle_end = bundle_records + bundle_blocks[id + 1];
+  } else if (stream_input) OpenStreamReaders(&loader->stream_state, &loader->src_reader, &loader->tgt_reader, &loader->align_reader);
+  else {
+    // src
+    OpenTrainReader(&loader->src_reader, src, id);
+    // tgt
+    if (is_bi) OpenTrainReader(&loader->tgt_reader, tgt, id);
+    // align
+    if (align_opt && align_links != NULL) {
+      loader->align_pos = align_links + align_line_blocks[id];
+      loader->align_end = align_links + align_line_blocks[id + 1];
+    } else if (align_opt) {
+      if (align_source != NULL) OpenSourceReader(&loader->align_reader, align_source, align_line_blocks[id], align_line_blocks[id + 1]);
+      else OpenCorpusReader(&loader->align_reader, align_file, align_line_blocks[id]);
+    }
+  }
 
-#ifdef DEBUG
-            printf(" %s", tgt->vocab[word].word); fflush(stdout);
-#endif
+  if (prefetch > 0) {
+    // its own draws, so the subsampling doesn't follow the training thread's negative samples
+    loader->next_random = id * (unsigned long long)25214903917 + 0x5DEECE66DULL;
+    for (b = 0; b < 2; b++) {
+      loader->batches[b].pairs = (struct sentence_pair *)malloc(prefetch * sizeof(struct sentence_pair));
+      if (loader->batches[b].pairs == NULL) {
+        printf("Memory allocation failed\n");
+        exit(1);
+      }
+      loader->batches[b].num_pairs = 0;
+      loader->batches[b].ready = 0;
+    }
+    loader->cur_batch = loader->cur_pair = 0;
+    pthread_mutex_init(&loader->mutex, NULL);
+    pthread_cond_init(&loader->cond, NULL);
+    pthread_create(&loader->pt, NULL, PrefetchThread, (void *)loader);
+  }
+}
 
-            tgt_id_map[tgt_sentence_orig_length-1] = -1;
-            continue;
-          } else {
-            tgt_id_map[tgt_sentence_orig_length-1] = tgt_sentence_length;
-          }
+// Next sentence pair of the loader, taken from the prefetched batches. Without prefetching only the
+// src sentence is loaded into *pair, and LoadTgtSentence loads the rest once the src sentence has
+// been trained on, which keeps the draws of next_random in their sequential order.
+struct sentence_pair *NextSentencePair(struct sentence_loader *loader, struct sentence_pair *pair, unsigned long long *next_random) {
+  struct sentence_batch *batch;
+
+  if (prefetch == 0) {
+    LoadSrcSentence(loader, pair, next_random);
+    return pair;
+  }
+
+  batch = &loader->batches[loader->cur_batch];
+  if (loader->cur_pair > 0 && loader->cur_pair == batch->num_pairs) { // done with this batch, hand it back
+    pthread_mutex_lock(&loader->mutex);
+    if (batch->ready) {
+      batch->ready = 0;
+      pthread_cond_signal(&loader->cond);
+    }
+    pthread_mutex_unlock(&loader->mutex);
+    loader->cur_batch ^= 1;
+    loader->cur_pair = 0;
+    batch = &loader->batches[loader->cur_batch];
+  }
+  if (loader->cur_pair == 0) {
+    pthread_mutex_lock(&loader->mutex);
+    while (!batch->ready) pthread_cond_wait(&loader->cond, &loader->mutex);
+    pthread_mutex_unlock(&loader->mutex);
+  }
+  return &batch->pairs[loader->cur_pair++];
+}
+
+// Called once the last pair has been trained on
+void CloseSentenceLoader(struct sentence_loader *loader) {
+  int b;
+
+  if (prefetch > 0) {
+    pthread_join(loader->pt, NULL);
+    pthread_mutex_destroy(&loader->mutex);
+    pthread_cond_destroy(&loader->cond);
+    for (b = 0; b < 2; b++) free(loader->batches[b].pairs);
+  }
+  if (bundle_records != NULL) return;
+  CloseCorpusReader(&loader->src_reader);
+  if (is_bi) CloseCorpusReader(&loader->tgt_reader);
+  if (align_opt && align_links == NULL) CloseCorpusReader(&loader->align_reader);
+}
+/** End Sentence loading **/
+
+void *TrainModelThread(void *id) {
+  long long src_word_count = 0, src_last_word_count = 0;
+  unsigned long long next_random = (long long)id;
+  clock_t now;
+  struct sentence_loader *loader = (struct sentence_loader *)calloc(1, sizeof(struct sentence_loader));
+  struct sentence_pair *pair = NULL, *pair_buffer = NULL;
+
+  // for align
+  int count;
+  int src_pos, tgt_pos;
+
+  real *neu1 = (real *)calloc(layer1_stride, sizeof(real)); // cbow
+  // skipgram: a row per pair of a -shared-negatives block; with -minibatch the input rows, then the output rows, of a batch
+  real *neu1e = (real *)calloc(layer1_stride * (minibatch ? window * 4 + negative : shared_negatives ? window * 2 : 1), sizeof(real));
+
+  if (prefetch == 0) pair_buffer = (struct sentence_pair *)malloc(sizeof(struct sentence_pair));
+  OpenSentenceLoader(loader, (long long)id);
+
+  while (1) {
+    if (src_word_count - src_last_word_count > 10000) {
+      src->word_count_actual += src_word_count - src_last_word_count;
+      src_last_word_count = src_word_count;
+      if ((debug_mode > 1)) {
+        now=clock();
+        if (is_bi){
+          printf("%cAlpha: %f, bi_alpha: %f,  Progress: %.2f%%  Words/thread/sec: %.2fk  ", 13, alpha, bi_alpha,
+                   (src->word_count_actual - (src->word_count_actual / src->train_words) * src->train_words)/ (real)(src->train_words + 1) * 100,
+                   src->word_count_actual / ((real)(now - start + 1) / (real)CLOCKS_PER_SEC * 1000));
+        } else {
+          printf("%cAlpha: %f  Progress: %.2f%%  Words/thread/sec: %.2fk  ", 13, alpha,
+                             (src->word_count_actual - (src->word_count_actual / src->train_words) * src->train_words)/ (real)(src->train_words + 1) * 100,
+                             src->word_count_actual / ((real)(now - start + 1) / (real)CLOCKS_PER_SEC * 1000));
         }
-      
-        tgt_sen[tgt_sentence_length] = word;
-        tgt_sentence_length++;
+        fflush(stdout);
       }
 
-#ifdef DEBUG 
-        sprintf(prefix, "\n  tgt orig %lld, len %d:", sent_id, tgt_sentence_orig_length);
-        print_sent(tgt_sen_orig, tgt_sentence_orig_length, tgt->vocab, prefix);
-        sprintf(prefix, "  tgt %lld, len %d:", sent_id, tgt_sentence_length);
-        print_sent(tgt_sen, tgt_sentence_length, tgt->vocab, prefix);
-#endif
+      alpha = starting_alpha * (1 - (cur_iter * src->train_words + src->word_count_actual) / (real)(num_train_iters * src->train_words + 1));
+      if (alpha < starting_alpha * 0.0001) alpha = starting_alpha * 0.0001;
+      if (is_bi) bi_alpha = alpha*bi_weight;
+    }
 
-      ProcessSentence(tgt_sentence_length, tgt_sen, tgt, &next_random, neu1, neu1e);
+    // load src sentence
+    pair = NextSentencePair(loader, pair_buffer, &next_random);
 
-      if (feof(tgt_fi)) break;
-      if (tgt_word_count > tgt->train_words / num_threads) break;
+    ProcessSentence(pair->src_sentence_length, pair->src_sen, src, &next_random, neu1, neu1e);
 
-      // align
-      if (align_opt) { // use unsupervised alignments
-        for (src_pos = 0; src_pos < src_sentence_orig_length; ++src_pos) src_align_map[src_pos] = -1;
+    // load tgt sentence
+    if (prefetch == 0) LoadTgtSentence(loader, pair, &next_random);
+    src_word_count = pair->src_word_count;
 
-        while (fscanf(align_fi, "%d %d%c", &src_pos, &tgt_pos, &ch)) {
-          src_align_map[src_pos] = tgt_pos;
-          if (ch == '\n') break;
-        }
+    if (is_bi) {
+      ProcessSentence(pair->tgt_sentence_length, pair->tgt_sen, tgt, &next_random, neu1, neu1e);
+      if (pair->stop == 2) break;
 
-        for (src_pos = 0; src_pos < src_sentence_orig_length; ++src_pos) {
-          if(src_id_map[src_pos]==-1) continue;
+      // align
+      if (align_opt) { // use unsupervised alignments
+        for (src_pos = 0; src_pos < pair->src_sentence_orig_length; ++src_pos) {
+          if(pair->src_id_map[src_pos]==-1) continue;
 
           // get tgt_pos
-          if(src_align_map[src_pos]==-1){ // no alignment, try to infer
+          if(pair->src_align_map[src_pos]==-1){ // no alignment, try to infer
             count = 0;
             tgt_pos = 0;
-            if(src_pos>0 && src_align_map[src_pos-1]!=-1){ // previous link
-              tgt_pos += src_align_map[src_pos-1];
+            if(src_pos>0 && pair->src_align_map[src_pos-1]!=-1){ // previous link
+              tgt_pos += pair->src_align_map[src_pos-1];
               count++;
             }
-            if(src_pos<(src_sentence_orig_length-1) && src_align_map[src_pos+1]!=-1){ // next link
-              tgt_pos += src_align_map[src_pos+1];
+            if(src_pos<(pair->src_sentence_orig_length-1) && pair->src_align_map[src_pos+1]!=-1){ // next link
+              tgt_pos += pair->src_align_map[src_pos+1];
               count++;
             }
             if (count>0) tgt_pos = tgt_pos / count;
           } else {
-            tgt_pos = src_align_map[src_pos];
+            tgt_pos = pair->src_align_map[src_pos];
             count = 1;
           }
 
-          if (count>0 && tgt_id_map[tgt_pos]>=0){
-            ProcessSentenceAlign(src, src_sen[src_id_map[src_pos]], src_id_map[src_pos],
-                tgt, tgt_sen, tgt_sentence_length, tgt_id_map[tgt_pos],
+          if (count>0 && pair->tgt_id_map[tgt_pos]>=0){
+            ProcessSentenceAlign(src, pair->src_sen[pair->src_id_map[src_pos]], pair->src_id_map[src_pos],
+                tgt, pair->tgt_sen, pair->tgt_sentence_length, pair->tgt_id_map[tgt_pos],
                 &next_random, neu1, neu1e);
-            ProcessSentenceAlign(tgt, tgt_sen[tgt_id_map[tgt_pos]], tgt_id_map[tgt_pos],
-                src, src_sen, src_sentence_length, src_id_map[src_pos],
+            ProcessSentenceAlign(tgt, pair->tgt_sen[pair->tgt_id_map[tgt_pos]], pair->tgt_id_map[tgt_pos],
+                src, pair->src_sen, pair->src_sentence_length, pair->src_id_map[src_pos],
                 &next_random, neu1, neu1e);
           }
         }
       } else { // uniform alignments
-        for (src_pos = 0; src_pos < src_sentence_orig_length; ++src_pos) {
-          tgt_pos = src_pos * tgt_sentence_orig_length / src_sentence_orig_length;
-          if(src_id_map[src_pos]>=0 && tgt_id_map[tgt_pos]>=0){
-            ProcessSentenceAlign(src, src_sen[src_id_map[src_pos]], src_id_map[src_pos],
-                tgt, tgt_sen, tgt_sentence_length, tgt_id_map[tgt_pos],
+        for (src_pos = 0; src_pos < pair->src_sentence_orig_length; ++src_pos) {
+          tgt_pos = src_pos * pair->tgt_sentence_orig_length / pair->src_sentence_orig_length;
+          if(pair->src_id_map[src_pos]>=0 && pair->tgt_id_map[tgt_pos]>=0){
+            ProcessSentenceAlign(src, pair->src_sen[pair->src_id_map[src_pos]], pair->src_id_map[src_pos],
+                tgt, pair->tgt_sen, pair->tgt_sentence_length, pair->tgt_id_map[tgt_pos],
                 &next_random, neu1, neu1e);
-            ProcessSentenceAlign(tgt, tgt_sen[tgt_id_map[tgt_pos]], tgt_id_map[tgt_pos],
-                src, src_sen, src_sentence_length, src_id_map[src_pos],
+            ProcessSentenceAlign(tgt, pair->tgt_sen[pair->tgt_id_map[tgt_pos]], pair->tgt_id_map[tgt_pos],
+                src, pair->src_sen, pair->src_sentence_length, pair->src_id_map[src_pos],
                 &next_random, neu1, neu1e);
           }
         }
       }
     } // end is_bi
 
-#ifdef DEBUG
-    if ((sent_id % 1000) == 0) printf("Done process sentence\n");
-    //if (align_debug) align_debug = 0;
-#endif
-
-    sent_id++;
-    if (feof(src_fi)) break;
-    if (src_word_count > src->train_words / num_threads) break;
+    if (pair->stop) break;
   }
   
-  fclose(src_fi);
-  if (is_bi) fclose(tgt_fi);
-  if (align_opt) fclose(align_fi);
-
+  CloseSentenceLoader(loader);
+  free(loader);
+  free(pair_buffer);
   free(neu1);
   free(neu1e);
   pthread_exit(NULL);
@@ -1129,7 +3635,7 @@ void SaveVector(char* output_prefix, char* lang, struct train_params *params, in
   long a, b;
   long long vocab_size = params->vocab_size;
   struct vocab_word *vocab = params->vocab;
-  real sum;
+  real sum, *syn0, *syn1neg = NULL, in_buf[layer1_stride], out_buf[layer1_stride];
   int save_out_vecs = 0, save_avg_vecs = 0;
   if (opt==1) save_avg_vecs = 1;
   if (opt==2) save_out_vecs = 1;
@@ -1137,15 +3643,13 @@ void SaveVector(char* output_prefix, char* lang, struct train_params *params, in
   char output_file[MAX_STRING];
   sprintf(output_file, "%s.%s", output_prefix, lang);
 
-  // Save the word vectors
-  real *syn0 = params->syn0;
+  // Save the word vectors, as floats also with -bf16 (syn0 and syn1neg are then the row of word a)
   FILE* fo = fopen(output_file, "wb");
   fprintf(fo, "%lld %lld\n", vocab_size, layer1_size);
 
   // Save sum out vecs or sum of in and out vecs
   FILE* fo_sum = NULL;
   FILE* fo_out = NULL;
-  real *syn1neg = params->syn1neg; // negative sampling
   if(hs==0) { // only for negative sampling, we have the notion of output vectors
     if (save_avg_vecs){
       char sum_vector_file[MAX_STRING];
@@ -1163,6 +3667,8 @@ void SaveVector(char* output_prefix, char* lang, struct train_params *params, in
   }
 
   for (a = 0; a < vocab_size; a++) {
+    syn0 = LoadRow(params->syn0, params->syn0_bf16, a, in_buf);
+    if (hs == 0 && (save_avg_vecs || save_out_vecs)) syn1neg = LoadRow(params->syn1neg, params->syn1neg_bf16, a, out_buf); // negative sampling
     fprintf(fo, "%s ", vocab[a].word);
     if(hs==0) {
       if (save_avg_vecs) fprintf(fo_sum, "%s ", vocab[a].word);
@@ -1171,27 +3677,27 @@ void SaveVector(char* output_prefix, char* lang, struct train_params *params, in
 
     if (binary) { // binary
       for (b = 0; b < layer1_size; b++) {
-        fwrite(&syn0[a * layer1_size + b], sizeof(real), 1, fo);
+        fwrite(&syn0[b], sizeof(real), 1, fo);
 
         if(hs==0) {
           if (save_avg_vecs) {
-            sum = syn0[a * layer1_size + b] + syn1neg[a * layer1_size + b];
+            sum = syn0[b] + syn1neg[b];
             fwrite(&sum, sizeof(real), 1, fo_sum);
           }
-          if (save_out_vecs) fwrite(&syn1neg[a * layer1_size + b], sizeof(real), 1, fo_out);
+          if (save_out_vecs) fwrite(&syn1neg[b], sizeof(real), 1, fo_out);
         }
 
       }
     } else { // text
       for (b = 0; b < layer1_size; b++) {
-        fprintf(fo, "%lf ", syn0[a * layer1_size + b]);
+        fprintf(fo, "%lf ", syn0[b]);
 
         if(hs==0) {
           if (save_avg_vecs) {
-            sum = syn0[a * layer1_size + b] + syn1neg[a * layer1_size + b];
+            sum = syn0[b] + syn1neg[b];
             fprintf(fo_sum, "%lf ", sum);
           }
-          if (save_out_vecs) fprintf(fo_out, "%lf ", syn1neg[a * layer1_size + b]);
+          if (save_out_vecs) fprintf(fo_out, "%lf ", syn1neg[b]);
         }
       }
     }
@@ -1214,7 +3720,7 @@ void KMeans(char* output_file, struct train_params *params){
   long a, b, c, d;
   long long vocab_size = params->vocab_size;
   struct vocab_word *vocab = params->vocab;
-  real *syn0 = params->syn0;
+  real *row, buf[layer1_stride];
   FILE* fo = fopen(output_file, "wb");
   
   // Run K-means on the word vectors
@@ -1228,7 +3734,8 @@ void KMeans(char* output_file, struct train_params *params){
     for (b = 0; b < clcn * layer1_size; b++) cent[b] = 0;
     for (b = 0; b < clcn; b++) centcn[b] = 1;
     for (c = 0; c < vocab_size; c++) {
-      for (d = 0; d < layer1_size; d++) cent[layer1_size * cl[c] + d] += syn0[c * layer1_size + d];
+      row = LoadRow(params->syn0, params->syn0_bf16, c, buf);
+      for (d = 0; d < layer1_size; d++) cent[layer1_size * cl[c] + d] += row[d];
       centcn[cl[c]]++;
     }
     for (b = 0; b < clcn; b++) {
@@ -1243,9 +3750,10 @@ void KMeans(char* output_file, struct train_params *params){
     for (c = 0; c < vocab_size; c++) {
       closev = -10;
       closeid = 0;
+      row = LoadRow(params->syn0, params->syn0_bf16, c, buf);
       for (d = 0; d < clcn; d++) {
         x = 0;
-        for (b = 0; b < layer1_size; b++) x += cent[layer1_size * d + b] * syn0[c * layer1_size + b];
+        for (b = 0; b < layer1_size; b++) x += cent[layer1_size * d + b] * row[b];
         if (x > closev) {
           closev = x;
           closeid = d;
@@ -1264,18 +3772,31 @@ void KMeans(char* output_file, struct train_params *params){
 
 // init for each language
 void MonoInit(struct train_params *params, long long train_words){
+  int binary_vocab = 0; // vocab, codes and noise distribution came from vocab_bin_file
   if (access(params->vocab_file, F_OK) != -1) { // vocab file exists
     printf("# Vocab file %s exists. Loading ...\n", params->vocab_file);
-    ReadVocab(params);
+    binary_vocab = LoadBinaryVocab(params);
+    if (!binary_vocab) ReadVocab(params);
     if (train_words>0) params->train_words = train_words;
-    else CountWordsFromTrainFile(params);
+    else if (stream_input) { // can't read the stream twice, keep the sum of the vocab counts
+      if (debug_mode > 0) printf("  Words in train file (from vocab): %lld\n", params->train_words);
+    } else if (params->file_words >= 0) {
+      params->train_words = params->file_words;
+      if (debug_mode > 0) printf("  Words in train file: %lld\n", params->train_words);
+    } else if (compile_corpus && LoadCompiledCorpus(params, &params->train_words)) {
+      params->file_words = params->train_words;
+      if (debug_mode > 0) printf("  Words in train file: %lld\n", params->train_words);
+    } else CountWordsFromTrainFile(params);
+  } else if (stream_input) {
+    printf("ERROR: -stream needs an existing vocab file %s\n", params->vocab_file);
+    exit(1);
   } else { // vocab file doesn't exist
     printf("# Vocab file %s doesn't exists. Deriving ...\n", params->vocab_file);
     LearnVocabFromTrainFile(params);
     SaveVocab(params);
   }
 
-  params->unk_id = params->vocab_hash[GetWordHash(unk_word)];
+  params->unk_id = SearchVocab(unk_word, params);
   if (params->unk_id<0){
     fprintf(stderr, "! Can't find %s in the vocab file %s\n", unk_word, params->vocab_file);
     exit(1);
@@ -1284,9 +3805,31 @@ void MonoInit(struct train_params *params, long long train_words){
   }
 
   sprintf(params->output_file, "%s.%s", output_prefix, params->lang);
+  FreezeVocab(params);
+  if (!binary_vocab) {
+    CreateBinaryTree(params);
+    SaveBinaryVocab(params);
+  }
   InitNet(params);
-  if (negative > 0) InitUnigramTable(params);
-  ComputeBlockStartPoints(params->train_file, num_threads, &params->line_blocks, &params->num_lines);
+  if (negative > 0) InitNoiseSampler(params);
+  if (stream_input) {
+    // nothing to split, the distributor thread hands out lines as they come
+  } else if (bundle_file[0] != 0) {
+    // split by TrainModel once both vocabs are in place
+  } else if (compile_corpus) {
+    long long compiled_words;
+    if (params->ids == NULL && !LoadCompiledCorpus(params, &compiled_words)) {
+      CompileCorpus(params);
+      if (!LoadCompiledCorpus(params, &compiled_words)) {
+        printf("ERROR: can't load compiled corpus %s\n", params->compiled_file);
+        exit(1);
+      }
+    }
+    ComputeIdBlocks(params, num_threads);
+  } else {
+    ComputeBlockStartPoints(params->train_file, num_threads, &params->line_blocks, &params->num_lines);
+    params->train_source = OpenTrainSource(params->train_file);
+  }
 
 #ifdef DEBUG
     printf("  MonoInit Vocab size: %lld\n", params->vocab_size);
@@ -1298,6 +3841,7 @@ void TrainModel() {
   long a;
 
   pthread_t *pt = (pthread_t *)malloc(num_threads * sizeof(pthread_t));
+  pthread_t stream_pt;
   if (is_bi) printf("Starting training using src-file %s and tgt-file %s\n", src->train_file, tgt->train_file);
   else printf("Starting training using src-file %s\n", src->train_file);
   starting_alpha = alpha;
@@ -1309,8 +3853,36 @@ void TrainModel() {
     MonoInit(tgt, tgt_train_words);
     assert(src->num_lines==tgt->num_lines);
   }
-  if (align_opt) {
-    ComputeBlockStartPoints(align_file, num_threads, &align_line_blocks, &align_num_lines);
+  if (bundle_file[0] != 0) {
+    if (!LoadBundle()) {
+      BuildBundle();
+      if (!LoadBundle()) {
+        printf("ERROR: can't load bundle %s\n", bundle_file);
+        exit(1);
+      }
+    }
+    ComputeBundleBlocks(num_threads);
+  } else if (align_opt && !stream_input) {
+    struct stat align_st;
+    if (LoadCompiledAlign(align_file, NULL, num_threads)) {
+      // -align names a compiled file
+    } else if (compile_corpus) {
+      if (snprintf(align_links_file, MAX_STRING, "%s.links", align_file) >= MAX_STRING) {
+        printf("ERROR: alignment file path too long: %s\n", align_file);
+        exit(1);
+      }
+      stat(align_file, &align_st);
+      if (!LoadCompiledAlign(align_links_file, &align_st, num_threads)) {
+        CompileAlign(align_links_file, &align_st);
+        if (!LoadCompiledAlign(align_links_file, &align_st, num_threads)) {
+          printf("ERROR: can't load compiled alignments %s\n", align_links_file);
+          exit(1);
+        }
+      }
+    } else {
+      ComputeBlockStartPoints(align_file, num_threads, &align_line_blocks, &align_num_lines);
+      align_source = OpenTrainSource(align_file);
+    }
     assert(src->num_lines==align_num_lines);
   }
 
@@ -1323,8 +3895,17 @@ void TrainModel() {
 
     // Train Model
     fprintf(stderr, "\n## Start iter %d, alpha=%f ... ", cur_iter, alpha); execute("date"); fflush(stderr);
+    if (stream_input) {
+      for (a = 1; a < 4 * num_threads; a *= 2);
+      StreamQueueInit(&stream_queue, a);
+      pthread_create(&stream_pt, NULL, StreamDistributorThread, NULL);
+    }
     for (a = 0; a < num_threads; a++) pthread_create(&pt[a], NULL, TrainModelThread, (void *)a);
     for (a = 0; a < num_threads; a++) pthread_join(pt[a], NULL);
+    if (stream_input) {
+      pthread_join(stream_pt, NULL);
+      free(stream_queue.slots);
+    }
     fprintf(stderr, "\n# Done iter %d, alpha=%f, ", cur_iter, alpha); execute("date"); fflush(stderr);
     print_model_stat(src);
     if(is_bi) print_model_stat(tgt);
@@ -1392,22 +3973,6 @@ int ArgPos(char *str, int argc, char **argv) {
   return -1;
 }
 
-struct train_params *InitTrainParams() {
-  struct train_params *params = malloc(sizeof(struct train_params));
-
-  params->train_words = 0;
-  params->word_count_actual = 0;
-  params->file_size = 0;
-  params->num_lines = 0;
-
-  params->vocab_size = 0;
-  params->vocab_max_size = 1000;
-  params->vocab = (struct vocab_word *)calloc(params->vocab_max_size, sizeof(struct vocab_word));
-  params->vocab_hash = (int *)calloc(vocab_hash_size, sizeof(int));
-
-  return params;
-}
-
 int main(int argc, char **argv) {
   // srand(21260063);
   int i;
@@ -1417,6 +3982,7 @@ int main(int argc, char **argv) {
     printf("Parameters for training:\n");
     printf("\t-train <file>\n");
     printf("\t\tUse text data from <file> to train the model\n");
+    printf("\t\tTraining and alignment files may be block-compressed with bgzip (the .gzi index is built if missing)\n");
     printf("\t-output <file>\n");
     printf("\t\tUse <file> to save the resulting word vectors / word clusters\n");
     printf("\t-size <int>\n");
@@ -1430,8 +3996,20 @@ int main(int argc, char **argv) {
     printf("\t\tUse Hierarchical Softmax; default is 0 (not used)\n");
     printf("\t-negative <int>\n");
     printf("\t\tNumber of negative examples; default is 5, common values are 3 - 10 (0 = not used)\n");
+    printf("\t-shared-negatives <int>\n");
+    printf("\t\tSkip-gram: draw one set of negative examples per center word for all its context pairs and train\n");
+    printf("\t\tthem as one block; default is 0 (fresh negatives for every pair)\n");
+    printf("\t-minibatch <int>\n");
+    printf("\t\tSkip-gram: score all context words of a center word (all aligned neighbors of a source word) against\n");
+    printf("\t\tthe center word and one shared set of negatives as small matrix products, and write every row back\n");
+    printf("\t\tonce per batch; default is 0 (off)\n");
+    printf("\t-bf16 <int>\n");
+    printf("\t\tStore the embeddings as bfloat16, half the memory of floats, and train them in float with stochastic\n");
+    printf("\t\trounding; the vectors are still saved as floats. Default is 0 (floats)\n");
     printf("\t-threads <int>\n");
     printf("\t\tUse <int> threads (default 12)\n");
+    printf("\t-simd <int>\n");
+    printf("\t\tWidest vector kernels to use if the CPU has them: 0 = scalar, 1 = AVX2/FMA, 2 = AVX-512; default is 2\n");
     printf("\t-min-count <int>\n");
     printf("\t\tThis will discard words that appear less than <int> times; default is 5\n");
     printf("\t-alpha <float>\n");
@@ -1446,8 +4024,31 @@ int main(int argc, char **argv) {
     printf("\t\tThe vocabulary will be saved to <file>\n");
     printf("\t-read-vocab <file>\n");
     printf("\t\tThe vocabulary will be read from <file>, not constructed from the training data\n");
+    printf("\t-src-vocab <file>, -tgt-vocab <file>\n");
+    printf("\t\tVocab files to load (or save); default is <train file>.vocab.min<min-count>\n");
     printf("\t-cbow <int>\n");
     printf("\t\tUse the continuous bag of words model; default is 1 (use 0 for skip-gram model)\n");
+    printf("\t-mmap <int>\n");
+    printf("\t\tTokenize the training files straight from memory-mapped pages; default is 1 (use 0 to read through stdio)\n");
+    printf("\t-compile-corpus <int>\n");
+    printf("\t\tTokenize each training file once into <file>.ids.min<min-count> and train from the word ids, and convert the\n");
+    printf("\t\t-align file into binary links (<file>.links, which -align also accepts directly); default is 0 (off)\n");
+    printf("\t-stream <int>\n");
+    printf("\t\tRead the src/tgt/align files sequentially through one reader thread, so they can be named pipes or - (stdin);\n");
+    printf("\t\tneeds existing vocab files and reopens the inputs every iteration; default is 0 (off)\n");
+    printf("\t-bundle <file>\n");
+    printf("\t\tTrain from <file>, one record per sentence pair with the src/tgt word ids and alignment links;\n");
+    printf("\t\tbuilt from the src/tgt/align files when missing or out of date\n");
+    printf("\t-vocab-sketch <int>\n");
+    printf("\t\tWhen learning a vocab, first count the words approximately in a count-min sketch of <int> MB and then\n");
+    printf("\t\tcount exactly only the words that can reach min-count; same vocab, memory bounded by the candidates;\n");
+    printf("\t\tdefault is 0 (count every word exactly)\n");
+    printf("\t-vocab-shard <int>\n");
+    printf("\t\tOnly count the words of each train file into <file>.vocab.shard (raw counts, for bivec-vocab-merge)\n");
+    printf("\t\tand exit; default is 0 (off)\n");
+    printf("\t-prefetch <int>\n");
+    printf("\t\tLoad and subsample the next <int> sentence pairs of each training thread in a helper thread while\n");
+    printf("\t\tthe current ones train (two batches of <int> pairs per thread); default is 0 (off)\n");
 
     printf("\t-eval <int>\n");
     printf("\t\t0 -- no evaluation, 1 -- eval (default = 0)\n");
@@ -1461,8 +4062,8 @@ int main(int argc, char **argv) {
     return 0;
   }
 
-  src = InitTrainParams();
-  tgt = InitTrainParams();
+  src = InitTrainParams(vocab_hash_size);
+  tgt = InitTrainParams(vocab_hash_size);
 
   if ((i = ArgPos((char *)"-size", argc, argv)) > 0) {
     layer1_size = atoi(argv[i + 1]);
@@ -1497,9 +4098,22 @@ int main(int argc, char **argv) {
   if ((i = ArgPos((char *)"-sample", argc, argv)) > 0) sample = atof(argv[i + 1]);
   if ((i = ArgPos((char *)"-hs", argc, argv)) > 0) hs = atoi(argv[i + 1]);
   if ((i = ArgPos((char *)"-negative", argc, argv)) > 0) negative = atoi(argv[i + 1]);
+  if ((i = ArgPos((char *)"-shared-negatives", argc, argv)) > 0) shared_negatives = atoi(argv[i + 1]);
+  if ((i = ArgPos((char *)"-minibatch", argc, argv)) > 0) minibatch = atoi(argv[i + 1]);
+  if ((i = ArgPos((char *)"-bf16", argc, argv)) > 0) bf16 = atoi(argv[i + 1]);
+  // 64 bytes are 16 floats or 32 bfloat16 values
+  layer1_stride = bf16 ? (layer1_size + 31) / 32 * 32 : (layer1_size + 15) / 16 * 16;
   if ((i = ArgPos((char *)"-threads", argc, argv)) > 0) num_threads = atoi(argv[i + 1]);
+  if ((i = ArgPos((char *)"-simd", argc, argv)) > 0) simd = atoi(argv[i + 1]);
   if ((i = ArgPos((char *)"-min-count", argc, argv)) > 0) min_count = atoi(argv[i + 1]);
   if ((i = ArgPos((char *)"-classes", argc, argv)) > 0) classes = atoi(argv[i + 1]);
+  if ((i = ArgPos((char *)"-mmap", argc, argv)) > 0) use_mmap = atoi(argv[i + 1]);
+  if ((i = ArgPos((char *)"-compile-corpus", argc, argv)) > 0) compile_corpus = atoi(argv[i + 1]);
+  if ((i = ArgPos((char *)"-stream", argc, argv)) > 0) stream_input = atoi(argv[i + 1]);
+  if ((i = ArgPos((char *)"-prefetch", argc, argv)) > 0) prefetch = atoi(argv[i + 1]);
+  if ((i = ArgPos((char *)"-vocab-sketch", argc, argv)) > 0) vocab_sketch = atoi(argv[i + 1]);
+  if ((i = ArgPos((char *)"-vocab-shard", argc, argv)) > 0) vocab_shard = atoi(argv[i + 1]);
+  if ((i = ArgPos((char *)"-bundle", argc, argv)) > 0) strcpy(bundle_file, argv[i + 1]);
 
   // evaluation
   if ((i = ArgPos((char *)"-eval", argc, argv)) > 0) eval_freq = atoi(argv[i + 1]);
@@ -1534,10 +4148,28 @@ int main(int argc, char **argv) {
   printf("# absolute path=%s\n", output_prefix);
 
   // vocab files
-  sprintf(src->vocab_file, "%s.vocab.min%d", src->train_file, min_count);
+  if ((i = ArgPos((char *)"-src-vocab", argc, argv)) > 0) strcpy(src->vocab_file, argv[i + 1]);
+  else sprintf(src->vocab_file, "%s.vocab.min%d", src->train_file, min_count);
+  if (snprintf(src->compiled_file, MAX_STRING, "%s.ids.min%d", src->train_file, min_count) >= MAX_STRING) {
+    printf("ERROR: training file path too long: %s\n", src->train_file);
+    exit(1);
+  }
+  if (snprintf(src->vocab_bin_file, MAX_STRING, "%s.bin", src->vocab_file) >= MAX_STRING) {
+    printf("ERROR: vocab file path too long: %s\n", src->vocab_file);
+    exit(1);
+  }
   if (src_train_words>0) printf("# src_train_words=%lld\n", src_train_words);
   if(is_bi){
-    sprintf(tgt->vocab_file, "%s.vocab.min%d", tgt->train_file, min_count);
+    if ((i = ArgPos((char *)"-tgt-vocab", argc, argv)) > 0) strcpy(tgt->vocab_file, argv[i + 1]);
+    else sprintf(tgt->vocab_file, "%s.vocab.min%d", tgt->train_file, min_count);
+    if (snprintf(tgt->compiled_file, MAX_STRING, "%s.ids.min%d", tgt->train_file, min_count) >= MAX_STRING) {
+      printf("ERROR: training file path too long: %s\n", tgt->train_file);
+      exit(1);
+    }
+    if (snprintf(tgt->vocab_bin_file, MAX_STRING, "%s.bin", tgt->vocab_file) >= MAX_STRING) {
+      printf("ERROR: vocab file path too long: %s\n", tgt->vocab_file);
+      exit(1);
+    }
     if (tgt_train_words>0) printf("# tgt_train_words=%lld\n", tgt_train_words);
   }
   
@@ -1545,17 +4177,37 @@ int main(int argc, char **argv) {
   if (strcmp(align_file, "")==1) { // align_file is specified
     assert(align_opt>0);
   }
+  if (bundle_file[0] != 0 && (!is_bi || stream_input || compile_corpus)) {
+    printf("ERROR: -bundle needs -tgt-train and can't be used with -stream or -compile-corpus\n");
+    exit(1);
+  }
+  if (stream_input) {
+    if (compile_corpus) {
+      printf("ERROR: -stream and -compile-corpus can't be used together\n");
+      exit(1);
+    }
+    if (num_train_iters - start_iter > 1 && (!strcmp(src->train_file, "-") || (is_bi && !strcmp(tgt->train_file, "-")) || (align_opt && !strcmp(align_file, "-")))) {
+      printf("ERROR: stdin can only be read for one iteration\n");
+      exit(1);
+    }
+  }
+
+  if (vocab_shard) {
+    if (vocab_sketch > 0) {
+      printf("ERROR: -vocab-sketch drops the rare words a vocab shard must keep\n");
+      exit(1);
+    }
+    CountVocabShard(src);
+    if (is_bi) CountVocabShard(tgt);
+    return 0;
+  }
 
   // config file
   sprintf(src->config_file, "%s.config", output_prefix);
 
-  // compute exp table
-  expTable = (real *)malloc((EXP_TABLE_SIZE + 1) * sizeof(real));
-  for (i = 0; i < EXP_TABLE_SIZE; i++) {
-    expTable[i] = exp((i / (real)EXP_TABLE_SIZE * 2 - 1) * MAX_EXP); // Precompute the exp() table
-    expTable[i] = expTable[i] / (expTable[i] + 1);                   // Precompute f(x) = x / (x + 1)
-  }
-  
+  SelectVecKernels(&vk, simd, layer1_stride);
+  printf("# vector kernels=%s%s\n", vk.name, (bf16 ? vk.sgns_bf16 != NULL : vk.sgns != NULL) ? ", fixed-size negative sampling" : "");
+
   TrainModel();
 
   return 0;
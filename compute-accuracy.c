@@ -18,11 +18,27 @@
 #include <math.h>
 #include <stdlib.h>
 #include <ctype.h>
+#include "wordhash.h"
+#include "perfecthash.h"
 
 const long long max_size = 2000;         // max length of strings
 const long long N = 1;                   // number of closest words
 const long long max_w = 50;              // max length of vocabulary entries
 
+struct perfect_hash vocab_hash;
+
+// Position of word in vocab (first one if repeated), words when it is not there; scans the vocab
+// if the perfect hash couldn't be built
+long long SearchVocab(const char *vocab, const char *word, long long words) {
+  long long b;
+  if (vocab_hash.num_slots == 0) {
+    for (b = 0; b < words; b++) if (!strcmp(&vocab[b * max_w], word)) break;
+    return b;
+  }
+  b = PerfectHashFind(&vocab_hash, WordHash(word, strlen(word)));
+  return b < 0 ? words : b;
+}
+
 int main(int argc, char **argv)
 {
   FILE *f;
@@ -62,6 +78,10 @@ int main(int argc, char **argv)
     for (a = 0; a < size; a++) M[a + b * size] /= len;
   }
   fclose(f);
+  unsigned long long *hashes = (unsigned long long *)malloc(words * sizeof(unsigned long long));
+  for (b = 0; b < words; b++) hashes[b] = WordHash(&vocab[b * max_w], strlen(&vocab[b * max_w]));
+  if (!PerfectHashBuild(&vocab_hash, hashes, words)) printf("! Can't build a perfect hash over %lld words, searching them without it\n", words);
+  free(hashes);
   TCN = 0;
   while (1) {
     for (a = 0; a < N; a++) bestd[a] = 0;
@@ -89,19 +109,16 @@ int main(int argc, char **argv)
     for (a = 0; a<strlen(st3); a++) st3[a] = toupper(st3[a]);
     scanf("%s", st4);
     for (a = 0; a < strlen(st4); a++) st4[a] = toupper(st4[a]);
-    for (b = 0; b < words; b++) if (!strcmp(&vocab[b * max_w], st1)) break;
-    b1 = b;
-    for (b = 0; b < words; b++) if (!strcmp(&vocab[b * max_w], st2)) break;
-    b2 = b;
-    for (b = 0; b < words; b++) if (!strcmp(&vocab[b * max_w], st3)) break;
-    b3 = b;
+    b1 = SearchVocab(vocab, st1, words);
+    b2 = SearchVocab(vocab, st2, words);
+    b3 = SearchVocab(vocab, st3, words);
     for (a = 0; a < N; a++) bestd[a] = 0;
     for (a = 0; a < N; a++) bestw[a][0] = 0;
     TQ++;
     if (b1 == words) continue;
     if (b2 == words) continue;
     if (b3 == words) continue;
-    for (b = 0; b < words; b++) if (!strcmp(&vocab[b * max_w], st4)) break;
+    b = SearchVocab(vocab, st4, words);
     if (b == words) continue;
     for (a = 0; a < size; a++) vec[a] = (M[a + b2 * size] - M[a + b1 * size]) + M[a + b3 * size];
     TQS++;
@@ -16,6 +16,8 @@
 #include <string.h>
 #include <math.h>
 #include <stdlib.h>
+#include "wordhash.h"
+#include "perfecthash.h"
 
 const long long max_size = 2000;         // max length of strings
 const long long N = 10;                  // number of closest words that will be shown
@@ -36,8 +38,9 @@ int ArgPos(char *str, int argc, char **argv) {
   
 #define MAX_STRING 1000
 
-const int vocab_hash_size = 30000000;  // Maximum 30 * 0.7 = 21M words in the vocabulary
-int *vocab_hash;
+struct perfect_hash vocab_hash; // over the words of the -word file, built once they are all read
+int *vocab_table; // open addressing over the -word file, only if vocab_hash can't be built
+long long vocab_table_size;
 
 struct vocab_word {
   long long cn;
@@ -48,30 +51,53 @@ struct vocab_word {
 struct vocab_word *vocab;
 long long vocab_max_size, vocab_size;
 
-// Returns hash value of a word
-int GetWordHash(const char *word) {
-  unsigned long long a, hash = 0;
-  for (a = 0; a < strlen(word); a++) hash = hash * 257 + word[a];
-  hash = hash % vocab_hash_size;
-  return hash;
-}
-
 // Returns position of a word in the vocabulary; if the word is not found, returns -1
 int SearchVocab(char *word) {
-  unsigned int hash = GetWordHash(word);
-  while (1) {
-    if (vocab_hash[hash] == -1) return -1;
-    if (!strcmp(word, vocab[vocab_hash[hash]].word)) {
-      return vocab_hash[hash];
-    }
-    hash = (hash + 1) % vocab_hash_size;
+  unsigned long long hash = WordHash(word, strlen(word)), b;
+  if (vocab_table == NULL) return PerfectHashFind(&vocab_hash, hash);
+  for (b = hash % vocab_table_size; vocab_table[b] != -1; b = (b + 1) % vocab_table_size) {
+    if (!strcmp(word, vocab[vocab_table[b]].word)) return vocab_table[b];
   }
   return -1;
 }
 
+// Builds the open addressing table SearchVocab falls back to, at most half full
+void BuildVocabTable() {
+  long long a, b;
+  vocab_table_size = 2 * vocab_size + 1;
+  vocab_table = (int *)malloc(vocab_table_size * sizeof(int));
+  for (b = 0; b < vocab_table_size; b++) vocab_table[b] = -1;
+  for (a = 0; a < vocab_size; a++) {
+    b = WordHash(vocab[a].word, strlen(vocab[a].word)) % vocab_table_size;
+    while (vocab_table[b] != -1) b = (b + 1) % vocab_table_size;
+    vocab_table[b] = a;
+  }
+}
+
+// Position of word in the embedding vocab, -1 if it is not there; scans the words if ph is empty
+long long SearchFullVocab(const struct perfect_hash *ph, char **full_vocab, long long words, const char *word) {
+  long long b;
+  if (ph->num_slots > 0) return PerfectHashFind(ph, WordHash(word, strlen(word)));
+  for (b = 0; b < words; b++) if (!strcmp(full_vocab[b], word)) return b;
+  return -1;
+}
+
+// Builds a perfect hash over n words, a repeated word maps to its first position; returns 0 (and
+// leaves ph empty) if it can't be built
+int BuildWordHash(struct perfect_hash *ph, char **words, long long n) {
+  unsigned long long *hashes = (unsigned long long *)malloc(n * sizeof(unsigned long long));
+  long long a;
+  int ok;
+  for (a = 0; a < n; a++) hashes[a] = WordHash(words[a], strlen(words[a]));
+  ok = PerfectHashBuild(ph, hashes, n);
+  if (!ok) printf("! Can't build a perfect hash over %lld words, searching them without it\n", n);
+  free(hashes);
+  return ok;
+}
+
 // Adds a word to the vocabulary
 int AddWordToVocab(const char *word) {
-  unsigned int hash, length = strlen(word) + 1;
+  unsigned int length = strlen(word) + 1;
   if (length > MAX_STRING) length = MAX_STRING;
   vocab[vocab_size].word = (char *)calloc(length, sizeof(char));
   strcpy(vocab[vocab_size].word, word);
@@ -82,10 +108,6 @@ int AddWordToVocab(const char *word) {
     vocab_max_size += 1000;
     vocab = (struct vocab_word *)realloc(vocab, vocab_max_size * sizeof(struct vocab_word));
   }
-
-  hash = GetWordHash(word);
-  while (vocab_hash[hash] != -1) hash = (hash + 1) % vocab_hash_size;
-  vocab_hash[hash] = vocab_size - 1;
   return vocab_size - 1;
 }
 int main(int argc, char **argv) {
@@ -97,6 +119,7 @@ int main(int argc, char **argv) {
   long long words, size, a, b, c, d, cn, bi[100];
   // char ch;
   float *M;
+  struct perfect_hash full_vocab_hash;
   if (argc == 1) {
     printf("Usage: ./distance\n"); // in the BINARY FORMAT\n");
     printf("\t-emb <file>\n");
@@ -117,8 +140,6 @@ int main(int argc, char **argv) {
     vocab_size = 0;
     vocab_max_size = 1000;
     vocab = (struct vocab_word *)calloc(vocab_max_size, sizeof(struct vocab_word));
-    vocab_hash = (int *)calloc(vocab_hash_size, sizeof(int));
-    for (a = 0; a < vocab_hash_size; a++) vocab_hash[a] = -1;
     
     f = fopen(word_file, "r");
     if (f == NULL) {
@@ -136,6 +157,10 @@ int main(int argc, char **argv) {
     }
     printf("  constraint neighbors to %d words\n", count);
     fclose(f); 
+    char **words = (char **)malloc(vocab_size * sizeof(char *));
+    for (a = 0; a < vocab_size; a++) words[a] = vocab[a].word;
+    if (!BuildWordHash(&vocab_hash, words, vocab_size)) BuildVocabTable();
+    free(words);
   }
 
   if ((i = ArgPos((char *)"-emb", argc, argv)) > 0) {
@@ -177,6 +202,7 @@ int main(int argc, char **argv) {
     for (a = 0; a < size; a++) M[a + b * size] /= len;
   }
   fclose(f);
+  BuildWordHash(&full_vocab_hash, full_vocab, words);
 
   /** Query nearest neighbors **/
   while (1) {
@@ -211,8 +237,7 @@ int main(int argc, char **argv) {
     cn++;
     for (a = 0; a < cn; a++) {
       // for (b = 0; b < words; b++) if (!strcmp(&full_vocab[b * max_w], st[a])) break;
-      for (b = 0; b < words; b++) if (!strcmp(full_vocab[b], st[a])) break;
-      if (b == words) b = -1;
+      b = SearchFullVocab(&full_vocab_hash, full_vocab, words, st[a]);
       bi[a] = b;
       printf("\nWord: %s  Position in vocabulary: %lld\n", st[a], bi[a]);
       if (b == -1) {
@@ -0,0 +1,161 @@
+//  Perfect hash over a frozen vocabulary, shared by bivec, distance and compute-accuracy.
+//
+//  CHD-style hash and displace: the keys (64-bit WordHash values) are split into buckets of about
+//  PERFECT_HASH_BUCKET_SIZE keys, and buckets are placed largest first, each with the first seed
+//  that sends all of its keys to free slots. The n distinct keys get n slots plus one spare slot
+//  per PERFECT_HASH_SPARE keys: with no free slots to spare, the last buckets need about n seed
+//  tries each and can run out of seeds on a vocab of millions of words. If some bucket still finds
+//  no seed, the whole build is retried with another salt. A slot keeps the full hash of its key as
+//  a fingerprint, so a lookup is one hash, one seed load and one slot load. A word that is not in
+//  the vocab is only mistaken for one if its 64-bit hash equals a vocab word's hash.
+
+#ifndef PERFECTHASH_H
+#define PERFECTHASH_H
+
+#include <stdlib.h>
+#include <string.h>
+#include "wordhash.h"
+
+#define PERFECT_HASH_BUCKET_SIZE 3
+#define PERFECT_HASH_SPARE 8
+#define PERFECT_HASH_MAX_SEED (1 << 24)
+#define PERFECT_HASH_MAX_SALTS 16
+
+struct perfect_hash_slot {
+  unsigned long long hash; // WordHash of the key
+  long long id; // -1 in a spare slot
+};
+
+struct perfect_hash {
+  long long num_slots, num_buckets, num_keys; // num_slots is 0 until built
+  unsigned long long salt;
+  unsigned int *seeds;
+  struct perfect_hash_slot *slots;
+};
+
+// x * range / 2^64, maps a well mixed 64-bit value onto [0, range) without a division
+static inline long long PerfectHashRange(unsigned long long x, long long range) {
+  return (long long)(((unsigned __int128)x * (unsigned long long)range) >> 64);
+}
+
+static inline long long PerfectHashBucket(const struct perfect_hash *ph, unsigned long long hash) {
+  return PerfectHashRange(hash, ph->num_buckets);
+}
+
+static inline long long PerfectHashSlot(const struct perfect_hash *ph, unsigned long long hash, unsigned int seed) {
+  return PerfectHashRange(WordHashMix((hash ^ ph->salt) + seed * 0x9e3779b97f4a7c15ULL), ph->num_slots);
+}
+
+// Returns the id stored with hash, or -1 when hash is not a key
+static inline long long PerfectHashFind(const struct perfect_hash *ph, unsigned long long hash) {
+  const struct perfect_hash_slot *slot;
+  if (ph->num_slots == 0) return -1;
+  slot = &ph->slots[PerfectHashSlot(ph, hash, ph->seeds[PerfectHashBucket(ph, hash)])];
+  return slot->hash == hash ? slot->id : -1;
+}
+
+static inline void PerfectHashFree(struct perfect_hash *ph) {
+  free(ph->seeds);
+  free(ph->slots);
+  memset(ph, 0, sizeof(struct perfect_hash));
+}
+
+// Places the buckets in order with the current salt; returns 0 if no seed places some bucket
+static inline int PerfectHashPlace(struct perfect_hash *ph, const unsigned long long *hashes, const long long *keys,
+    const long long *bucket_start, const long long *bucket_size, const long long *order, long long max_size) {
+  long long a, b, i, j, size, *slot;
+  unsigned char *taken; // one bit per slot
+  unsigned int seed = 0;
+
+  taken = (unsigned char *)calloc(ph->num_slots / 8 + 1, 1);
+  slot = (long long *)malloc((max_size + 1) * sizeof(long long));
+  memset(ph->seeds, 0, ph->num_buckets * sizeof(unsigned int));
+  for (a = 0; a < ph->num_slots; a++) {
+    ph->slots[a].hash = 0;
+    ph->slots[a].id = -1;
+  }
+  for (a = 0; a < ph->num_buckets; a++) {
+    b = order[a];
+    size = bucket_size[b];
+    if (size == 0) break; // the rest are empty too
+    for (seed = 0; seed < PERFECT_HASH_MAX_SEED; seed++) {
+      for (i = 0; i < size; i++) {
+        slot[i] = PerfectHashSlot(ph, hashes[keys[bucket_start[b] + i]], seed);
+        if (taken[slot[i] >> 3] & (1 << (slot[i] & 7))) break;
+        for (j = 0; j < i; j++) if (slot[j] == slot[i]) break;
+        if (j < i) break;
+      }
+      if (i == size) break;
+    }
+    if (seed == PERFECT_HASH_MAX_SEED) break;
+    ph->seeds[b] = seed;
+    for (i = 0; i < size; i++) {
+      taken[slot[i] >> 3] |= 1 << (slot[i] & 7);
+      ph->slots[slot[i]].hash = hashes[keys[bucket_start[b] + i]];
+      ph->slots[slot[i]].id = keys[bucket_start[b] + i];
+    }
+  }
+  free(slot);
+  free(taken);
+  return seed < PERFECT_HASH_MAX_SEED;
+}
+
+// Builds the hash over the n keys hashes[i] with id i; of equal hashes the lowest id is kept, and
+// num_keys counts the distinct ones. Returns 0 (and leaves ph empty) if no salt places all buckets,
+// which doesn't happen in practice.
+static inline int PerfectHashBuild(struct perfect_hash *ph, const unsigned long long *hashes, long long n) {
+  long long a, b, i, j, size, max_size = 0, num_keys = 0, *bucket_start, *bucket_size, *keys, *order, *size_start;
+  int attempt, placed = 0;
+
+  memset(ph, 0, sizeof(struct perfect_hash));
+  if (n == 0) return 1;
+  ph->num_buckets = n / PERFECT_HASH_BUCKET_SIZE + 1;
+  bucket_start = (long long *)calloc(ph->num_buckets + 1, sizeof(long long));
+  bucket_size = (long long *)calloc(ph->num_buckets, sizeof(long long));
+  keys = (long long *)malloc(n * sizeof(long long));
+  // keys grouped by bucket, in id order within a bucket
+  for (i = 0; i < n; i++) bucket_start[PerfectHashBucket(ph, hashes[i]) + 1]++;
+  for (b = 0; b < ph->num_buckets; b++) bucket_start[b + 1] += bucket_start[b];
+  for (i = 0; i < n; i++) {
+    b = PerfectHashBucket(ph, hashes[i]);
+    keys[bucket_start[b] + bucket_size[b]++] = i;
+  }
+  // drop repeated hashes: a bucket keeps its first bucket_size keys
+  for (b = 0; b < ph->num_buckets; b++) {
+    size = 0;
+    for (i = bucket_start[b]; i < bucket_start[b] + bucket_size[b]; i++) {
+      for (j = 0; j < size; j++) if (hashes[keys[bucket_start[b] + j]] == hashes[keys[i]]) break;
+      if (j == size) keys[bucket_start[b] + size++] = keys[i];
+    }
+    bucket_size[b] = size;
+    num_keys += size;
+    if (size > max_size) max_size = size;
+  }
+  // buckets ordered by size, largest first (counting sort)
+  size_start = (long long *)calloc(max_size + 2, sizeof(long long));
+  order = (long long *)malloc(ph->num_buckets * sizeof(long long));
+  for (b = 0; b < ph->num_buckets; b++) size_start[max_size - bucket_size[b] + 1]++;
+  for (a = 0; a <= max_size; a++) size_start[a + 1] += size_start[a];
+  for (b = 0; b < ph->num_buckets; b++) order[size_start[max_size - bucket_size[b]]++] = b;
+
+  ph->num_keys = num_keys;
+  ph->num_slots = num_keys + num_keys / PERFECT_HASH_SPARE + 1;
+  ph->seeds = (unsigned int *)malloc(ph->num_buckets * sizeof(unsigned int));
+  ph->slots = (struct perfect_hash_slot *)malloc(ph->num_slots * sizeof(struct perfect_hash_slot));
+  for (attempt = 0; attempt < PERFECT_HASH_MAX_SALTS && !placed; attempt++) {
+    ph->salt = attempt * 0xd6e8feb86659fd93ULL;
+    placed = PerfectHashPlace(ph, hashes, keys, bucket_start, bucket_size, order, max_size);
+  }
+  free(order);
+  free(size_start);
+  free(keys);
+  free(bucket_size);
+  free(bucket_start);
+  if (!placed) {
+    PerfectHashFree(ph);
+    return 0;
+  }
+  return 1;
+}
+
+#endif
@@ -0,0 +1,678 @@
+//  Row kernels of the training loops: dot products and axpy updates over float rows of length n.
+//
+//  bivec picks one set at startup from CPUID (SelectVecKernels): AVX-512, AVX2 with FMA, or plain C.
+//  The SIMD versions are compiled for their instruction set with target attributes, so the binary
+//  is built for the baseline x86-64 and still runs the widest kernels the host has. Rows need no
+//  particular alignment; the AVX2 kernels finish a row in scalar code, the AVX-512 ones with masks.
+//
+//  Rows padded to one of VEC_FIXED_SIZES floats (zeros past the used dimension) also get a negative
+//  sampling kernel compiled for that size, which keeps the hidden vector and its error in registers
+//  across the positive and all negatives of a word.
+//
+//  The logistic function is computed, not looked up: sigmoid(x) = 1 / (1 + e^-x) with e^-x reduced to
+//  2^k * e^r, |r| <= ln 2 / 2, and e^r from its degree-6 Taylor polynomial. Over [-6, 6] it is
+//  within 1e-7 of the exact value, where the 1000-entry table it replaces was off by up to 9e-3, and
+//  a whole array of logits goes through one SIMD pass with no gathers or branches.
+//
+//  Rows stored as bfloat16 (the upper 16 bits of a float) are widened by a shift and narrowed with
+//  stochastic rounding: a uniform 16-bit number is added to the bits that are cut off, so a value
+//  rounds up with probability equal to its distance from the lower neighbor and the rounding is
+//  unbiased. Updates far below the bf16 resolution then still move a weight on average. The training
+//  loops work on stored bf16 rows directly: dot_bf16 widens a row as it reads it, and axpy_bf16,
+//  axpy2_bf16 and the bf16 sgns kernels widen it, update it and round it back in one pass, so a row is
+//  read once and written once per update. Like the fixed-size kernels they are written once with GCC
+//  vector types and compiled for each instruction set, the bf16 loads and stores of a vector coming
+//  from a small helper per target (LoadBf16Vec, StoreBf16Vec).
+
+#ifndef VECKERNELS_H
+#define VECKERNELS_H
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#endif
+
+struct vec_kernels {
+  const char *name;
+  float (*dot)(const float *x, const float *y, long long n);          // returns x . y
+  void (*axpy)(float a, const float *x, float *y, long long n);       // y += a * x
+  // The update of an output row w with input h and gradient a: e += a * w, then w += a * h, reading
+  // w once. This is the step every hs node and every negative does after its dot product.
+  void (*axpy2)(float a, const float *h, float *w, float *e, long long n);
+  // Four rows at a time, the blocks of small matrix products: out[j] = x . y[j] for j < 4, and
+  // y += a[0] * x[0] + ... + a[3] * x[3]; x (y) is loaded (stored) once for all four
+  void (*dot4)(const float *x, float *const *y, long long n, float *out);
+  void (*axpy4)(const float *a, float *const *x, float *y, long long n);
+  // y[i] = sigmoid(x[i]) for i < n; y may be x
+  void (*sigmoid)(float *x, float *y, long long n);
+  // Negative sampling of hidden vector h against the output rows out + targets[t] * row_size, t = 0
+  // the positive and the rest negatives, adding the error to e; rows of exactly the fixed size, NULL
+  // when the row size has no such kernel. The sigmoid saturates at 0 and 1 beyond +-max_exp, as in
+  // the training loops.
+  void (*sgns)(const float *h, float *e, float *out, const long long *targets, int num_targets, float alpha, float max_exp);
+  // y = x for bfloat16 x, and x rounded stochastically to bfloat16 y, the rounding bits drawn from *seed
+  void (*load_bf16)(const unsigned short *x, float *y, long long n);
+  void (*store_bf16)(const float *x, unsigned short *y, long long n, unsigned long long *seed);
+  // dot, axpy, axpy2 and sgns for rows y, w and out stored as bfloat16, each updated row rounded back
+  // stochastically as it is written; sgns_bf16 is NULL when the row size has no fixed-size kernel
+  float (*dot_bf16)(const float *x, const unsigned short *y, long long n);
+  void (*axpy_bf16)(float a, const float *x, unsigned short *y, long long n, unsigned long long *seed);
+  void (*axpy2_bf16)(float a, const float *h, unsigned short *w, float *e, long long n, unsigned long long *seed);
+  void (*sgns_bf16)(const float *h, float *e, unsigned short *out, const long long *targets, int num_targets, float alpha,
+      float max_exp, unsigned long long *seed);
+};
+
+#define VEC_SIGMOID_CLAMP 80.0f     // e^80 is still a normal float
+#define VEC_LOG2E 1.44269504f
+#define VEC_LN2_HI 0.693359375f     // ln 2 = VEC_LN2_HI - VEC_LN2_LO, VEC_LN2_HI exact in a few bits
+#define VEC_LN2_LO 2.12194440e-4f
+
+static inline float VecSigmoid(float x) {
+  union {
+    float f;
+    int i;
+  } scale;
+  float k, r, p;
+  x = x < -VEC_SIGMOID_CLAMP ? -VEC_SIGMOID_CLAMP : x > VEC_SIGMOID_CLAMP ? VEC_SIGMOID_CLAMP : x;
+  k = __builtin_floorf(-x * VEC_LOG2E + 0.5f);
+  r = -x - k * VEC_LN2_HI + k * VEC_LN2_LO;
+  p = 1 + r * (1 + r * (1 / 2.0f + r * (1 / 6.0f + r * (1 / 24.0f + r * (1 / 120.0f + r * (1 / 720.0f))))));
+  scale.i = ((int)k + 127) << 23;
+  return 1 / (1 + p * scale.f);
+}
+
+// The error signal label - sigmoid(f) of a logit f whose sigmoid is s, saturated beyond +-max_exp
+static inline float VecLogitError(float f, float s, int label, float max_exp) {
+  if (f > max_exp) return label - 1;
+  if (f < -max_exp) return label;
+  return label - s;
+}
+
+static inline float VecBf16ToFloat(unsigned short x) {
+  union {
+    float f;
+    unsigned int u;
+  } v;
+  v.u = (unsigned int)x << 16;
+  return v.f;
+}
+
+// x rounded to bfloat16, up when r (uniform in [0, 2^16)) plus the cut-off bits carries
+static inline unsigned short VecFloatToBf16(float x, unsigned int r) {
+  union {
+    float f;
+    unsigned int u;
+  } v;
+  v.f = x;
+  return (unsigned short)((v.u + (r & 0xFFFF)) >> 16);
+}
+
+// Multipliers that seed the per-lane rounding generators of the bf16 stores from one step of *seed
+static const unsigned int vec_bf16_lane_seeds[16] = {
+  0x9e3779b1, 0x85ebca77, 0xc2b2ae3d, 0x27d4eb2f, 0x165667b1, 0xd3a2646d, 0xfd7046c5, 0xb55a4f09,
+  0x2545f491, 0x9e6c63d1, 0xa0761d65, 0xe7037ed1, 0x8ebc6af1, 0x589965cd, 0x1d8e4e27, 0xeb44acab
+};
+
+// Row sizes with a fixed-size kernel (the padded rows of -size 40, 100, 128, 200, 256, 300 and 512)
+#define VEC_FIXED_SIZES(X, SUFFIX, TARGET, W) X(48, SUFFIX, TARGET, W) X(112, SUFFIX, TARGET, W) X(128, SUFFIX, TARGET, W) \
+  X(208, SUFFIX, TARGET, W) X(256, SUFFIX, TARGET, W) X(304, SUFFIX, TARGET, W) X(512, SUFFIX, TARGET, W)
+// The same sizes padded as bf16 rows
+#define VEC_BF16_FIXED_SIZES(X, SUFFIX, TARGET, W) X(64, SUFFIX, TARGET, W) X(128, SUFFIX, TARGET, W) X(224, SUFFIX, TARGET, W) \
+  X(256, SUFFIX, TARGET, W) X(320, SUFFIX, TARGET, W) X(512, SUFFIX, TARGET, W)
+
+// W floats in a register of the target (SSE, AVX2, AVX-512); the u types are the same in memory, at
+// any float alignment
+typedef float vec4 __attribute__((vector_size(16)));
+typedef float vec4u __attribute__((vector_size(16), aligned(4)));
+typedef float vec8 __attribute__((vector_size(32)));
+typedef float vec8u __attribute__((vector_size(32), aligned(4)));
+typedef float vec16 __attribute__((vector_size(64)));
+typedef float vec16u __attribute__((vector_size(64), aligned(4)));
+// W lanes of 32-bit rounding state (i) and of bfloat16 values (h)
+typedef unsigned int vec4i __attribute__((vector_size(16)));
+typedef unsigned int vec4iu __attribute__((vector_size(16), aligned(4)));
+typedef unsigned int vec8i __attribute__((vector_size(32)));
+typedef unsigned int vec8iu __attribute__((vector_size(32), aligned(4)));
+typedef unsigned int vec16i __attribute__((vector_size(64)));
+typedef unsigned int vec16iu __attribute__((vector_size(64), aligned(4)));
+typedef unsigned short vec4h __attribute__((vector_size(8)));
+typedef unsigned short vec4hu __attribute__((vector_size(8), aligned(2)));
+typedef unsigned short vec8h __attribute__((vector_size(16)));
+typedef unsigned short vec8hu __attribute__((vector_size(16), aligned(2)));
+typedef unsigned short vec16h __attribute__((vector_size(32)));
+typedef unsigned short vec16hu __attribute__((vector_size(32), aligned(2)));
+
+// The rounding bits of the bf16 store at offset k into a row, from the lane generators r stepped
+// once per row: the stores along a row don't wait on each other, and each lane's bits are uniform,
+// which is all the rounding needs to be unbiased
+#define VEC_ROUND_BITS(r, k) ((r + (unsigned int)(k) * 0x9e3779b9u) >> 16)
+// Seeds the lane generators r from one step of *seed, as the bf16 stores do, and steps them
+#define VEC_SEED_BF16(W, r, seed) do { \
+    *(seed) = *(seed) * 25214903917ULL + 11; \
+    r = *(const vec##W##iu *)vec_bf16_lane_seeds * ((unsigned int)(*(seed) >> 16) | 1); \
+  } while (0)
+#define VEC_NEXT_BF16(r) do { \
+    r ^= r << 13; \
+    r ^= r >> 17; \
+    r ^= r << 5; \
+  } while (0)
+
+// Defines Sgns<P><SUFFIX>, the sgns kernel for rows of P floats compiled with TARGET, in vectors of W
+// floats; with the loops over the row unrolled, h and e are arrays of registers. All logits are
+// scored first and go through Sigmoid<SUFFIX> together, then the rows are updated.
+#define VEC_SGNS_KERNEL(P, SUFFIX, TARGET, W) \
+TARGET static void Sgns##P##SUFFIX(const float *h_row, float *e_row, float *out, const long long *targets, int num_targets, \
+    float alpha, float max_exp) { \
+  vec##W h[P / W], e[P / W], s, w; \
+  float f[num_targets], sig[num_targets], g, *row; \
+  int t, j; \
+  _Pragma("GCC unroll 128") for (j = 0; j < P / W; j++) { \
+    h[j] = *(const vec##W##u *)(h_row + j * W); \
+    e[j] = *(const vec##W##u *)(e_row + j * W); \
+  } \
+  for (t = 0; t < num_targets; t++) { \
+    row = out + targets[t] * P; \
+    s = h[0] * *(const vec##W##u *)row; \
+    _Pragma("GCC unroll 128") for (j = 1; j < P / W; j++) s += h[j] * *(const vec##W##u *)(row + j * W); \
+    f[t] = 0; \
+    _Pragma("GCC unroll 16") for (j = 0; j < W; j++) f[t] += s[j]; \
+  } \
+  Sigmoid##SUFFIX(f, sig, num_targets); \
+  for (t = 0; t < num_targets; t++) { \
+    row = out + targets[t] * P; \
+    g = VecLogitError(f[t], sig[t], t == 0, max_exp) * alpha; \
+    _Pragma("GCC unroll 128") for (j = 0; j < P / W; j++) { \
+      w = *(const vec##W##u *)(row + j * W); \
+      e[j] += g * w; \
+      *(vec##W##u *)(row + j * W) = w + g * h[j]; \
+    } \
+  } \
+  _Pragma("GCC unroll 128") for (j = 0; j < P / W; j++) *(vec##W##u *)(e_row + j * W) = e[j]; \
+}
+
+#define VEC_SGNS_CASE(P, SUFFIX, TARGET, W) case P: k->sgns = Sgns##P##SUFFIX; break;
+
+// Defines SgnsBf16<P><SUFFIX>, Sgns<P><SUFFIX> for rows stored as bfloat16: the scoring pass widens
+// each row as it reads it, and the update pass widens it again (from cache), updates it and stores it
+// rounded, once per target.
+#define VEC_SGNS_BF16_KERNEL(P, SUFFIX, TARGET, W) \
+TARGET static void SgnsBf16##P##SUFFIX(const float *h_row, float *e_row, unsigned short *out, const long long *targets, \
+    int num_targets, float alpha, float max_exp, unsigned long long *seed) { \
+  vec##W h[P / W], e[P / W], s, w; \
+  vec##W##i r; \
+  float f[num_targets], sig[num_targets], g; \
+  unsigned short *row; \
+  int t, j; \
+  VEC_SEED_BF16(W, r, seed); \
+  /* a row takes several times the instructions per byte of a float row, so fewer rows would be */ \
+  /* fetched ahead on their own: ask for all of them first, each P / 32 cache lines */ \
+  for (t = 0; t < num_targets; t++) \
+    _Pragma("GCC unroll 16") for (j = 0; j < P; j += 32) __builtin_prefetch(out + targets[t] * P + j, 1); \
+  _Pragma("GCC unroll 128") for (j = 0; j < P / W; j++) { \
+    h[j] = *(const vec##W##u *)(h_row + j * W); \
+    e[j] = *(const vec##W##u *)(e_row + j * W); \
+  } \
+  for (t = 0; t < num_targets; t++) { \
+    row = out + targets[t] * P; \
+    s = h[0] * LoadBf16Vec##SUFFIX(row); \
+    _Pragma("GCC unroll 128") for (j = 1; j < P / W; j++) s += h[j] * LoadBf16Vec##SUFFIX(row + j * W); \
+    f[t] = 0; \
+    _Pragma("GCC unroll 16") for (j = 0; j < W; j++) f[t] += s[j]; \
+  } \
+  Sigmoid##SUFFIX(f, sig, num_targets); \
+  for (t = 0; t < num_targets; t++) { \
+    row = out + targets[t] * P; \
+    g = VecLogitError(f[t], sig[t], t == 0, max_exp) * alpha; \
+    VEC_NEXT_BF16(r); \
+    _Pragma("GCC unroll 128") for (j = 0; j < P / W; j++) { \
+      w = LoadBf16Vec##SUFFIX(row + j * W); \
+      e[j] += g * w; \
+      StoreBf16Vec##SUFFIX(row + j * W, w + g * h[j], VEC_ROUND_BITS(r, j)); \
+    } \
+  } \
+  _Pragma("GCC unroll 128") for (j = 0; j < P / W; j++) *(vec##W##u *)(e_row + j * W) = e[j]; \
+}
+
+#define VEC_SGNS_BF16_CASE(P, SUFFIX, TARGET, W) case P: k->sgns_bf16 = SgnsBf16##P##SUFFIX; break;
+
+// Defines DotBf16<SUFFIX>, AxpyBf16<SUFFIX> and Axpy2Bf16<SUFFIX> in vectors of W floats, the last
+// n % W values in scalar code
+#define VEC_BF16_KERNELS(SUFFIX, TARGET, W) \
+TARGET static float DotBf16##SUFFIX(const float *x, const unsigned short *y, long long n) { \
+  vec##W s = {0}; \
+  long long i = 0; \
+  float f = 0; \
+  int j; \
+  for (; i + W <= n; i += W) s += *(const vec##W##u *)(x + i) * LoadBf16Vec##SUFFIX(y + i); \
+  _Pragma("GCC unroll 16") for (j = 0; j < W; j++) f += s[j]; \
+  for (; i < n; i++) f += x[i] * VecBf16ToFloat(y[i]); \
+  return f; \
+} \
+\
+TARGET static void AxpyBf16##SUFFIX(float a, const float *x, unsigned short *y, long long n, unsigned long long *seed) { \
+  vec##W##i r; \
+  long long i = 0; \
+  VEC_SEED_BF16(W, r, seed); \
+  for (; i + W <= n; i += W) StoreBf16Vec##SUFFIX(y + i, LoadBf16Vec##SUFFIX(y + i) + a * *(const vec##W##u *)(x + i), VEC_ROUND_BITS(r, i)); \
+  for (; i < n; i++) { \
+    *seed = *seed * 25214903917ULL + 11; \
+    y[i] = VecFloatToBf16(VecBf16ToFloat(y[i]) + a * x[i], (unsigned int)(*seed >> 16)); \
+  } \
+} \
+\
+TARGET static void Axpy2Bf16##SUFFIX(float a, const float *h, unsigned short *w, float *e, long long n, unsigned long long *seed) { \
+  vec##W v; \
+  vec##W##i r; \
+  long long i = 0; \
+  float u; \
+  VEC_SEED_BF16(W, r, seed); \
+  for (; i + W <= n; i += W) { \
+    v = LoadBf16Vec##SUFFIX(w + i); \
+    *(vec##W##u *)(e + i) += a * v; \
+    StoreBf16Vec##SUFFIX(w + i, v + a * *(const vec##W##u *)(h + i), VEC_ROUND_BITS(r, i)); \
+  } \
+  for (; i < n; i++) { \
+    u = VecBf16ToFloat(w[i]); \
+    e[i] += a * u; \
+    *seed = *seed * 25214903917ULL + 11; \
+    w[i] = VecFloatToBf16(u + a * h[i], (unsigned int)(*seed >> 16)); \
+  } \
+}
+
+static void SigmoidScalar(float *x, float *y, long long n) {
+  long long i;
+  for (i = 0; i < n; i++) y[i] = VecSigmoid(x[i]);
+}
+
+VEC_FIXED_SIZES(VEC_SGNS_KERNEL, Scalar, , 4)
+
+// The 4 bfloat16 values at p widened to floats, and 4 floats stored at p with rounding bits r
+static inline vec4 LoadBf16VecScalar(const unsigned short *p) {
+  return (vec4)(__builtin_convertvector(*(const vec4hu *)p, vec4i) << 16);
+}
+
+static inline void StoreBf16VecScalar(unsigned short *p, vec4 x, vec4i r) {
+  *(vec4hu *)p = __builtin_convertvector(((vec4i)x + r) >> 16, vec4h);
+}
+
+VEC_BF16_KERNELS(Scalar, , 4)
+VEC_BF16_FIXED_SIZES(VEC_SGNS_BF16_KERNEL, Scalar, , 4)
+
+static void LoadBf16Scalar(const unsigned short *x, float *y, long long n) {
+  long long i;
+  for (i = 0; i < n; i++) y[i] = VecBf16ToFloat(x[i]);
+}
+
+static void StoreBf16Scalar(const float *x, unsigned short *y, long long n, unsigned long long *seed) {
+  long long i;
+  for (i = 0; i < n; i++) {
+    *seed = *seed * 25214903917ULL + 11;
+    y[i] = VecFloatToBf16(x[i], (unsigned int)(*seed >> 16));
+  }
+}
+
+static float DotScalar(const float *x, const float *y, long long n) {
+  long long i;
+  float f = 0;
+  for (i = 0; i < n; i++) f += x[i] * y[i];
+  return f;
+}
+
+static void AxpyScalar(float a, const float *x, float *y, long long n) {
+  long long i;
+  for (i = 0; i < n; i++) y[i] += a * x[i];
+}
+
+static void Axpy2Scalar(float a, const float *h, float *w, float *e, long long n) {
+  long long i;
+  for (i = 0; i < n; i++) {
+    e[i] += a * w[i];
+    w[i] += a * h[i];
+  }
+}
+
+static void Dot4Scalar(const float *x, float *const *y, long long n, float *out) {
+  long long i;
+  float f0 = 0, f1 = 0, f2 = 0, f3 = 0;
+  for (i = 0; i < n; i++) {
+    f0 += x[i] * y[0][i];
+    f1 += x[i] * y[1][i];
+    f2 += x[i] * y[2][i];
+    f3 += x[i] * y[3][i];
+  }
+  out[0] = f0;
+  out[1] = f1;
+  out[2] = f2;
+  out[3] = f3;
+}
+
+static void Axpy4Scalar(const float *a, float *const *x, float *y, long long n) {
+  long long i;
+  for (i = 0; i < n; i++) y[i] += a[0] * x[0][i] + a[1] * x[1][i] + a[2] * x[2][i] + a[3] * x[3][i];
+}
+
+#if defined(__x86_64__) || defined(__i386__)
+__attribute__((target("avx2,fma"))) static float HorizontalSumAvx2(__m256 s) {
+  __m128 h = _mm_add_ps(_mm256_castps256_ps128(s), _mm256_extractf128_ps(s, 1));
+  h = _mm_add_ps(h, _mm_movehl_ps(h, h));
+  h = _mm_add_ss(h, _mm_shuffle_ps(h, h, 1));
+  return _mm_cvtss_f32(h);
+}
+
+__attribute__((target("avx2,fma"))) static float DotAvx2(const float *x, const float *y, long long n) {
+  __m256 s0 = _mm256_setzero_ps(), s1 = _mm256_setzero_ps();
+  long long i = 0;
+  float f;
+  for (; i + 16 <= n; i += 16) {
+    s0 = _mm256_fmadd_ps(_mm256_loadu_ps(x + i), _mm256_loadu_ps(y + i), s0);
+    s1 = _mm256_fmadd_ps(_mm256_loadu_ps(x + i + 8), _mm256_loadu_ps(y + i + 8), s1);
+  }
+  if (i + 8 <= n) {
+    s0 = _mm256_fmadd_ps(_mm256_loadu_ps(x + i), _mm256_loadu_ps(y + i), s0);
+    i += 8;
+  }
+  f = HorizontalSumAvx2(_mm256_add_ps(s0, s1));
+  for (; i < n; i++) f += x[i] * y[i];
+  return f;
+}
+
+__attribute__((target("avx2,fma"))) static void AxpyAvx2(float a, const float *x, float *y, long long n) {
+  __m256 va = _mm256_set1_ps(a);
+  long long i = 0;
+  for (; i + 8 <= n; i += 8) _mm256_storeu_ps(y + i, _mm256_fmadd_ps(va, _mm256_loadu_ps(x + i), _mm256_loadu_ps(y + i)));
+  for (; i < n; i++) y[i] += a * x[i];
+}
+
+__attribute__((target("avx2,fma"))) static void Axpy2Avx2(float a, const float *h, float *w, float *e, long long n) {
+  __m256 va = _mm256_set1_ps(a), vw;
+  long long i = 0;
+  for (; i + 8 <= n; i += 8) {
+    vw = _mm256_loadu_ps(w + i);
+    _mm256_storeu_ps(e + i, _mm256_fmadd_ps(va, vw, _mm256_loadu_ps(e + i)));
+    _mm256_storeu_ps(w + i, _mm256_fmadd_ps(va, _mm256_loadu_ps(h + i), vw));
+  }
+  for (; i < n; i++) {
+    e[i] += a * w[i];
+    w[i] += a * h[i];
+  }
+}
+
+__attribute__((target("avx2,fma"))) static void Dot4Avx2(const float *x, float *const *y, long long n, float *out) {
+  __m256 s0 = _mm256_setzero_ps(), s1 = _mm256_setzero_ps(), s2 = _mm256_setzero_ps(), s3 = _mm256_setzero_ps(), vx;
+  long long i = 0, j;
+  for (; i + 8 <= n; i += 8) {
+    vx = _mm256_loadu_ps(x + i);
+    s0 = _mm256_fmadd_ps(vx, _mm256_loadu_ps(y[0] + i), s0);
+    s1 = _mm256_fmadd_ps(vx, _mm256_loadu_ps(y[1] + i), s1);
+    s2 = _mm256_fmadd_ps(vx, _mm256_loadu_ps(y[2] + i), s2);
+    s3 = _mm256_fmadd_ps(vx, _mm256_loadu_ps(y[3] + i), s3);
+  }
+  out[0] = HorizontalSumAvx2(s0);
+  out[1] = HorizontalSumAvx2(s1);
+  out[2] = HorizontalSumAvx2(s2);
+  out[3] = HorizontalSumAvx2(s3);
+  for (; i < n; i++) for (j = 0; j < 4; j++) out[j] += x[i] * y[j][i];
+}
+
+__attribute__((target("avx2,fma"))) static void Axpy4Avx2(const float *a, float *const *x, float *y, long long n) {
+  __m256 a0 = _mm256_set1_ps(a[0]), a1 = _mm256_set1_ps(a[1]), a2 = _mm256_set1_ps(a[2]), a3 = _mm256_set1_ps(a[3]), vy;
+  long long i = 0;
+  for (; i + 8 <= n; i += 8) {
+    vy = _mm256_fmadd_ps(a0, _mm256_loadu_ps(x[0] + i), _mm256_loadu_ps(y + i));
+    vy = _mm256_fmadd_ps(a1, _mm256_loadu_ps(x[1] + i), vy);
+    vy = _mm256_fmadd_ps(a2, _mm256_loadu_ps(x[2] + i), vy);
+    _mm256_storeu_ps(y + i, _mm256_fmadd_ps(a3, _mm256_loadu_ps(x[3] + i), vy));
+  }
+  for (; i < n; i++) y[i] += a[0] * x[0][i] + a[1] * x[1][i] + a[2] * x[2][i] + a[3] * x[3][i];
+}
+
+__attribute__((target("avx512f"))) static float DotAvx512(const float *x, const float *y, long long n) {
+  __m512 s0 = _mm512_setzero_ps(), s1 = _mm512_setzero_ps();
+  __mmask16 m;
+  long long i = 0;
+  for (; i + 32 <= n; i += 32) {
+    s0 = _mm512_fmadd_ps(_mm512_loadu_ps(x + i), _mm512_loadu_ps(y + i), s0);
+    s1 = _mm512_fmadd_ps(_mm512_loadu_ps(x + i + 16), _mm512_loadu_ps(y + i + 16), s1);
+  }
+  for (; i < n; i += 16) {
+    m = n - i >= 16 ? 0xffff : (__mmask16)((1u << (n - i)) - 1);
+    s0 = _mm512_fmadd_ps(_mm512_maskz_loadu_ps(m, x + i), _mm512_maskz_loadu_ps(m, y + i), s0);
+  }
+  return _mm512_reduce_add_ps(_mm512_add_ps(s0, s1));
+}
+
+__attribute__((target("avx512f"))) static void AxpyAvx512(float a, const float *x, float *y, long long n) {
+  __m512 va = _mm512_set1_ps(a);
+  __mmask16 m;
+  long long i;
+  for (i = 0; i < n; i += 16) {
+    m = n - i >= 16 ? 0xffff : (__mmask16)((1u << (n - i)) - 1);
+    _mm512_mask_storeu_ps(y + i, m, _mm512_fmadd_ps(va, _mm512_maskz_loadu_ps(m, x + i), _mm512_maskz_loadu_ps(m, y + i)));
+  }
+}
+
+__attribute__((target("avx512f"))) static void Axpy2Avx512(float a, const float *h, float *w, float *e, long long n) {
+  __m512 va = _mm512_set1_ps(a), vw;
+  __mmask16 m;
+  long long i;
+  for (i = 0; i < n; i += 16) {
+    m = n - i >= 16 ? 0xffff : (__mmask16)((1u << (n - i)) - 1);
+    vw = _mm512_maskz_loadu_ps(m, w + i);
+    _mm512_mask_storeu_ps(e + i, m, _mm512_fmadd_ps(va, vw, _mm512_maskz_loadu_ps(m, e + i)));
+    _mm512_mask_storeu_ps(w + i, m, _mm512_fmadd_ps(va, _mm512_maskz_loadu_ps(m, h + i), vw));
+  }
+}
+
+__attribute__((target("avx512f"))) static void Dot4Avx512(const float *x, float *const *y, long long n, float *out) {
+  __m512 s0 = _mm512_setzero_ps(), s1 = _mm512_setzero_ps(), s2 = _mm512_setzero_ps(), s3 = _mm512_setzero_ps(), vx;
+  __mmask16 m;
+  long long i;
+  for (i = 0; i < n; i += 16) {
+    m = n - i >= 16 ? 0xffff : (__mmask16)((1u << (n - i)) - 1);
+    vx = _mm512_maskz_loadu_ps(m, x + i);
+    s0 = _mm512_fmadd_ps(vx, _mm512_maskz_loadu_ps(m, y[0] + i), s0);
+    s1 = _mm512_fmadd_ps(vx, _mm512_maskz_loadu_ps(m, y[1] + i), s1);
+    s2 = _mm512_fmadd_ps(vx, _mm512_maskz_loadu_ps(m, y[2] + i), s2);
+    s3 = _mm512_fmadd_ps(vx, _mm512_maskz_loadu_ps(m, y[3] + i), s3);
+  }
+  out[0] = _mm512_reduce_add_ps(s0);
+  out[1] = _mm512_reduce_add_ps(s1);
+  out[2] = _mm512_reduce_add_ps(s2);
+  out[3] = _mm512_reduce_add_ps(s3);
+}
+
+__attribute__((target("avx512f"))) static void Axpy4Avx512(const float *a, float *const *x, float *y, long long n) {
+  __m512 a0 = _mm512_set1_ps(a[0]), a1 = _mm512_set1_ps(a[1]), a2 = _mm512_set1_ps(a[2]), a3 = _mm512_set1_ps(a[3]), vy;
+  __mmask16 m;
+  long long i;
+  for (i = 0; i < n; i += 16) {
+    m = n - i >= 16 ? 0xffff : (__mmask16)((1u << (n - i)) - 1);
+    vy = _mm512_fmadd_ps(a0, _mm512_maskz_loadu_ps(m, x[0] + i), _mm512_maskz_loadu_ps(m, y + i));
+    vy = _mm512_fmadd_ps(a1, _mm512_maskz_loadu_ps(m, x[1] + i), vy);
+    vy = _mm512_fmadd_ps(a2, _mm512_maskz_loadu_ps(m, x[2] + i), vy);
+    _mm512_mask_storeu_ps(y + i, m, _mm512_fmadd_ps(a3, _mm512_maskz_loadu_ps(m, x[3] + i), vy));
+  }
+}
+
+__attribute__((target("avx2,fma"))) static __m256 SigmoidVecAvx2(__m256 x) {
+  __m256 k, r, p, scale;
+  x = _mm256_min_ps(_mm256_max_ps(x, _mm256_set1_ps(-VEC_SIGMOID_CLAMP)), _mm256_set1_ps(VEC_SIGMOID_CLAMP));
+  k = _mm256_round_ps(_mm256_mul_ps(x, _mm256_set1_ps(-VEC_LOG2E)), _MM_FROUND_TO_NEAREST_INT | _MM_FROUND_NO_EXC);
+  r = _mm256_fnmadd_ps(k, _mm256_set1_ps(VEC_LN2_HI), _mm256_sub_ps(_mm256_setzero_ps(), x));
+  r = _mm256_fmadd_ps(k, _mm256_set1_ps(VEC_LN2_LO), r);
+  p = _mm256_fmadd_ps(_mm256_set1_ps(1 / 720.0f), r, _mm256_set1_ps(1 / 120.0f));
+  p = _mm256_fmadd_ps(p, r, _mm256_set1_ps(1 / 24.0f));
+  p = _mm256_fmadd_ps(p, r, _mm256_set1_ps(1 / 6.0f));
+  p = _mm256_fmadd_ps(p, r, _mm256_set1_ps(1 / 2.0f));
+  p = _mm256_fmadd_ps(p, r, _mm256_set1_ps(1));
+  p = _mm256_fmadd_ps(p, r, _mm256_set1_ps(1));
+  scale = _mm256_castsi256_ps(_mm256_slli_epi32(_mm256_add_epi32(_mm256_cvtps_epi32(k), _mm256_set1_epi32(127)), 23));
+  return _mm256_div_ps(_mm256_set1_ps(1), _mm256_fmadd_ps(p, scale, _mm256_set1_ps(1)));
+}
+
+__attribute__((target("avx2,fma"))) static void SigmoidAvx2(float *x, float *y, long long n) {
+  __m256i m;
+  long long i = 0;
+  for (; i + 8 <= n; i += 8) _mm256_storeu_ps(y + i, SigmoidVecAvx2(_mm256_loadu_ps(x + i)));
+  if (i < n) {
+    m = _mm256_cmpgt_epi32(_mm256_set1_epi32(n - i), _mm256_setr_epi32(0, 1, 2, 3, 4, 5, 6, 7));
+    _mm256_maskstore_ps(y + i, m, SigmoidVecAvx2(_mm256_maskload_ps(x + i, m)));
+  }
+}
+
+VEC_FIXED_SIZES(VEC_SGNS_KERNEL, Avx2, __attribute__((target("avx2,fma"))), 8)
+
+__attribute__((target("avx2,fma"))) static inline vec8 LoadBf16VecAvx2(const unsigned short *p) {
+  return (vec8)_mm256_slli_epi32(_mm256_cvtepu16_epi32(_mm_loadu_si128((const __m128i *)p)), 16);
+}
+
+__attribute__((target("avx2,fma"))) static inline void StoreBf16VecAvx2(unsigned short *p, vec8 x, vec8i r) {
+  __m256i v = _mm256_srli_epi32(_mm256_add_epi32((__m256i)x, (__m256i)r), 16);
+  _mm_storeu_si128((__m128i *)p, _mm_packus_epi32(_mm256_castsi256_si128(v), _mm256_extracti128_si256(v, 1)));
+}
+
+VEC_BF16_KERNELS(Avx2, __attribute__((target("avx2,fma"))), 8)
+VEC_BF16_FIXED_SIZES(VEC_SGNS_BF16_KERNEL, Avx2, __attribute__((target("avx2,fma"))), 8)
+
+__attribute__((target("avx2,fma"))) static void LoadBf16Avx2(const unsigned short *x, float *y, long long n) {
+  long long i = 0;
+  for (; i + 8 <= n; i += 8)
+    _mm256_storeu_ps(y + i, _mm256_castsi256_ps(_mm256_slli_epi32(_mm256_cvtepu16_epi32(_mm_loadu_si128((const __m128i *)(x + i))), 16)));
+  for (; i < n; i++) y[i] = VecBf16ToFloat(x[i]);
+}
+
+// The rounding bits come from a xorshift generator per lane, the lanes seeded from one step of *seed
+__attribute__((target("avx2,fma"))) static void StoreBf16Avx2(const float *x, unsigned short *y, long long n, unsigned long long *seed) {
+  __m256i s, v;
+  long long i = 0;
+  *seed = *seed * 25214903917ULL + 11;
+  s = _mm256_mullo_epi32(_mm256_set1_epi32((int)(*seed >> 16) | 1), _mm256_loadu_si256((const __m256i *)vec_bf16_lane_seeds));
+  for (; i + 8 <= n; i += 8) {
+    s = _mm256_xor_si256(s, _mm256_slli_epi32(s, 13));
+    s = _mm256_xor_si256(s, _mm256_srli_epi32(s, 17));
+    s = _mm256_xor_si256(s, _mm256_slli_epi32(s, 5));
+    v = _mm256_add_epi32(_mm256_castps_si256(_mm256_loadu_ps(x + i)), _mm256_and_si256(s, _mm256_set1_epi32(0xffff)));
+    v = _mm256_srli_epi32(v, 16);
+    // pack keeps the 128-bit halves apart: gather the two low quarters
+    v = _mm256_permute4x64_epi64(_mm256_packus_epi32(v, v), 0x08);
+    _mm_storeu_si128((__m128i *)(y + i), _mm256_castsi256_si128(v));
+  }
+  for (; i < n; i++) {
+    *seed = *seed * 25214903917ULL + 11;
+    y[i] = VecFloatToBf16(x[i], (unsigned int)(*seed >> 16));
+  }
+}
+__attribute__((target("avx512f"))) static void SigmoidAvx512(float *x, float *y, long long n) {
+  __m512 v, k, r, p, scale;
+  __mmask16 m;
+  long long i;
+  for (i = 0; i < n; i += 16) {
+    m = n - i >= 16 ? 0xffff : (__mmask16)((1u << (n - i)) - 1);
+    v = _mm512_maskz_loadu_ps(m, x + i);
+    v = _mm512_min_ps(_mm512_max_ps(v, _mm512_set1_ps(-VEC_SIGMOID_CLAMP)), _mm512_set1_ps(VEC_SIGMOID_CLAMP));
+    k = _mm512_roundscale_ps(_mm512_mul_ps(v, _mm512_set1_ps(-VEC_LOG2E)), _MM_FROUND_TO_NEAREST_INT | _MM_FROUND_NO_EXC);
+    r = _mm512_fnmadd_ps(k, _mm512_set1_ps(VEC_LN2_HI), _mm512_sub_ps(_mm512_setzero_ps(), v));
+    r = _mm512_fmadd_ps(k, _mm512_set1_ps(VEC_LN2_LO), r);
+    p = _mm512_fmadd_ps(_mm512_set1_ps(1 / 720.0f), r, _mm512_set1_ps(1 / 120.0f));
+    p = _mm512_fmadd_ps(p, r, _mm512_set1_ps(1 / 24.0f));
+    p = _mm512_fmadd_ps(p, r, _mm512_set1_ps(1 / 6.0f));
+    p = _mm512_fmadd_ps(p, r, _mm512_set1_ps(1 / 2.0f));
+    p = _mm512_fmadd_ps(p, r, _mm512_set1_ps(1));
+    p = _mm512_fmadd_ps(p, r, _mm512_set1_ps(1));
+    scale = _mm512_castsi512_ps(_mm512_slli_epi32(_mm512_add_epi32(_mm512_cvtps_epi32(k), _mm512_set1_epi32(127)), 23));
+    _mm512_mask_storeu_ps(y + i, m, _mm512_div_ps(_mm512_set1_ps(1), _mm512_fmadd_ps(p, scale, _mm512_set1_ps(1))));
+  }
+}
+
+VEC_FIXED_SIZES(VEC_SGNS_KERNEL, Avx512, __attribute__((target("avx512f"))), 16)
+
+__attribute__((target("avx512f"))) static inline vec16 LoadBf16VecAvx512(const unsigned short *p) {
+  return (vec16)_mm512_slli_epi32(_mm512_cvtepu16_epi32(_mm256_loadu_si256((const __m256i *)p)), 16);
+}
+
+__attribute__((target("avx512f"))) static inline void StoreBf16VecAvx512(unsigned short *p, vec16 x, vec16i r) {
+  _mm256_storeu_si256((__m256i *)p, _mm512_cvtepi32_epi16(_mm512_srli_epi32(_mm512_add_epi32((__m512i)x, (__m512i)r), 16)));
+}
+
+VEC_BF16_KERNELS(Avx512, __attribute__((target("avx512f"))), 16)
+VEC_BF16_FIXED_SIZES(VEC_SGNS_BF16_KERNEL, Avx512, __attribute__((target("avx512f"))), 16)
+
+__attribute__((target("avx512f"))) static void LoadBf16Avx512(const unsigned short *x, float *y, long long n) {
+  long long i = 0;
+  for (; i + 16 <= n; i += 16)
+    _mm512_storeu_ps(y + i, _mm512_castsi512_ps(_mm512_slli_epi32(_mm512_cvtepu16_epi32(_mm256_loadu_si256((const __m256i *)(x + i))), 16)));
+  for (; i < n; i++) y[i] = VecBf16ToFloat(x[i]);
+}
+
+__attribute__((target("avx512f"))) static void StoreBf16Avx512(const float *x, unsigned short *y, long long n, unsigned long long *seed) {
+  __m512i s, v;
+  __mmask16 m;
+  long long i;
+  *seed = *seed * 25214903917ULL + 11;
+  s = _mm512_mullo_epi32(_mm512_set1_epi32((int)(*seed >> 16) | 1), _mm512_loadu_si512(vec_bf16_lane_seeds));
+  for (i = 0; i < n; i += 16) {
+    m = n - i >= 16 ? 0xffff : (__mmask16)((1u << (n - i)) - 1);
+    s = _mm512_xor_si512(s, _mm512_slli_epi32(s, 13));
+    s = _mm512_xor_si512(s, _mm512_srli_epi32(s, 17));
+    s = _mm512_xor_si512(s, _mm512_slli_epi32(s, 5));
+    v = _mm512_add_epi32(_mm512_castps_si512(_mm512_maskz_loadu_ps(m, x + i)), _mm512_and_si512(s, _mm512_set1_epi32(0xffff)));
+    _mm512_mask_cvtepi32_storeu_epi16(y + i, m, _mm512_srli_epi32(v, 16));
+  }
+}
+#endif
+
+// Fills k with the widest kernels the CPU runs for rows of row_size floats; level caps the choice
+// (0: scalar, 1: AVX2, 2: AVX-512)
+static inline void SelectVecKernels(struct vec_kernels *k, int level, long long row_size) {
+  k->name = "scalar";
+  k->dot = DotScalar;
+  k->axpy = AxpyScalar;
+  k->axpy2 = Axpy2Scalar;
+  k->dot4 = Dot4Scalar;
+  k->axpy4 = Axpy4Scalar;
+  k->sigmoid = SigmoidScalar;
+  k->load_bf16 = LoadBf16Scalar;
+  k->store_bf16 = StoreBf16Scalar;
+  k->dot_bf16 = DotBf16Scalar;
+  k->axpy_bf16 = AxpyBf16Scalar;
+  k->axpy2_bf16 = Axpy2Bf16Scalar;
+  k->sgns = NULL;
+  k->sgns_bf16 = NULL;
+  switch (row_size) { VEC_FIXED_SIZES(VEC_SGNS_CASE, Scalar, , 4) }
+  switch (row_size) { VEC_BF16_FIXED_SIZES(VEC_SGNS_BF16_CASE, Scalar, , 4) }
+#if defined(__x86_64__) || defined(__i386__)
+  __builtin_cpu_init();
+  if (level >= 2 && __builtin_cpu_supports("avx512f")) {
+    k->name = "avx512";
+    k->dot = DotAvx512;
+    k->axpy = AxpyAvx512;
+    k->axpy2 = Axpy2Avx512;
+    k->dot4 = Dot4Avx512;
+    k->axpy4 = Axpy4Avx512;
+    k->sigmoid = SigmoidAvx512;
+    k->load_bf16 = LoadBf16Avx512;
+    k->store_bf16 = StoreBf16Avx512;
+    k->dot_bf16 = DotBf16Avx512;
+    k->axpy_bf16 = AxpyBf16Avx512;
+    k->axpy2_bf16 = Axpy2Bf16Avx512;
+    switch (row_size) { VEC_FIXED_SIZES(VEC_SGNS_CASE, Avx512, , 16) }
+    switch (row_size) { VEC_BF16_FIXED_SIZES(VEC_SGNS_BF16_CASE, Avx512, , 16) }
+  } else if (level >= 1 && __builtin_cpu_supports("avx2") && __builtin_cpu_supports("fma")) {
+    k->name = "avx2";
+    k->dot = DotAvx2;
+    k->axpy = AxpyAvx2;
+    k->axpy2 = Axpy2Avx2;
+    k->dot4 = Dot4Avx2;
+    k->axpy4 = Axpy4Avx2;
+    k->sigmoid = SigmoidAvx2;
+    k->load_bf16 = LoadBf16Avx2;
+    k->store_bf16 = StoreBf16Avx2;
+    k->dot_bf16 = DotBf16Avx2;
+    k->axpy_bf16 = AxpyBf16Avx2;
+    k->axpy2_bf16 = Axpy2Bf16Avx2;
+    switch (row_size) { VEC_FIXED_SIZES(VEC_SGNS_CASE, Avx2, , 8) }
+    switch (row_size) { VEC_BF16_FIXED_SIZES(VEC_SGNS_BF16_CASE, Avx2, , 8) }
+  }
+#endif
+}
+
+#endif
@@ -17,6 +17,7 @@
 #include <string.h>
 #include <math.h>
 #include <pthread.h>
+#include "wordhash.h"
 
 #define MAX_STRING 60
 
@@ -123,10 +124,7 @@ int ReadWord(char *word, FILE *fin) {
 
 // Returns hash value of a word
 int GetWordHash(const char *word) {
-  unsigned long long a, hash = 1;
-  for (a = 0; a < strlen(word); a++) hash = hash * 257 + word[a];
-  hash = hash % vocab_hash_size;
-  return hash;
+  return WordHash(word, strlen(word)) % vocab_hash_size;
 }
 
 // Returns position of a word in the vocabulary; if the word is not found, returns -1
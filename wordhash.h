@@ -0,0 +1,48 @@
+//  Word hashing shared by bivec, word2phrase and distance.
+//
+//  WordHash reads a word 8 bytes at a time (nothing calls strlen per byte, and the length is
+//  only mixed in at the end) and finishes with a 64-bit avalanche, so both its low bits (hash table
+//  buckets) and high bits are well mixed.
+
+#ifndef WORDHASH_H
+#define WORDHASH_H
+
+#include <string.h>
+
+static inline unsigned long long WordHashMix(unsigned long long hash) {
+  hash ^= hash >> 33;
+  hash *= 0xff51afd7ed558ccdULL;
+  hash ^= hash >> 33;
+  hash *= 0xc4ceb9fe1a85ec53ULL;
+  hash ^= hash >> 33;
+  return hash;
+}
+
+// A word is hashed as WORD_HASH_SEED, one WordHashBlock per full 8 bytes, then WordHashEnd with
+// the zero-padded tail and the length, so a reader can hash the word while it scans it
+#define WORD_HASH_SEED 0x9e3779b97f4a7c15ULL
+
+static inline unsigned long long WordHashBlock(unsigned long long hash, unsigned long long block) {
+  hash = (hash ^ block) * 0x94d049bb133111ebULL;
+  return hash ^ (hash >> 29);
+}
+
+static inline unsigned long long WordHashEnd(unsigned long long hash, unsigned long long tail, long long len) {
+  if (len & 7) hash = WordHashBlock(hash, tail);
+  return WordHashMix(hash ^ ((unsigned long long)len * 0xbf58476d1ce4e5b9ULL));
+}
+
+// Returns the hash of the len bytes of word
+static inline unsigned long long WordHash(const char *word, long long len) {
+  unsigned long long hash = WORD_HASH_SEED, block = 0;
+  long long a;
+  for (a = 0; a + 8 <= len; a += 8) {
+    memcpy(&block, word + a, 8);
+    hash = WordHashBlock(hash, block);
+  }
+  block = 0;
+  memcpy(&block, word + a, len - a);
+  return WordHashEnd(hash, block, len);
+}
+
+#endif